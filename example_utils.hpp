@@ -19,6 +19,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <functional>
 #include <iostream>
@@ -27,6 +28,10 @@
 #include <stdlib.h>
 #include <initializer_list>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "dnnl.hpp"
 #include "dnnl_debug.h"
 
@@ -164,6 +169,54 @@ inline dnnl::memory::dim product(const dnnl::memory::dims &dims) {
             std::multiplies<dnnl::memory::dim>());
 }
 
+// Copy with non-temporal stores: a one-shot transfer of a large tensor does
+// not need to go through (and evict) the caches
+inline void stream_copy(void *dst, const void *src, size_t size) {
+    uint8_t *d = static_cast<uint8_t *>(dst);
+    const uint8_t *s = static_cast<const uint8_t *>(src);
+#ifdef __SSE2__
+    // scalar head up to 16-byte alignment of dst, streamed body, scalar tail
+    size_t head = (16 - (reinterpret_cast<uintptr_t>(d) & 15)) & 15;
+    if (head > size) head = size;
+    std::memcpy(d, s, head);
+    size_t i = head;
+    for (; i + 64 <= size; i += 64) {
+        __m128i x0 = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i x1 = _mm_loadu_si128((const __m128i *)(s + i + 16));
+        __m128i x2 = _mm_loadu_si128((const __m128i *)(s + i + 32));
+        __m128i x3 = _mm_loadu_si128((const __m128i *)(s + i + 48));
+        _mm_stream_si128((__m128i *)(d + i), x0);
+        _mm_stream_si128((__m128i *)(d + i + 16), x1);
+        _mm_stream_si128((__m128i *)(d + i + 32), x2);
+        _mm_stream_si128((__m128i *)(d + i + 48), x3);
+    }
+    std::memcpy(d + i, s + i, size - i);
+    _mm_sfence();
+#else
+    std::memcpy(d, s, size);
+#endif
+}
+
+// Below this size a copy stays on one thread with regular stores
+const size_t parallel_copy_threshold = (size_t)4 << 20;
+
+// memcpy for host buffers: multithreaded streaming copy for large sizes
+inline void parallel_copy(void *dst, const void *src, size_t size) {
+    if (size < parallel_copy_threshold) {
+        std::memcpy(dst, src, size);
+        return;
+    }
+    const size_t chunk = (size_t)1 << 20;
+    const long nchunks = (long)((size + chunk - 1) / chunk);
+    PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+    for (long i = 0; i < nchunks; ++i) {
+        size_t offset = i * chunk;
+        stream_copy(static_cast<uint8_t *>(dst) + offset,
+                static_cast<const uint8_t *>(src) + offset,
+                std::min(chunk, size - offset));
+    }
+}
+
 // Read from memory, write to handle
 inline void read_from_dnnl_memory(void *handle, dnnl::memory &mem) {
     dnnl::engine eng = mem.get_engine();
@@ -215,8 +268,7 @@ inline void read_from_dnnl_memory(void *handle, dnnl::memory &mem) {
     if (eng.get_kind() == dnnl::engine::kind::cpu) {
         uint8_t *src = static_cast<uint8_t *>(mem.get_data_handle());
         if (!src) throw std::runtime_error("get_data_handle returned nullptr.");
-        for (size_t i = 0; i < size; ++i)
-            ((uint8_t *)handle)[i] = src[i];
+        parallel_copy(handle, src, size);
         return;
     }
 
@@ -274,12 +326,63 @@ inline void write_to_dnnl_memory(void *handle, dnnl::memory &mem) {
     if (eng.get_kind() == dnnl::engine::kind::cpu) {
         uint8_t *dst = static_cast<uint8_t *>(mem.get_data_handle());
         if (!dst) throw std::runtime_error("get_data_handle returned nullptr.");
-        for (size_t i = 0; i < size; ++i)
-            dst[i] = ((uint8_t *)handle)[i];
+        parallel_copy(dst, handle, size);
         return;
     }
 
     assert(!"not expected");
 }
 
+// Strided transfers between a packed handle and memory: `rows` rows of
+// `row_size` bytes, the first one at byte `offset` of the memory and the
+// next ones `stride` bytes apart. One row with offset i * sample size reads
+// or writes a single sample of a plain-layout batch.
+// The memory is mapped, which is free on CPU engines (the handle itself is
+// used) and falls back to a device map/unmap elsewhere.
+inline void read_from_dnnl_memory(void *handle, dnnl::memory &mem,
+        size_t offset, size_t row_size, size_t rows = 1, size_t stride = 0) {
+    if (!handle) throw std::runtime_error("handle is nullptr.");
+    if (rows == 0) return;
+    if (rows > 1 && stride < row_size)
+        throw std::runtime_error("stride is smaller than a row.");
+    if (offset + (rows - 1) * stride + row_size > mem.get_desc().get_size())
+        throw std::runtime_error("range is out of the memory bounds.");
+
+    uint8_t *src = mem.map_data<uint8_t>();
+    if (!src) throw std::runtime_error("map_data returned nullptr.");
+    if (rows == 1 || stride == row_size)
+        parallel_copy(handle, src + offset, rows * row_size);
+    else {
+        PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+        for (long r = 0; r < (long)rows; ++r)
+            std::memcpy(static_cast<uint8_t *>(handle) + r * row_size,
+                    src + offset + r * stride, row_size);
+    }
+    mem.unmap_data(src);
+}
+
+inline void write_to_dnnl_memory(const void *handle, dnnl::memory &mem,
+        size_t offset, size_t row_size, size_t rows = 1, size_t stride = 0) {
+    if (!handle) throw std::runtime_error("handle is nullptr.");
+    if (rows == 0) return;
+    if (rows > 1 && stride < row_size)
+        throw std::runtime_error("stride is smaller than a row.");
+    if (offset + (rows - 1) * stride + row_size > mem.get_desc().get_size())
+        throw std::runtime_error("range is out of the memory bounds.");
+
+    uint8_t *dst = mem.map_data<uint8_t>();
+    if (!dst) throw std::runtime_error("map_data returned nullptr.");
+    if (rows == 1 || stride == row_size)
+        parallel_copy(dst + offset, handle, rows * row_size);
+    else {
+        PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+        for (long r = 0; r < (long)rows; ++r)
+            std::memcpy(dst + offset + r * stride,
+                    static_cast<const uint8_t *>(handle) + r * row_size,
+                    row_size);
+    }
+    mem.unmap_data(dst);
+}
+
+
 #endif
@@ -1,284 +1,798 @@
+// feature switches, ahead of the includes: my_layers.hpp and my_trace.hpp
+// read some of them
+// #define DEBUG
+#define MODIFY
+// #define TRACE  // timeline of every primitive
+// #define USEREORDER
+// #define USEARENA  // carve all tensors from one huge-page NUMA-local arena
+// #define FC_LOWRANK  // report on low-rank fc1/fc2 after training
+// #define GAP_HEAD  // global average pooling + FC10 instead of pool5, fc1-fc4
+// #define NATIVE_INPUT  // no cv::resize, pad 28x28 to 32x32 and replicate
+// #define ASYNC_EVAL  // evaluate on its own cores while training goes on
+// #define PERF_COUNTERS  // hardware counters around every fwd/bwd primitive
+// #define GRAY_INPUT  // conv1 over the one grayscale plane, not 3 copies
+// #define DETERMINISTIC  // bitwise reproducible across thread counts
+// #define SHARDED_DATA  // stream the training set from shards on disk
+// #define DEPTH_FIRST  // report on banded conv1-pool2 inference after training
+// #define ASYNC_SAVE  // save the weights from a background thread
+// #define GEMV_HEAD  // report batch-1 latency with prepacked GEMV fc1-fc4
+// #define RESULT_CACHE  // serve repeated test images through a result cache
+// #define POOL_RELU_BACK  // conv relu backward on the pooled-size gradient
+// #define AUGMENT  // random shift, flip and brightness of training samples
+// #define METRICS  // serve Prometheus metrics on METRICS_ENDPOINT
+// #define THREADPOOL  // one work-stealing pool for oneDNN, batches and eval;
+                       // oneDNN built with DNNL_CPU_RUNTIME=THREADPOOL
+
 #include <assert.h>
 #include <math.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <numeric>
+#include <thread>
 #include <iostream>
+#include <sstream>
 // export CPLUS_INCLUDE_PATH=/home/cauchy/github/mnist-fashion/include:$CPLUS_INCLUDE_PATH
 #include "mnist/mnist_reader.hpp"
 // export CPLUS_INCLUDE_PATH=/usr/local/include/opencv4:$CPLUS_INCLUDE_PATH
 #include <opencv2/opencv.hpp>
+#include "my_augment.hpp"
+#include "my_cache.hpp"
+#include "my_eval.hpp"
+#include "my_fused.hpp"
+#include "my_gemv.hpp"
 #include "my_layers.hpp"
+#include "my_metrics.hpp"
+#include "my_perf.hpp"
+#include "my_save.hpp"
+#include "my_shapes.hpp"
+#include "my_shards.hpp"
+#include "my_threadpool.hpp"
+#include "my_trace.hpp"
+#include "my_tune.hpp"
 
 using namespace dnnl;
 
-// #define DEBUG
-#define MODIFY
-// #define USEREORDER
+#if defined(FC_LOWRANK) && defined(GAP_HEAD)
+#error "FC_LOWRANK compresses fc1/fc2, which GAP_HEAD removes"
+#endif
+#if defined(GEMV_HEAD) && defined(GAP_HEAD)
+#error "GEMV_HEAD replaces fc1-fc4, which GAP_HEAD removes"
+#endif
+#if defined(THREADPOOL) && defined(DETERMINISTIC)
+#error "DETERMINISTIC fixes OpenMP team sizes, which THREADPOOL does not use"
+#endif
+#if defined(THREADPOOL) && defined(ASYNC_EVAL)
+#error "THREADPOOL runs evaluation as a low priority task of the one pool"
+#endif
+#ifdef THREADPOOL
+#include "oneapi/dnnl/dnnl_threadpool.hpp"
+#endif
 
 const std::string MNIST_DATA_LOCATION =
     "/home/cauchy/github/mnist-fashion/data/mnist";
 const std::string MNIST_FASHION_DATA_LOCATION =
     "/home/cauchy/github/mnist-fashion/data/fashion";
-const memory::dim N = 16;  // batch_size
+// batch_size, the default of train_batch in TUNED_CONFIG
+memory::dim N = 16;
+// input resolution, a multiple of 32 so the five poolings divide it; the
+// spatial sizes in the layer comments below are for IMG = 224
+#ifdef NATIVE_INPUT
+const memory::dim IMG = 32;
+#else
+const memory::dim IMG = 224;  // 28x28 upsampled by 8
+#endif
+static_assert(IMG % 32 == 0, "IMG must be a multiple of 32");
+// input channels: the grayscale plane is replicated into 3 for the
+// ImageNet-shaped conv1. Since the copies are identical, conv1 over them
+// equals a 1-channel conv1 whose weights are the sum of the 3 slices, which
+// is what GRAY_INPUT trains (He-normal over fan_in 9 has the variance of
+// that sum), with a third of the input traffic and FLOPs
+#ifdef GRAY_INPUT
+const memory::dim IN_C = 1;
+#else
+const memory::dim IN_C = 3;
+#endif
+// training augmentation under AUGMENT: shift by up to AUG_SHIFT pixels of
+// the IMG x IMG input, flip with probability 1/2, brightness scaled by
+// up to +-AUG_BRIGHTNESS
+const int AUG_SHIFT = IMG / 8;
+const float AUG_BRIGHTNESS = 0.2f;
+// gradient accumulation: ACC_STEPS micro-batches of N samples are summed
+// before one weights update, so the effective batch is N * ACC_STEPS
+const int ACC_STEPS = 16;
+const int UPDATE_STEPS = 2;
+const float LEARNING_RATE = 0.01f;
+// activation checkpointing per conv block: a checkpointed block keeps only
+// its output (after pooling) and recomputes conv/relu/pooling in backward
+const bool CHECKPOINT_BLOCK[5] = {false, false, false, false, false};
+// convolution algorithm of conv1..conv8; all are 3x3 stride 1 where
+// winograd F(4x4, 3x3) applies, automatic times it against direct
+const conv_algo CONV_ALGO[8] = {conv_algo::direct, conv_algo::direct,
+                                conv_algo::direct, conv_algo::direct,
+                                conv_algo::direct, conv_algo::direct,
+                                conv_algo::direct, conv_algo::direct};
+// team of every convolution and inner product under DETERMINISTIC
+const int DETERMINISTIC_THREADS = 4;
+// virtual reservation of the arena, only touched pages take memory
+const size_t ARENA_BYTES = (size_t)64 << 30;
+// test set evaluation: batch size (the default of batch in TUNED_CONFIG),
+// steps between two evaluations and cores set aside for it under ASYNC_EVAL
+memory::dim EVAL_N = 32;
+const int EVAL_EVERY = 1;
+const int EVAL_CORES = 4;
+// threads of the pool under THREADPOOL, 0 for every core
+const int POOL_THREADS = 0;
+// images read from the dataset, 0 for the whole set
+const int TRAIN_LIMIT = 240;
+const int TEST_LIMIT = 0;
+// training shards under SHARDED_DATA, written from the loaded training set
+// when SHARD_DIR has no index yet; the window is drawn from at random, at
+// most SHARD_PREFETCH shards are read ahead
+const char* SHARD_DIR = "/tmp/vgg11_shards";
+const size_t SHARD_IMAGES = 4096;
+const size_t SHARD_WINDOW = 8192;
+const size_t SHARD_PREFETCH = 2;
+// runtime configuration read at startup, written by `autotune [slo_ms]`,
+// which sweeps the inference graph over batches, threads, instances and
+// layouts for TUNE_SECONDS each and keeps the fastest with p99 <= the SLO
+const char* TUNED_CONFIG = "vgg11.cfg";
+const double TUNE_SLO_MS = 100;
+const double TUNE_SECONDS = 0.5;
+const std::vector<memory::dim> TUNE_BATCHES = {1, 2, 4, 8, 16, 32, 64};
+const std::vector<std::string> TUNE_LAYOUTS = {"any", "nhwc"};
+const memory::dim TUNE_MAX_IN_FLIGHT = 256;
+// weights checkpoint under ASYNC_SAVE, loaded at startup when it exists and
+// saved after every SAVE_EVERY steps
+const char* SAVE_PATH = "vgg11_weights.bin";
+const int SAVE_EVERY = 1;
+// serving under RESULT_CACHE: CACHE_REQUESTS requests drawn at random from
+// the first CACHE_DISTINCT test images, through a cache of CACHE_ENTRIES
+const size_t CACHE_ENTRIES = 1024;
+const size_t CACHE_REQUESTS = 4096;
+const size_t CACHE_DISTINCT = 1536;
+// "host:port" or "unix:<path>" of the metrics under METRICS
+const char* METRICS_ENDPOINT = "127.0.0.1:9464";
+// ranks of the compressed fc1 {4096, 25088} and fc2 {4096, 4096}
+const memory::dim FC1_RANK = 256;
+const memory::dim FC2_RANK = 256;
+
+// VGG11 per image: every layer states the shape it expects and
+// shapes::Net checks at compile time that the previous layer produces it
+namespace vgg11 {
+using shapes::Flat;
+using shapes::Shape;
+using conv1 = shapes::Conv<Shape<IN_C, IMG, IMG>, 64, 3, 1, 1>;
+using pool1 = shapes::MaxPool<Shape<64, IMG, IMG>, 2, 2>;
+using conv2 = shapes::Conv<Shape<64, IMG / 2, IMG / 2>, 128, 3, 1, 1>;
+using pool2 = shapes::MaxPool<Shape<128, IMG / 2, IMG / 2>, 2, 2>;
+using conv3 = shapes::Conv<Shape<128, IMG / 4, IMG / 4>, 256, 3, 1, 1>;
+using conv4 = shapes::Conv<Shape<256, IMG / 4, IMG / 4>, 256, 3, 1, 1>;
+using pool3 = shapes::MaxPool<Shape<256, IMG / 4, IMG / 4>, 2, 2>;
+using conv5 = shapes::Conv<Shape<256, IMG / 8, IMG / 8>, 512, 3, 1, 1>;
+using conv6 = shapes::Conv<Shape<512, IMG / 8, IMG / 8>, 512, 3, 1, 1>;
+using pool4 = shapes::MaxPool<Shape<512, IMG / 8, IMG / 8>, 2, 2>;
+using conv7 = shapes::Conv<Shape<512, IMG / 16, IMG / 16>, 512, 3, 1, 1>;
+using conv8 = shapes::Conv<Shape<512, IMG / 16, IMG / 16>, 512, 3, 1, 1>;
+#ifdef GAP_HEAD
+using gap = shapes::GlobalPool<Shape<512, IMG / 16, IMG / 16>>;
+using fc = shapes::Dense<Shape<512, 1, 1>, 10>;
+using net = shapes::Net<conv1, pool1, conv2, pool2, conv3, conv4, pool3, conv5,
+                        conv6, pool4, conv7, conv8, gap, fc>;
+#else
+using pool5 = shapes::MaxPool<Shape<512, IMG / 16, IMG / 16>, 2, 2>;
+using fc1 = shapes::Dense<Shape<512, IMG / 32, IMG / 32>, 4096>;
+using fc2 = shapes::Dense<Flat<4096>, 4096>;
+using fc3 = shapes::Dense<Flat<4096>, 1000>;
+using fc4 = shapes::Dense<Flat<1000>, 10>;
+using net = shapes::Net<conv1, pool1, conv2, pool2, conv3, conv4, pool3, conv5,
+                        conv6, pool4, conv7, conv8, pool5, fc1,
+                        shapes::Relu<Flat<4096>>, fc2, shapes::Relu<Flat<4096>>,
+                        fc3, shapes::Relu<Flat<1000>>, fc4>;
+#endif
+static_assert(std::is_same<net::dst, Flat<10>>::value,
+              "VGG11 ends in the 10 classes");
+}  // namespace vgg11
 
 // get fasion-mnist
 mnist::MNIST_dataset<std::vector, std::vector<uint8_t>, uint8_t> dataset =
     mnist::read_dataset<std::vector, std::vector, uint8_t, uint8_t>(
-        MNIST_FASHION_DATA_LOCATION, 240, 40);
+        MNIST_FASHION_DATA_LOCATION, TRAIN_LIMIT, TEST_LIMIT);
 memory::dim train_t = 0;
+// training samples drawn so far, the counter of the augmentation draws
+uint64_t train_drawn = 0;
 memory::dim test_t = 0;
 
 using tag = memory::format_tag;
 using dt = memory::data_type;
 
-void VGG11(engine::kind engine_kind) {
-
-    auto eng = engine(engine_kind, 0);
-    stream s(eng);
+// write the 28x28 picture `pic` with label `ans` as sample i of net_src
+// (NCHW) / net_dst, transformed by aug; net_dst row i must be zero
+void write_sample(const uint8_t* pic, size_t ans, size_t i, float* net_src,
+                  std::vector<float>& net_dst,
+                  const augment::Params& aug = augment::Params()) {
+    const int IS = IMG * IMG;    // input size
+    size_t fpi = i * IN_C * IS;  // first pixel index
+
+    // the IMG x IMG gray plane, normalized (divided by 255) and replicated
+    // into the IN_C channels by write_planes
+#ifdef NATIVE_INPUT
+    // (28, 28) -> (IMG, IMG): zero border of 2 to 32 x 32, then every
+    // pixel repeated IMG / 32 times
+    const memory::dim rep = IMG / 32;
+    uint8_t plane[IS];
+    for (memory::dim w = 0; w < IMG; ++w)
+        for (memory::dim h = 0; h < IMG; ++h) {
+            memory::dim y = w / rep - 2, x = h / rep - 2;
+            plane[w * IMG + h] =
+                (y >= 0 && y < 28 && x >= 0 && x < 28) ? pic[y * 28 + x] : 0;
+        }
+    augment::write_planes(plane, IMG, aug, net_src + fpi, IN_C);
+#else
+    // resize imagine (28, 28) -> (IMG, IMG); the channels are copies, one
+    // is resized
+    cv::Mat img(28, 28, CV_8U, const_cast<uint8_t*>(pic));
+    cv::Mat img_res;
+    cv::resize(img, img_res, cv::Size(IMG, IMG), 0, 0,
+               cv::INTER_LINEAR);  //INTER_CUBIC slower
+    augment::write_planes(img_res.data, IMG, aug, net_src + fpi, IN_C);
+#endif
 
-    // Vector of primitives and their execute arguments
-    std::vector<primitive> net_fwd, net_bwd;
-    std::vector<std::unordered_map<int, memory>> net_fwd_args, net_bwd_args;
+    // write data into dst
+    net_dst[i * 10 + ans] = 1;
+}
 
-    // Vectors of input data and expected output
-    std::vector<float> net_src(N * 3 * 224 * 224);
-    std::vector<float> net_dst(N * 10);  // 10 classes
+// transform of the next training sample, drawn + i, under AUGMENT
+augment::Params sample_augment(const uint64_t* drawn, memory::dim i) {
+#ifdef AUGMENT
+    if (drawn) return augment::draw(*drawn + i, AUG_SHIFT, AUG_BRIGHTNESS);
+#else
+    (void)drawn;
+    (void)i;
+#endif
+    return augment::Params();
+}
 
-    const int IS = 224 * 224;  // input size
+// f(i) for the samples i of a batch, on the default pool if there is one
+template <typename F>
+void for_each_sample(memory::dim batch, F f) {
+    WorkStealingPool* pool = default_pool();
+    if (!pool) {
+        for (memory::dim i = 0; i < batch; ++i)
+            f(i);
+        return;
+    }
+    int chunks = (int)std::min<memory::dim>(batch, pool->get_num_threads());
+    pool->parallel_for(chunks, [&](int c, int n) {
+        for (memory::dim i = c; i < batch; i += n)
+            f(i);
+    });
+}
 
-    for (size_t i = 0; i < N * 10; ++i)
+// read the next `batch` samples from position t of (images, labels) into
+// net_src (NCHW) / net_dst, wrapping around at the end of the set; with
+// drawn, they are augmented as training samples *drawn.. and it advances
+void read_batch(const std::vector<std::vector<uint8_t>>& images,
+                const std::vector<uint8_t>& labels, memory::dim& t,
+                float* net_src, std::vector<float>& net_dst,
+                memory::dim batch = N, uint64_t* drawn = nullptr) {
+    for (memory::dim i = 0; i < batch * 10; ++i)
         net_dst[i] = (float)0;
 
     // read src and dst data from fasion-mnist
-    for (size_t i = 0; i < N; ++i) {
-        std::vector<uint8_t> pic = dataset.training_images[train_t];
-        size_t ans = dataset.training_labels[train_t];
-        ++train_t;
+    std::vector<memory::dim> index(batch);
+    for (memory::dim i = 0; i < batch; ++i) {
+        if (t == (memory::dim)images.size())
+            t = 0;  // next epoch
+        index[i] = t++;
+    }
+    for_each_sample(batch, [&](memory::dim i) {
+        write_sample(images[index[i]].data(), labels[index[i]], i, net_src,
+                     net_dst, sample_augment(drawn, i));
+    });
+    if (drawn) *drawn += batch;
+}
 
-        // resize imagine (28, 28) -> (224, 224, 3)
-        cv::Mat img = cv::Mat(28, 28, CV_8U);
-        for (size_t i = 0; i < 28; ++i)
-            for (size_t j = 0; j < 28; ++j)
-                img.at<uint8_t>(i, j) = (uint8_t)pic[i * 28 + j];
+// the next `batch` samples of the shuffled shard stream
+void read_batch(ShardReader& shards, float* net_src,
+                std::vector<float>& net_dst, memory::dim batch = N,
+                uint64_t* drawn = nullptr) {
+    for (memory::dim i = 0; i < batch * 10; ++i)
+        net_dst[i] = (float)0;
 
-        cv::Mat img_rgb(28, 28, CV_8UC3);
-        cv::merge(std::vector<cv::Mat>{img, img, img}, img_rgb);
+    std::vector<uint8_t> pics(batch * 28 * 28), labels(batch);
+    for (memory::dim i = 0; i < batch; ++i)
+        labels[i] = shards.next(pics.data() + i * 28 * 28);
+    for_each_sample(batch, [&](memory::dim i) {
+        write_sample(pics.data() + i * 28 * 28, labels[i], i, net_src,
+                     net_dst, sample_augment(drawn, i));
+    });
+    if (drawn) *drawn += batch;
+}
 
-        cv::Mat img_res(224, 224, CV_8UC3);
-        cv::resize(img_rgb, img_res, cv::Size(), 8, 8,
-                   cv::INTER_LINEAR);  //INTER_CUBIC slower
+// image `pic` written as sample i of src_memory, without augmentation;
+// only that sample's bytes are transferred
+void load_sample(const uint8_t* pic, memory& src_memory, memory::dim i) {
+    std::vector<float> sample(IN_C * IMG * IMG), label(10);
+    write_sample(pic, 0, 0, sample.data(), label);
+    const size_t bytes = sample.size() * sizeof(float);
+    write_to_dnnl_memory(sample.data(), src_memory, i * bytes, bytes);
+}
 
-        auto data = img_res.data;
+// sorted wall times of run() over `runs` calls, after 3 warm-up calls
+template <typename F>
+std::vector<double> sorted_ms(F run, int runs) {
+    std::vector<double> ms;
+    for (int i = 0; i < runs + 3; ++i) {
+        auto t0 = std::chrono::steady_clock::now();
+        run();
+        if (i >= 3)
+            ms.push_back(std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - t0)
+                             .count());
+    }
+    std::sort(ms.begin(), ms.end());
+    return ms;
+}
 
-        int fpi = i * 224 * 224 * 3;  // first pixel index
+template <typename F>
+double median_ms(F run, int runs = 50) {
+    auto ms = sorted_ms(run, runs);
+    return ms[ms.size() / 2];
+}
 
-        // write data into src while doing normalization (divided by 255)
-        for (size_t c = 0; c < 3; ++c)  // channel
-            for (size_t w = 0; w < 224; ++w)
-                for (size_t h = 0; h < 224; ++h)
-                    net_src[fpi + c * IS + w * 224 + h] =
-                        ((float)(*(data + w * 672 + h * 3 + c))) / 255.0;
+// `cat` names the net in the trace; with counters or times, every
+// primitive is waited on and measured on its own
+void execute_net(stream& s, std::vector<primitive>& net,
+                 std::vector<std::unordered_map<int, memory>>& net_args,
+                 const char* cat = "net", LayerCounters* counters = nullptr,
+                 LayerTimes* times = nullptr) {
+    (void)cat;  // read by TRACE_SCOPE_INDEX only under TRACE
+    assert(net.size() == net_args.size() && "something is missing");
+    for (size_t i = 0; i < net.size(); ++i) {
+        TRACE_SCOPE_INDEX(trace_primitive_name(net.at(i)), cat, i);
+        ScopedThreads fixed(deterministic_threads() > 0 &&
+                                    is_reduction(net.at(i))
+                                ? deterministic_threads()
+                                : 0);
+        if (counters) counters->begin();
+        auto begin = std::chrono::steady_clock::now();
+        net.at(i).execute(s, net_args.at(i));
+        if (counters || times) s.wait();
+        if (counters) counters->end(i);
+        if (times) times->observe(i, begin);
+    }
+}
 
-        // write data into dst
-        net_dst[i * 10 + ans] = 1;
+// appends one vgg11:: layer type at a time to an inference graph, see
+// build_inference_net; shapes, kernels and strides all come from the types
+class InferenceBuilder {
+public:
+    InferenceBuilder(engine eng, std::vector<primitive>& net,
+                     std::vector<std::unordered_map<int, memory>>& net_args,
+                     std::vector<primitive>& net_snapshot,
+                     std::vector<std::unordered_map<int, memory>>&
+                         net_snapshot_args,
+                     const memory& src_memory, memory::dim batch,
+                     const std::vector<std::pair<memory, memory>>& params,
+                     bool head)
+        : eng_m(eng),
+          net_m(net),
+          net_args_m(net_args),
+          net_snapshot_m(net_snapshot),
+          net_snapshot_args_m(net_snapshot_args),
+          src_m(src_memory),
+          batch_m(batch),
+          params_m(params),
+          head_m(head) {}
+    InferenceBuilder(const InferenceBuilder&) = delete;
+
+    // dst of the last layer appended
+    memory dst_memory() const { return src_m; }
+
+    template <class Src, memory::dim OC, memory::dim K, memory::dim S,
+              memory::dim P>
+    void operator()(shapes::Conv<Src, OC, K, S, P>) {
+        using L = shapes::Conv<Src, OC, K, S, P>;
+        Conv2DwithReLu conv(eng_m, net_m, net_args_m, src_m,
+                            L::dst_dims(batch_m), L::strides(), L::padding(),
+                            negative_slope, weights(), bias(),
+                            CONV_ALGO[convs_m++]);
+        conv.snapshot(net_snapshot_m, net_snapshot_args_m);
+        src_m = conv.dst_memory();
+        ++weighted_m;
+    }
+    template <class Src, memory::dim K, memory::dim S>
+    void operator()(shapes::MaxPool<Src, K, S>) {
+        using L = shapes::MaxPool<Src, K, S>;
+        MaxPooling pool(eng_m, net_m, net_args_m, src_m, L::kernel(),
+                        L::dst_dims(batch_m), L::strides(), L::padding(),
+                        false);
+        src_m = pool.dst_memory();
+    }
+    // the head: global pooling, fc layers and their relus
+    template <class Src>
+    void operator()(shapes::GlobalPool<Src>) {
+        if (!head_m) return;
+        GlobalAvgPooling gap(eng_m, net_m, net_args_m, src_m,
+                             Src::dims(batch_m));
+        src_m = gap.dst_memory();
+    }
+    template <class Src, memory::dim O>
+    void operator()(shapes::Dense<Src, O>) {
+        if (!head_m) return;
+        Dense fc(eng_m, net_m, net_args_m, src_m,
+                 shapes::Dense<Src, O>::dst_dims(batch_m), weights(), bias());
+        fc.snapshot(net_snapshot_m, net_snapshot_args_m);
+        src_m = fc.dst_memory();
+        ++weighted_m;
+    }
+    template <class Src>
+    void operator()(shapes::Relu<Src>) {
+        if (!head_m) return;
+        ReLU relu(eng_m, net_m, net_args_m, src_m, negative_slope);
+        src_m = relu.dst_memory();
     }
 
+private:
+    const memory& weights() const { return params_m[2 * weighted_m].first; }
+    const memory& bias() const { return params_m[2 * weighted_m + 1].first; }
+
+    const float negative_slope = 0.0f;
+    engine eng_m;
+    std::vector<primitive>& net_m;
+    std::vector<std::unordered_map<int, memory>>& net_args_m;
+    std::vector<primitive>& net_snapshot_m;
+    std::vector<std::unordered_map<int, memory>>& net_snapshot_args_m;
+    memory src_m;
+    memory::dim batch_m;
+    const std::vector<std::pair<memory, memory>>& params_m;
+    bool head_m;
+    size_t weighted_m = 0;  // layers with weights so far, index into params
+    int convs_m = 0;
+};
+
+// inference graph of VGG11 (the vgg11::net layers) over `batch` images in
+// src_memory, built from the (weights, diff) pairs of params in layer
+// order; net_snapshot copies the trained weights into it. Returns the
+// softmax dst, or without the head the dst of the last pooling
+memory build_inference_net(
+    engine eng, std::vector<primitive>& net,
+    std::vector<std::unordered_map<int, memory>>& net_args,
+    std::vector<primitive>& net_snapshot,
+    std::vector<std::unordered_map<int, memory>>& net_snapshot_args,
+    const memory& src_memory, memory::dim batch,
+    const std::vector<std::pair<memory, memory>>& params, bool head = true) {
+    InferenceBuilder builder(eng, net, net_args, net_snapshot,
+                             net_snapshot_args, src_memory, batch, params,
+                             head);
+    vgg11::net::for_each_layer(builder);
+    memory src = builder.dst_memory();
+    if (!head) return src;
+
+    auto softmax_desc = softmax_forward::desc(prop_kind::forward_inference,
+                                              src.get_desc(), 1);
+    auto softmax_pd = softmax_forward::primitive_desc(softmax_desc, eng);
+    auto softmax_dst_memory = make_memory(softmax_pd.dst_desc(), eng);
+    net.push_back(softmax_forward(softmax_pd));
+    net_args.push_back(
+        {{DNNL_ARG_SRC, src}, {DNNL_ARG_DST, softmax_dst_memory}});
+    return softmax_dst_memory;
+}
+
+void VGG11(engine::kind engine_kind) {
+
+    auto setup_begin = std::chrono::steady_clock::now();
+    RuntimeConfig config;
+    config.train_batch = N;
+    config.batch = EVAL_N;
+    if (load_config(TUNED_CONFIG, config))
+        std::cout << "config from " << TUNED_CONFIG << ": batch "
+                  << config.train_batch << ", eval batch " << config.batch
+                  << " x " << config.threads << " threads, layout "
+                  << config.layout << std::endl;
+    N = config.train_batch;
+    EVAL_N = config.batch;
+    activation_format() = layout_tag(config.layout);
+#ifdef _OPENMP
+    if (config.train_threads > 0) omp_set_num_threads(config.train_threads);
+#endif
+#ifdef TRACE
+    trace_thread_name("train");
+#endif
+#ifdef DETERMINISTIC
+    deterministic_threads() = DETERMINISTIC_THREADS;
+#endif
+
+#ifdef ASYNC_EVAL
+    // training keeps the other cores, set before any OpenMP team exists
+    CoreSets cores = split_cores(EVAL_CORES);
+    pin_thread(cores.train);
+#endif
+
+#ifdef SHARDED_DATA
+    if (!std::ifstream(std::string(SHARD_DIR) + "/index.txt"))
+        write_shards(SHARD_DIR, dataset.training_images,
+                     dataset.training_labels, 28, 28, SHARD_IMAGES);
+    ShardReader shards(SHARD_DIR, SHARD_WINDOW, SHARD_PREFETCH);
+    if (shards.rows() != 28 || shards.cols() != 28)
+        throw std::runtime_error("shards are not 28x28");
+#endif
+
+#ifdef USEARENA
+    MemoryArena arena(ARENA_BYTES);
+    default_arena() = &arena;
+#endif
+
+    auto eng = engine(engine_kind, 0);
+#ifdef THREADPOOL
+    // training queues its primitives high, batches normal, evaluation low;
+    // OpenCV resizes inline on whichever pool thread prepares the sample
+    WorkStealingPool pool(POOL_THREADS > 0
+                              ? POOL_THREADS
+                              : (int)std::thread::hardware_concurrency());
+    default_pool() = &pool;
+    cv::setNumThreads(0);
+    auto new_stream = [&]() {
+        return dnnl::threadpool_interop::make_stream(eng, &pool);
+    };
+#else
+    auto new_stream = [&]() { return stream(eng); };
+#endif
+    stream s = new_stream();
+
+    // Vector of primitives and their execute arguments
+    std::vector<primitive> net_fwd, net_bwd;
+    std::vector<std::unordered_map<int, memory>> net_fwd_args, net_bwd_args;
+
+    // Vector of expected output, the input is written into conv1 src
+    std::vector<float> net_dst(N * 10);  // 10 classes
+
     auto net_dst_memory =
-        memory({{memory::dims{N, 10}}, dt::f32, tag::nc}, eng);
-    write_to_dnnl_memory(net_dst.data(), net_dst_memory);
+        make_memory({{memory::dims{N, 10}}, dt::f32, tag::nc}, eng);
 
     const float negative_slope = 0.0f;
 
+    // intermediates of the checkpointed blocks, shared between blocks
+    ActivationScratch scratch;
+    auto checkpoint = [&](int block) -> ActivationScratch* {
+        scratch.begin_block();
+        return CHECKPOINT_BLOCK[block] ? &scratch : nullptr;
+    };
+
+    ActivationScratch* block1_scratch = checkpoint(0);
+
     // VGG11: block 1-1: conv1
-    // {batch, 3, 224, 224} (x) {64, 3, 3, 3} -> {batch, 64, 224, 224}
+    // {batch, IN_C, 224, 224} (x) {64, IN_C, 3, 3} -> {batch, 64, 224, 224}
     // kernel: {3,3}; strides: {1, 1}; padding: {1, 1}
-    memory::dims conv1_src_tz = {N, 3, 224, 224};
-    memory::dims conv1_weights_tz = {64, 3, 3, 3};
-    memory::dims conv1_dst_tz = {N, 64, 224, 224};
-    memory::dims conv1_strides = {1, 1};
-    memory::dims conv1_padding = {1, 1};
+    memory::dims conv1_src_tz = vgg11::conv1::src_dims(N);
+    memory::dims conv1_weights_tz = vgg11::conv1::weights_dims();
+    memory::dims conv1_dst_tz = vgg11::conv1::dst_dims(N);
+    memory::dims conv1_strides = vgg11::conv1::strides();
+    memory::dims conv1_padding = vgg11::conv1::padding();
 
-    auto conv1_src_memory = memory({{conv1_src_tz}, dt::f32, tag::nchw}, eng);
-    write_to_dnnl_memory(net_src.data(), conv1_src_memory);
+    auto conv1_src_memory = make_memory({{conv1_src_tz}, dt::f32, tag::nchw}, eng);
 
     Conv2DwithReLu conv1(eng, net_fwd, net_fwd_args, conv1_src_memory,
                          conv1_src_tz, conv1_dst_tz, conv1_weights_tz,
-                         conv1_strides, conv1_padding, negative_slope);
+                         conv1_strides, conv1_padding, negative_slope, "conv1",
+                         block1_scratch, CONV_ALGO[0]);
     memory conv1_dst_memory = conv1.dst_memory();
 
     // VGG11: block 1-2: max_pooling1
     // {batch, 64, 224, 224} -> {batch, 64, 112, 112}
     // kernel: {2, 2}
     // strides: {2, 2}
-    memory::dims pool1_dst_tz = {N, 64, 112, 112};
-    memory::dims pool1_kernel = {2, 2};
-    memory::dims pool1_strides = {2, 2};
-    memory::dims pool1_padding = {0, 0};
+    memory::dims pool1_dst_tz = vgg11::pool1::dst_dims(N);
+    memory::dims pool1_kernel = vgg11::pool1::kernel();
+    memory::dims pool1_strides = vgg11::pool1::strides();
+    memory::dims pool1_padding = vgg11::pool1::padding();
     MaxPooling pool1(eng, net_fwd, net_fwd_args, conv1_dst_memory, pool1_kernel,
-                     pool1_dst_tz, pool1_strides, pool1_padding);
+                     pool1_dst_tz, pool1_strides, pool1_padding, true,
+                     block1_scratch);
     memory pool1_dst_memory = pool1.dst_memory();
 
+    ActivationScratch* block2_scratch = checkpoint(1);
+
     // VGG11: block 2-1: conv2
     // {batch, 64, 112, 112} -> {batch, 128, 112, 112}
     // kernel: {3, 3}; strides: {1, 1}; padding: {1, 1}
-    memory::dims conv2_src_tz = {N, 64, 112, 112};
-    memory::dims conv2_weights_tz = {128, 64, 3, 3};
-    memory::dims conv2_dst_tz = {N, 128, 112, 112};
-    memory::dims conv2_strides = {1, 1};
-    memory::dims conv2_padding = {1, 1};
+    memory::dims conv2_src_tz = vgg11::conv2::src_dims(N);
+    memory::dims conv2_weights_tz = vgg11::conv2::weights_dims();
+    memory::dims conv2_dst_tz = vgg11::conv2::dst_dims(N);
+    memory::dims conv2_strides = vgg11::conv2::strides();
+    memory::dims conv2_padding = vgg11::conv2::padding();
     Conv2DwithReLu conv2(eng, net_fwd, net_fwd_args, pool1_dst_memory,
                          conv2_src_tz, conv2_dst_tz, conv2_weights_tz,
-                         conv2_strides, conv2_padding, negative_slope);
+                         conv2_strides, conv2_padding, negative_slope, "conv2",
+                         block2_scratch, CONV_ALGO[1]);
     memory conv2_dst_memory = conv2.dst_memory();
 
     // VGG11: block 2-2 max_pooling2
     // {batch, 128, 112, 112} -> {batch, 128, 56, 56}
     // kernel: {2, 2}; strides: {2, 2}; padding: {0, 0}
-    memory::dims pool2_dst_tz = {N, 128, 56, 56};
-    memory::dims pool2_kernel = {2, 2};
-    memory::dims pool2_strides = {2, 2};
-    memory::dims pool2_padding = {0, 0};
+    memory::dims pool2_dst_tz = vgg11::pool2::dst_dims(N);
+    memory::dims pool2_kernel = vgg11::pool2::kernel();
+    memory::dims pool2_strides = vgg11::pool2::strides();
+    memory::dims pool2_padding = vgg11::pool2::padding();
     MaxPooling pool2(eng, net_fwd, net_fwd_args, conv2_dst_memory, pool2_kernel,
-                     pool2_dst_tz, pool2_strides, pool2_padding);
+                     pool2_dst_tz, pool2_strides, pool2_padding, true,
+                     block2_scratch);
     memory pool2_dst_memory = pool2.dst_memory();
 
+    ActivationScratch* block3_scratch = checkpoint(2);
+
     // VGG11: block 3-1: conv3
     // {batch, 128, 56, 56} -> {batch, 256, 56, 56}
     // kernel: {3, 3}; strides: {1, 1}; padding: {1, 1}
-    memory::dims conv3_src_tz = {N, 128, 56, 56};
-    memory::dims conv3_weights_tz = {256, 128, 3, 3};
-    memory::dims conv3_dst_tz = {N, 256, 56, 56};
-    memory::dims conv3_strides = {1, 1};
-    memory::dims conv3_padding = {1, 1};
+    memory::dims conv3_src_tz = vgg11::conv3::src_dims(N);
+    memory::dims conv3_weights_tz = vgg11::conv3::weights_dims();
+    memory::dims conv3_dst_tz = vgg11::conv3::dst_dims(N);
+    memory::dims conv3_strides = vgg11::conv3::strides();
+    memory::dims conv3_padding = vgg11::conv3::padding();
     Conv2DwithReLu conv3(eng, net_fwd, net_fwd_args, pool2_dst_memory,
                          conv3_src_tz, conv3_dst_tz, conv3_weights_tz,
-                         conv3_strides, conv3_padding, negative_slope);
+                         conv3_strides, conv3_padding, negative_slope, "conv3",
+                         block3_scratch, CONV_ALGO[2]);
     memory conv3_dst_memory = conv3.dst_memory();
 
     // VGG11: block 3-2: conv4
     // {batch, 256, 56, 56} -> {batch, 256, 56, 56}
-    memory::dims conv4_src_tz = {N, 256, 56, 56};
-    memory::dims conv4_weights_tz = {256, 256, 3, 3};
-    memory::dims conv4_dst_tz = {N, 256, 56, 56};
-    memory::dims conv4_strides = {1, 1};
-    memory::dims conv4_padding = {1, 1};
+    memory::dims conv4_src_tz = vgg11::conv4::src_dims(N);
+    memory::dims conv4_weights_tz = vgg11::conv4::weights_dims();
+    memory::dims conv4_dst_tz = vgg11::conv4::dst_dims(N);
+    memory::dims conv4_strides = vgg11::conv4::strides();
+    memory::dims conv4_padding = vgg11::conv4::padding();
     Conv2DwithReLu conv4(eng, net_fwd, net_fwd_args, conv3_dst_memory,
                          conv4_src_tz, conv4_dst_tz, conv4_weights_tz,
-                         conv4_strides, conv4_padding, negative_slope);
+                         conv4_strides, conv4_padding, negative_slope, "conv4",
+                         block3_scratch, CONV_ALGO[3]);
     memory conv4_dst_memory = conv4.dst_memory();
 
     // VGG11: block 3-3: max_pooling3
     // {batch, 256, 56, 56} -> {batch, 256, 28, 28}
     // kernel: {2, 2}; strides: {2, 2}; padding: {1, 1}
-    memory::dims pool3_dst_tz = {N, 256, 28, 28};
-    memory::dims pool3_kernel = {2, 2};
-    memory::dims pool3_strides = {2, 2};
-    memory::dims pool3_padding = {0, 0};
+    memory::dims pool3_dst_tz = vgg11::pool3::dst_dims(N);
+    memory::dims pool3_kernel = vgg11::pool3::kernel();
+    memory::dims pool3_strides = vgg11::pool3::strides();
+    memory::dims pool3_padding = vgg11::pool3::padding();
     MaxPooling pool3(eng, net_fwd, net_fwd_args, conv4_dst_memory, pool3_kernel,
-                     pool3_dst_tz, pool3_strides, pool3_padding);
+                     pool3_dst_tz, pool3_strides, pool3_padding, true,
+                     block3_scratch);
     memory pool3_dst_memory = pool3.dst_memory();
 
+    ActivationScratch* block4_scratch = checkpoint(3);
+
     // VGG11: block 4-1: conv5
     // {batch, 256, 28, 28} -> {batch, 512, 28, 28}
     // kernel: {3, 3}; strides: {1, 1}; padding: {1, 1}
-    memory::dims conv5_src_tz = {N, 256, 28, 28};
-    memory::dims conv5_weights_tz = {512, 256, 3, 3};
-    memory::dims conv5_dst_tz = {N, 512, 28, 28};
-    memory::dims conv5_strides = {1, 1};
-    memory::dims conv5_padding = {1, 1};
+    memory::dims conv5_src_tz = vgg11::conv5::src_dims(N);
+    memory::dims conv5_weights_tz = vgg11::conv5::weights_dims();
+    memory::dims conv5_dst_tz = vgg11::conv5::dst_dims(N);
+    memory::dims conv5_strides = vgg11::conv5::strides();
+    memory::dims conv5_padding = vgg11::conv5::padding();
     Conv2DwithReLu conv5(eng, net_fwd, net_fwd_args, pool3_dst_memory,
                          conv5_src_tz, conv5_dst_tz, conv5_weights_tz,
-                         conv5_strides, conv5_padding, negative_slope);
+                         conv5_strides, conv5_padding, negative_slope, "conv5",
+                         block4_scratch, CONV_ALGO[4]);
     memory conv5_dst_memory = conv5.dst_memory();
 
     // VGG11: block 4-2: conv6
     // {batch, 512, 28, 28} -> {batch, 512, 28, 28}
     // kernel: {3, 3}; strides: {1, 1}; padding: {1, 1}
-    memory::dims conv6_src_tz = {N, 512, 28, 28};
-    memory::dims conv6_weights_tz = {512, 512, 3, 3};
-    memory::dims conv6_dst_tz = {N, 512, 28, 28};
-    memory::dims conv6_strides = {1, 1};
-    memory::dims conv6_padding = {1, 1};
+    memory::dims conv6_src_tz = vgg11::conv6::src_dims(N);
+    memory::dims conv6_weights_tz = vgg11::conv6::weights_dims();
+    memory::dims conv6_dst_tz = vgg11::conv6::dst_dims(N);
+    memory::dims conv6_strides = vgg11::conv6::strides();
+    memory::dims conv6_padding = vgg11::conv6::padding();
     Conv2DwithReLu conv6(eng, net_fwd, net_fwd_args, conv5_dst_memory,
                          conv6_src_tz, conv6_dst_tz, conv6_weights_tz,
-                         conv6_strides, conv6_padding, negative_slope);
+                         conv6_strides, conv6_padding, negative_slope, "conv6",
+                         block4_scratch, CONV_ALGO[5]);
     memory conv6_dst_memory = conv6.dst_memory();
 
     // VGG11: block 4-3: max_pooling4
     // {batch, 512, 28, 28} -> {batch, 512, 14, 14}
     // kernel: {2, 2}; strides: {2, 2}; padding: {1, 1}
-    memory::dims pool4_dst_tz = {N, 512, 14, 14};
-    memory::dims pool4_kernel = {2, 2};
-    memory::dims pool4_strides = {2, 2};
-    memory::dims pool4_padding = {0, 0};
+    memory::dims pool4_dst_tz = vgg11::pool4::dst_dims(N);
+    memory::dims pool4_kernel = vgg11::pool4::kernel();
+    memory::dims pool4_strides = vgg11::pool4::strides();
+    memory::dims pool4_padding = vgg11::pool4::padding();
     MaxPooling pool4(eng, net_fwd, net_fwd_args, conv6_dst_memory, pool4_kernel,
-                     pool4_dst_tz, pool4_strides, pool4_padding);
+                     pool4_dst_tz, pool4_strides, pool4_padding, true,
+                     block4_scratch);
     memory pool4_dst_memory = pool4.dst_memory();
 
+    ActivationScratch* block5_scratch = checkpoint(4);
+
     // VGG11: block 5-1: conv7
     // {batch, 512, 14, 14} -> {batch, 512, 14, 14}
     // kernel: {3, 3}; strides: {1, 1}; padding: {1, 1}
-    memory::dims conv7_src_tz = {N, 512, 14, 14};
-    memory::dims conv7_weights_tz = {512, 512, 3, 3};
-    memory::dims conv7_dst_tz = {N, 512, 14, 14};
-    memory::dims conv7_strides = {1, 1};
-    memory::dims conv7_padding = {1, 1};
+    memory::dims conv7_src_tz = vgg11::conv7::src_dims(N);
+    memory::dims conv7_weights_tz = vgg11::conv7::weights_dims();
+    memory::dims conv7_dst_tz = vgg11::conv7::dst_dims(N);
+    memory::dims conv7_strides = vgg11::conv7::strides();
+    memory::dims conv7_padding = vgg11::conv7::padding();
     Conv2DwithReLu conv7(eng, net_fwd, net_fwd_args, pool4_dst_memory,
                          conv7_src_tz, conv7_dst_tz, conv7_weights_tz,
-                         conv7_strides, conv7_padding, negative_slope);
+                         conv7_strides, conv7_padding, negative_slope, "conv7",
+                         block5_scratch, CONV_ALGO[6]);
     memory conv7_dst_memory = conv7.dst_memory();
 
     // VGG11: block 5-2: conv8
     // {batch, 512, 14, 14} -> {batch, 512, 14, 14}
     // kernel: {3, 3}; strides: {1, 1}; padding: {1, 1}
-    memory::dims conv8_src_tz = {N, 512, 14, 14};
-    memory::dims conv8_weights_tz = {512, 512, 3, 3};
-    memory::dims conv8_dst_tz = {N, 512, 14, 14};
-    memory::dims conv8_strides = {1, 1};
-    memory::dims conv8_padding = {1, 1};
+    memory::dims conv8_src_tz = vgg11::conv8::src_dims(N);
+    memory::dims conv8_weights_tz = vgg11::conv8::weights_dims();
+    memory::dims conv8_dst_tz = vgg11::conv8::dst_dims(N);
+    memory::dims conv8_strides = vgg11::conv8::strides();
+    memory::dims conv8_padding = vgg11::conv8::padding();
     Conv2DwithReLu conv8(eng, net_fwd, net_fwd_args, conv7_dst_memory,
                          conv8_src_tz, conv8_dst_tz, conv8_weights_tz,
-                         conv8_strides, conv8_padding, negative_slope);
+                         conv8_strides, conv8_padding, negative_slope, "conv8",
+                         block5_scratch, CONV_ALGO[7]);
     memory conv8_dst_memory = conv8.dst_memory();
 
+#ifdef GAP_HEAD
+    // GAP head: global average pooling and one FC10
+    // {batch, 512, 14, 14} -> {batch, 512, 1, 1} -> {batch, 10}
+    GlobalAvgPooling gap(eng, net_fwd, net_fwd_args, conv8_dst_memory,
+                         conv8_dst_tz);
+    memory gap_dst_memory = gap.dst_memory();
+
+    memory::dims fc_src_tz = vgg11::fc::src_dims(N);
+    memory::dims fc_weights_tz = vgg11::fc::weights_dims();
+    memory::dims fc_dst_tz = vgg11::fc::dst_dims(N);
+    Dense fc(eng, net_fwd, net_fwd_args, gap_dst_memory, fc_src_tz, fc_dst_tz,
+             fc_weights_tz, "fc");
+    memory logits_memory = fc.dst_memory();
+#else
     // VGG11: block 5-3: max_pooling5
     // {batch, 512, 14, 14} -> {batch, 512, 7, 7}
     // kernel: {2, 2}; strides: {2, 2}; padding: {1, 1}
-    memory::dims pool5_dst_tz = {N, 512, 7, 7};
-    memory::dims pool5_kernel = {2, 2};
-    memory::dims pool5_strides = {2, 2};
-    memory::dims pool5_padding = {0, 0};
+    memory::dims pool5_dst_tz = vgg11::pool5::dst_dims(N);
+    memory::dims pool5_kernel = vgg11::pool5::kernel();
+    memory::dims pool5_strides = vgg11::pool5::strides();
+    memory::dims pool5_padding = vgg11::pool5::padding();
     MaxPooling pool5(eng, net_fwd, net_fwd_args, conv8_dst_memory, pool5_kernel,
-                     pool5_dst_tz, pool5_strides, pool5_padding);
+                     pool5_dst_tz, pool5_strides, pool5_padding, true,
+                     block5_scratch);
     memory pool5_dst_memory = pool5.dst_memory();
 
     // VGG11: FC4096*2
     // {batch, 512, 7, 7} -> {batch, 4096} -> {batch, 4096}
-    memory::dims fc1_src_tz = {N, 512, 7, 7};
-    memory::dims fc1_weights_tz = {4096, 512, 7, 7};
-    memory::dims fc1_dst_tz = {N, 4096};
+    memory::dims fc1_src_tz = vgg11::fc1::src_dims(N);
+    memory::dims fc1_weights_tz = vgg11::fc1::weights_dims();
+    memory::dims fc1_dst_tz = vgg11::fc1::dst_dims(N);
+#ifdef FC_LOWRANK
+    size_t fc1_begin = net_fwd.size();  // conv stack shared by FC_LOWRANK
+#endif
     Dense fc1(eng, net_fwd, net_fwd_args, pool5_dst_memory, fc1_src_tz,
-              fc1_dst_tz, fc1_weights_tz);
+              fc1_dst_tz, fc1_weights_tz, "fc1");
     memory fc1_dst_memory = fc1.dst_memory();
 
     ReLU fc1_relu(eng, net_fwd, net_fwd_args, fc1_dst_memory, negative_slope);
     memory fc1_relu_dst_memory = fc1_relu.dst_memory();
 
-    memory::dims fc2_src_tz = {N, 4096};
-    memory::dims fc2_weights_tz = {4096, 4096};
-    memory::dims fc2_dst_tz = {N, 4096};
+    memory::dims fc2_src_tz = vgg11::fc2::src_dims(N);
+    memory::dims fc2_weights_tz = vgg11::fc2::weights_dims();
+    memory::dims fc2_dst_tz = vgg11::fc2::dst_dims(N);
     Dense fc2(eng, net_fwd, net_fwd_args, fc1_relu_dst_memory, fc2_src_tz,
-              fc2_dst_tz, fc2_weights_tz);
+              fc2_dst_tz, fc2_weights_tz, "fc2");
     memory fc2_dst_memory = fc2.dst_memory();
 
+#ifdef FC_LOWRANK
+    size_t fc2_relu_begin = net_fwd.size();  // head shared by FC_LOWRANK
+#endif
     ReLU fc2_relu(eng, net_fwd, net_fwd_args, fc2_dst_memory, negative_slope);
     memory fc2_relu_dst_memory = fc2_relu.dst_memory();
 
     // VGG11: FC1000
     // {batch, 4096} -> {batch, 1000}
-    memory::dims fc3_src_tz = {N, 4096};
-    memory::dims fc3_weights_tz = {1000, 4096};
-    memory::dims fc3_dst_tz = {N, 1000};
+    memory::dims fc3_src_tz = vgg11::fc3::src_dims(N);
+    memory::dims fc3_weights_tz = vgg11::fc3::weights_dims();
+    memory::dims fc3_dst_tz = vgg11::fc3::dst_dims(N);
     Dense fc3(eng, net_fwd, net_fwd_args, fc2_relu_dst_memory, fc3_src_tz,
-              fc3_dst_tz, fc3_weights_tz);
+              fc3_dst_tz, fc3_weights_tz, "fc3");
     memory fc3_dst_memory = fc3.dst_memory();
 
     ReLU fc3_relu(eng, net_fwd, net_fwd_args, fc3_dst_memory, negative_slope);
@@ -286,12 +800,13 @@ void VGG11(engine::kind engine_kind) {
 
     // VGG11: FC10
     // {batch, 1000} -> {batch, 10}
-    memory::dims fc4_src_tz = {N, 1000};
-    memory::dims fc4_weights_tz = {10, 1000};
-    memory::dims fc4_dst_tz = {N, 10};
+    memory::dims fc4_src_tz = vgg11::fc4::src_dims(N);
+    memory::dims fc4_weights_tz = vgg11::fc4::weights_dims();
+    memory::dims fc4_dst_tz = vgg11::fc4::dst_dims(N);
     Dense fc4(eng, net_fwd, net_fwd_args, fc3_relu_dst_memory, fc4_src_tz,
-              fc4_dst_tz, fc4_weights_tz);
-    memory fc4_dst_memory = fc4.dst_memory();
+              fc4_dst_tz, fc4_weights_tz, "fc4");
+    memory logits_memory = fc4.dst_memory();
+#endif
 
     // VGG11: the end, softmax
     memory::dims softmax_src_tz = {N, 10};
@@ -299,11 +814,11 @@ void VGG11(engine::kind engine_kind) {
     auto softmax_dec =
         softmax_forward::desc(prop_kind::forward_training, softmax_src_md, 1);
     auto softmax_pd = softmax_forward::primitive_desc(softmax_dec, eng);
-    auto softmax_dst_memory = memory(softmax_pd.dst_desc(), eng);
+    auto softmax_dst_memory = make_memory(softmax_pd.dst_desc(), eng);
 
     net_fwd.push_back(softmax_forward(softmax_pd));
     net_fwd_args.push_back(
-        {{DNNL_ARG_SRC, fc4_dst_memory}, {DNNL_ARG_DST, softmax_dst_memory}});
+        {{DNNL_ARG_SRC, logits_memory}, {DNNL_ARG_DST, softmax_dst_memory}});
 
     memory::dims y_tz = {N, 10};
     // CrossEntropyLoss loss(eng, net_fwd, net_fwd_args, softmax_dst_memory, net_dst_memory, y_tz);
@@ -314,7 +829,7 @@ void VGG11(engine::kind engine_kind) {
     float upper = 1 - 1e-7;  // beta
 
     auto y_md = memory::desc({y_tz}, dt::f32, tag::nc);
-    auto y_hat_cliped_memory = memory(y_md, eng);
+    auto y_hat_cliped_memory = make_memory(y_md, eng);
 
     auto clip_desc =
         eltwise_forward::desc(prop_kind::forward_training,
@@ -326,7 +841,7 @@ void VGG11(engine::kind engine_kind) {
                             {DNNL_ARG_DST, y_hat_cliped_memory}});
 
     // 1) Perform elementwise log on y_hat_cliped
-    auto y_hat_logged_memory = memory(y_md, eng);
+    auto y_hat_logged_memory = make_memory(y_md, eng);
 
     auto log_desc = eltwise_forward::desc(prop_kind::forward_training,
                                           algorithm::eltwise_log, y_md);
@@ -340,34 +855,73 @@ void VGG11(engine::kind engine_kind) {
     // wait until training
     memory::dims loss_tz = {N, 1};
     auto loss_md = memory::desc({loss_tz}, dt::f32, tag::nc);
-    auto loss_memory = memory(loss_md, eng);
+    auto loss_memory = make_memory(loss_md, eng);
 
     //-----------------------------------------------------------------------
     //----------------- Backpropagation Stream  (Data)-------------------------------------
 
     // use loss and y_hat to calculate loss_diff({N, 10})
-    // wait until training
+    // loss = -sum(y_true * log(y_hat)) / N, so loss_diff = -y_true / y_hat / N
     auto loss_diff_md = memory::desc({y_tz}, dt::f32, tag::nc);
-    auto loss_diff_memory = memory(loss_diff_md, eng);
+    auto loss_diff_memory = make_memory(loss_diff_md, eng);
+
+    post_ops loss_diff_ops;
+    loss_diff_ops.append_eltwise(1.0f, algorithm::eltwise_linear, -1.0f / N,
+                                 0.0f);
+    primitive_attr loss_diff_attr;
+    loss_diff_attr.set_post_ops(loss_diff_ops);
+    auto loss_diff_desc =
+        binary::desc(algorithm::binary_div, y_md, y_md, loss_diff_md);
+    auto loss_diff_pd =
+        binary::primitive_desc(loss_diff_desc, loss_diff_attr, eng);
+
+    net_bwd.push_back(binary(loss_diff_pd));
+    net_bwd_args.push_back({{DNNL_ARG_SRC_0, net_dst_memory},
+                            {DNNL_ARG_SRC_1, y_hat_cliped_memory},
+                            {DNNL_ARG_DST, loss_diff_memory}});
 
     // softmax back
     auto softmax_back_desc =
         softmax_backward::desc(loss_diff_md, softmax_src_md, 1);
     auto softmax_back_pd =
         softmax_backward::primitive_desc(softmax_back_desc, eng, softmax_pd);
-    auto softmax_diff_src_memory = memory(softmax_src_md, eng);
+    auto softmax_diff_src_memory = make_memory(softmax_src_md, eng);
 
     net_bwd.push_back(softmax_backward(softmax_back_pd));
     net_bwd_args.push_back({{DNNL_ARG_DIFF_DST, loss_diff_memory},
                             {DNNL_ARG_DST, softmax_dst_memory},
                             {DNNL_ARG_DIFF_SRC, softmax_diff_src_memory}});
 
+#ifdef POOL_RELU_BACK
+    const bool pool_relu = true;
+#else
+    const bool pool_relu = false;
+#endif
+
+#ifdef GAP_HEAD
+    // fc back
+    Dense_back fc_back(eng, net_bwd, net_bwd_args, softmax_diff_src_memory,
+                       gap_dst_memory, fc_weights_tz, fc);
+
+    // block 5 recompute
+    if (CHECKPOINT_BLOCK[4]) {
+        conv7.recompute(net_bwd, net_bwd_args);
+        conv8.recompute(net_bwd, net_bwd_args);
+    }
+
+    // gap back
+    GlobalAvgPooling_back gap_back(eng, net_bwd, net_bwd_args,
+                                   fc_back.diff_src_memory, conv8_dst_memory,
+                                   gap);
+    memory conv8_diff_dst_memory = gap_back.diff_src_memory;
+    const bool conv8_relu_done = false;
+#else
     // fc4 back
     Dense_back fc4_back(eng, net_bwd, net_bwd_args, softmax_diff_src_memory,
                         fc3_relu_dst_memory, fc4_weights_tz, fc4);
     // fc3 ReLU back
     ReLU_back fc3_relu_back(eng, net_bwd, net_bwd_args,
-                            fc4_back.diff_src_memory, fc3_dst_memory, fc3_relu);
+                            fc4_back.diff_src_memory, fc3_relu);
 
     // fc3 back
     Dense_back fc3_back(eng, net_bwd, net_bwd_args,
@@ -376,7 +930,7 @@ void VGG11(engine::kind engine_kind) {
 
     // fc2 ReLU back
     ReLU_back fc2_relu_back(eng, net_bwd, net_bwd_args,
-                            fc3_back.diff_src_memory, fc2_dst_memory, fc2_relu);
+                            fc3_back.diff_src_memory, fc2_relu);
 
     // fc2 back
     Dense_back fc2_back(eng, net_bwd, net_bwd_args,
@@ -385,26 +939,1031 @@ void VGG11(engine::kind engine_kind) {
 
     // fc1 ReLU back
     ReLU_back fc1_relu_back(eng, net_bwd, net_bwd_args,
-                            fc2_back.diff_src_memory, fc1_dst_memory, fc1_relu);
+                            fc2_back.diff_src_memory, fc1_relu);
 
     // fc1 back
     Dense_back fc1_back(eng, net_bwd, net_bwd_args,
                         fc1_relu_back.diff_src_memory, pool5_dst_memory,
                         fc1_weights_tz, fc1);
 
+    // block 5 recompute
+    if (CHECKPOINT_BLOCK[4]) {
+        conv7.recompute(net_bwd, net_bwd_args);
+        conv8.recompute(net_bwd, net_bwd_args);
+        pool5.recompute(net_bwd, net_bwd_args);
+    }
+
     // pool5 back
     MaxPooling_back pool5_back(
         eng, net_bwd, net_bwd_args, pool5_kernel, pool5_strides, pool5_padding,
-        fc1_back.diff_src_memory, conv8_dst_memory, pool5);
+        fc1_back.diff_src_memory, conv8_dst_memory, pool5, pool_relu,
+        negative_slope);
+    memory conv8_diff_dst_memory = pool5_back.diff_src_memory;
+    const bool conv8_relu_done = pool_relu;
+#endif
 
     // conv8 back
     Conv2DwithReLu_back conv8_back(eng, net_bwd, net_bwd_args, conv8_weights_tz, conv8_strides, conv8_padding
-                , pool5_back.diff_src_memory, conv7_dst_memory, conv8);
+                , conv8_diff_dst_memory, conv7_dst_memory, conv8, negative_slope,
+                conv8_relu_done);
+
+    // conv7 back
+    Conv2DwithReLu_back conv7_back(
+        eng, net_bwd, net_bwd_args, conv7_weights_tz, conv7_strides,
+        conv7_padding, conv8_back.diff_src_memory, pool4_dst_memory, conv7,
+        negative_slope);
+
+    // block 4 recompute
+    if (CHECKPOINT_BLOCK[3]) {
+        conv5.recompute(net_bwd, net_bwd_args);
+        conv6.recompute(net_bwd, net_bwd_args);
+        pool4.recompute(net_bwd, net_bwd_args);
+    }
+
+    // pool4 back
+    MaxPooling_back pool4_back(
+        eng, net_bwd, net_bwd_args, pool4_kernel, pool4_strides, pool4_padding,
+        conv7_back.diff_src_memory, conv6_dst_memory, pool4, pool_relu,
+        negative_slope);
+
+    // conv6 back
+    Conv2DwithReLu_back conv6_back(
+        eng, net_bwd, net_bwd_args, conv6_weights_tz, conv6_strides,
+        conv6_padding, pool4_back.diff_src_memory, conv5_dst_memory, conv6,
+        negative_slope, pool_relu);
+
+    // conv5 back
+    Conv2DwithReLu_back conv5_back(
+        eng, net_bwd, net_bwd_args, conv5_weights_tz, conv5_strides,
+        conv5_padding, conv6_back.diff_src_memory, pool3_dst_memory, conv5,
+        negative_slope);
+
+    // block 3 recompute
+    if (CHECKPOINT_BLOCK[2]) {
+        conv3.recompute(net_bwd, net_bwd_args);
+        conv4.recompute(net_bwd, net_bwd_args);
+        pool3.recompute(net_bwd, net_bwd_args);
+    }
+
+    // pool3 back
+    MaxPooling_back pool3_back(
+        eng, net_bwd, net_bwd_args, pool3_kernel, pool3_strides, pool3_padding,
+        conv5_back.diff_src_memory, conv4_dst_memory, pool3, pool_relu,
+        negative_slope);
+
+    // conv4 back
+    Conv2DwithReLu_back conv4_back(
+        eng, net_bwd, net_bwd_args, conv4_weights_tz, conv4_strides,
+        conv4_padding, pool3_back.diff_src_memory, conv3_dst_memory, conv4,
+        negative_slope, pool_relu);
+
+    // conv3 back
+    Conv2DwithReLu_back conv3_back(
+        eng, net_bwd, net_bwd_args, conv3_weights_tz, conv3_strides,
+        conv3_padding, conv4_back.diff_src_memory, pool2_dst_memory, conv3,
+        negative_slope);
+
+    // block 2 recompute
+    if (CHECKPOINT_BLOCK[1]) {
+        conv2.recompute(net_bwd, net_bwd_args);
+        pool2.recompute(net_bwd, net_bwd_args);
+    }
+
+    // pool2 back
+    MaxPooling_back pool2_back(
+        eng, net_bwd, net_bwd_args, pool2_kernel, pool2_strides, pool2_padding,
+        conv3_back.diff_src_memory, conv2_dst_memory, pool2, pool_relu,
+        negative_slope);
+
+    // conv2 back
+    Conv2DwithReLu_back conv2_back(
+        eng, net_bwd, net_bwd_args, conv2_weights_tz, conv2_strides,
+        conv2_padding, pool2_back.diff_src_memory, pool1_dst_memory, conv2,
+        negative_slope, pool_relu);
+
+    // block 1 recompute
+    if (CHECKPOINT_BLOCK[0]) {
+        conv1.recompute(net_bwd, net_bwd_args);
+        pool1.recompute(net_bwd, net_bwd_args);
+    }
+
+    // pool1 back
+    MaxPooling_back pool1_back(
+        eng, net_bwd, net_bwd_args, pool1_kernel, pool1_strides, pool1_padding,
+        conv2_back.diff_src_memory, conv1_dst_memory, pool1, pool_relu,
+        negative_slope);
+
+    // conv1 back
+    Conv2DwithReLu_back conv1_back(
+        eng, net_bwd, net_bwd_args, conv1_weights_tz, conv1_strides,
+        conv1_padding, pool1_back.diff_src_memory, conv1_src_memory, conv1,
+        negative_slope, pool_relu);
+
+    //-----------------------------------------------------------------------
+    //----------------- Weights update ---------------------------------------
+
+    // (param, diff) of every trainable tensor
+    std::vector<std::pair<memory, memory>> params = {
+        {conv1.weights_memory, conv1_back.diff_weights_memory},
+        {conv1.bias_memory, conv1_back.diff_bias_memory},
+        {conv2.weights_memory, conv2_back.diff_weights_memory},
+        {conv2.bias_memory, conv2_back.diff_bias_memory},
+        {conv3.weights_memory, conv3_back.diff_weights_memory},
+        {conv3.bias_memory, conv3_back.diff_bias_memory},
+        {conv4.weights_memory, conv4_back.diff_weights_memory},
+        {conv4.bias_memory, conv4_back.diff_bias_memory},
+        {conv5.weights_memory, conv5_back.diff_weights_memory},
+        {conv5.bias_memory, conv5_back.diff_bias_memory},
+        {conv6.weights_memory, conv6_back.diff_weights_memory},
+        {conv6.bias_memory, conv6_back.diff_bias_memory},
+        {conv7.weights_memory, conv7_back.diff_weights_memory},
+        {conv7.bias_memory, conv7_back.diff_bias_memory},
+        {conv8.weights_memory, conv8_back.diff_weights_memory},
+        {conv8.bias_memory, conv8_back.diff_bias_memory}};
+#ifdef GAP_HEAD
+    params.insert(params.end(),
+                  {{fc.weights_memory, fc_back.diff_weights_memory},
+                   {fc.bias_memory, fc_back.diff_bias_memory}});
+#else
+    params.insert(params.end(), {
+        {fc1.weights_memory, fc1_back.diff_weights_memory},
+        {fc1.bias_memory, fc1_back.diff_bias_memory},
+        {fc2.weights_memory, fc2_back.diff_weights_memory},
+        {fc2.bias_memory, fc2_back.diff_bias_memory},
+        {fc3.weights_memory, fc3_back.diff_weights_memory},
+        {fc3.bias_memory, fc3_back.diff_bias_memory},
+        {fc4.weights_memory, fc4_back.diff_weights_memory},
+        {fc4.bias_memory, fc4_back.diff_bias_memory}});
+#endif
+
+    // the diff memories are overwritten by every backward, so with
+    // ACC_STEPS > 1 they are summed into accumulators first; the update
+    // divides by ACC_STEPS to average over the effective batch
+    std::vector<primitive> net_acc_first, net_acc, net_update;
+    std::vector<std::unordered_map<int, memory>> net_acc_first_args,
+        net_acc_args, net_update_args;
+    for (auto& p : params) {
+        memory grad_memory = p.second;
+        if (ACC_STEPS > 1) {
+            GradAccumulator acc(eng, net_acc_first, net_acc_first_args,
+                                net_acc, net_acc_args, p.second);
+            grad_memory = acc.acc_memory;
+        }
+        SGDUpdate update(eng, net_update, net_update_args, p.first,
+                         grad_memory, LEARNING_RATE / ACC_STEPS);
+    }
+
+    //-----------------------------------------------------------------------
+    //----------------- Evaluation -------------------------------------------
+
+    // the test set streams through an inference graph of batch EVAL_N with
+    // its own copy of the weights, refreshed by net_snapshot, so under
+    // ASYNC_EVAL it can run while training updates the live weights
+    std::vector<primitive> net_eval, net_snapshot;
+    std::vector<std::unordered_map<int, memory>> net_eval_args,
+        net_snapshot_args;
+    auto eval_src_memory =
+        make_memory({{EVAL_N, IN_C, IMG, IMG}, dt::f32, tag::nchw}, eng);
+#ifdef ASYNC_EVAL
+    // primitives sized for the threads that will run them
+    pin_thread(cores.eval);
+#endif
+    memory eval_dst_memory = build_inference_net(
+        eng, net_eval, net_eval_args, net_snapshot, net_snapshot_args,
+        eval_src_memory, EVAL_N, params);
+#ifdef ASYNC_EVAL
+    pin_thread(cores.train);
+#endif
+
+    // one pass over the test set, metrics read from the mapped softmax dst
+    stream eval_s = new_stream();
+    ConfusionMatrix eval_result;
+    auto evaluate = [&]() {
+        ScopedThreads eval_threads(config.threads);
+        ConfusionMatrix cm;
+        std::vector<float> eval_dst(EVAL_N * 10), y_hat(EVAL_N * 10);
+        memory::dim t = 0;
+        const memory::dim total = dataset.test_images.size();
+        for (memory::dim b = 0; b < total; b += EVAL_N) {
+            {
+                TRACE_SCOPE("read_batch", "loader");
+                float* eval_src = eval_src_memory.map_data<float>();
+                read_batch(dataset.test_images, dataset.test_labels, t,
+                           eval_src, eval_dst, EVAL_N);
+                eval_src_memory.unmap_data(eval_src);
+            }
+
+            execute_net(eval_s, net_eval, net_eval_args, "eval");
+            eval_s.wait();
+
+            // a short last batch wraps around, its extra rows are not read
+            const memory::dim rows = std::min(EVAL_N, total - b);
+            read_from_dnnl_memory(y_hat.data(), eval_dst_memory, 0,
+                                  rows * 10 * sizeof(float));
+            cm.add(y_hat.data(), dataset.test_labels.data() + b, rows);
+        }
+        eval_result = cm;
+    };
+
+    std::thread eval_thread;
+#ifdef THREADPOOL
+    std::future<void> eval_done;
+#endif
+    int eval_step = -1;
+    // wait for the running evaluation, if any, and report it
+    auto finish_eval = [&]() {
+        if (eval_thread.joinable()) eval_thread.join();
+#ifdef THREADPOOL
+        if (eval_done.valid()) eval_done.get();
+#endif
+        if (eval_step < 0) return;
+        std::cout << "eval after step " << eval_step << ": top-1 "
+                  << eval_result.top1() << " over " << eval_result.total()
+                  << " test images" << std::endl;
+        eval_step = -1;
+    };
+    // snapshot the weights between steps and evaluate them
+    auto start_eval = [&](int step) {
+        finish_eval();
+        execute_net(s, net_snapshot, net_snapshot_args, "snapshot");
+        s.wait();
+        eval_step = step;
+#ifdef ASYNC_EVAL
+        eval_thread = std::thread([&]() {
+#ifdef TRACE
+            trace_thread_name("eval");
+#endif
+            pin_thread(cores.eval);
+            evaluate();
+        });
+#elif defined(THREADPOOL)
+        eval_done = pool.submit(evaluate, task_priority::low);
+#else
+        evaluate();
+#endif
+    };
+
+#ifdef ASYNC_SAVE
+    std::vector<memory> saved_weights;
+    for (auto& p : params)
+        saved_weights.push_back(p.first);
+    // steps are numbered on from the loaded checkpoint
+    int64_t saved_step = 0, first_step = 0;
+    if (load_saved(SAVE_PATH, saved_weights, saved_step)) {
+        first_step = saved_step + 1;
+        std::cout << "weights of step " << saved_step << " loaded from "
+                  << SAVE_PATH << std::endl;
+    }
+    AsyncSaver saver(eng, saved_weights, SAVE_PATH);
+    std::vector<bool> step_saving;  // a write overlapped the step
+#endif
+
+    scratch.bind();
+    std::cout << "checkpointed blocks share " << scratch.bytes() / (1 << 20)
+              << " MB of activations" << std::endl;
+    // from the shapes alone: what a deployment with plain layouts would
+    // allocate up front
+    std::cout << "static plan: " << vgg11::net::size() << " layers, "
+              << vgg11::net::weights_elems() * sizeof(float) / (1 << 20)
+              << " MB of weights, layer outputs "
+              << vgg11::net::plan_elems() * N * sizeof(float) / (1 << 20)
+              << " MB in training, "
+              << 2 * vgg11::net::slot_elems() * EVAL_N * sizeof(float) /
+                     (1 << 20)
+              << " MB in inference" << std::endl;
+
+#ifdef USEARENA
+    arena.populate();
+    std::cout << "arena: " << arena.used() / (1 << 20) << " MB, "
+              << (arena.huge_pages() ? "huge pages" : "base pages")
+              << std::endl;
+#endif
+    auto setup_end = std::chrono::steady_clock::now();
+
+    //-----------------------------------------------------------------------
+    //----------------- Training ---------------------------------------------
+
+#ifdef PERF_COUNTERS
+    // opened after setup, on the team that will run the primitives
+    PerfCounters perf;
+    if (!perf.available())
+        std::cout << "perf_event_open failed, check "
+                     "/proc/sys/kernel/perf_event_paranoid"
+                  << std::endl;
+    LayerCounters fwd_counters(perf, net_fwd.size());
+    LayerCounters bwd_counters(perf, net_bwd.size());
+    LayerCounters* fwd_counters_ptr = perf.available() ? &fwd_counters : nullptr;
+    LayerCounters* bwd_counters_ptr = perf.available() ? &bwd_counters : nullptr;
+#else
+    LayerCounters* fwd_counters_ptr = nullptr;
+    LayerCounters* bwd_counters_ptr = nullptr;
+#endif
+
+#ifdef METRICS
+    // per primitive times cost a wait each, which CPU streams do anyway
+    MetricsRegistry& metrics = default_metrics();
+    Histogram* load_hist = &metrics.histogram(
+        "vgg11_load_seconds", "Time to prepare one training batch");
+    Histogram* fwd_hist = &metrics.histogram(
+        "vgg11_pass_seconds", "Time of one pass over a net", "net=\"fwd\"");
+    Histogram* bwd_hist = &metrics.histogram(
+        "vgg11_pass_seconds", "Time of one pass over a net", "net=\"bwd\"");
+    Histogram* step_hist = &metrics.histogram(
+        "vgg11_step_seconds", "Time of one weights update step");
+    Counter* images_counter =
+        &metrics.counter("vgg11_images_total", "Training images processed");
+    Gauge* loss_gauge = &metrics.gauge("vgg11_loss", "Loss of the last step");
+    metrics.gauge_fn("vgg11_memory_bytes",
+                     "Bytes of the tensors allocated by the layers", [] {
+                         return (double)allocated_bytes().load();
+                     });
+    metrics.gauge_fn("process_resident_memory_bytes",
+                     "Resident memory size in bytes", resident_bytes);
+    LayerTimes fwd_times(metrics, "fwd", net_fwd);
+    LayerTimes bwd_times(metrics, "bwd", net_bwd);
+    LayerTimes* fwd_times_ptr = &fwd_times;
+    LayerTimes* bwd_times_ptr = &bwd_times;
+    MetricsServer metrics_server(metrics, METRICS_ENDPOINT);
+    std::cout << "metrics served on " << METRICS_ENDPOINT << std::endl;
+#else
+    Histogram* load_hist = nullptr;
+    Histogram* fwd_hist = nullptr;
+    Histogram* bwd_hist = nullptr;
+    Histogram* step_hist = nullptr;
+    Counter* images_counter = nullptr;
+    Gauge* loss_gauge = nullptr;
+    LayerTimes* fwd_times_ptr = nullptr;
+    LayerTimes* bwd_times_ptr = nullptr;
+#endif
+
+    std::vector<double> step_ms;
+#ifdef THREADPOOL
+    ScopedPriority train_priority(task_priority::high);
+#endif
+    auto begin = std::chrono::steady_clock::now();
+    for (int step = 0; step < UPDATE_STEPS; ++step) {
+        auto step_begin = std::chrono::steady_clock::now();
+        float loss = 0;
+        for (int k = 0; k < ACC_STEPS; ++k) {
+            {
+                // the batch is normalized straight into conv1 src
+                TRACE_SCOPE("read_batch", "loader");
+                ScopedTimer load_timer(load_hist);
+#ifdef THREADPOOL
+                ScopedPriority batch_priority(task_priority::normal);
+#endif
+                float* net_src = conv1_src_memory.map_data<float>();
+#ifdef SHARDED_DATA
+                read_batch(shards, net_src, net_dst, N, &train_drawn);
+#else
+                read_batch(dataset.training_images, dataset.training_labels,
+                           train_t, net_src, net_dst, N, &train_drawn);
+#endif
+                conv1_src_memory.unmap_data(net_src);
+                write_to_dnnl_memory(net_dst.data(), net_dst_memory);
+            }
+
+            {
+                ScopedTimer fwd_timer(fwd_hist);
+                execute_net(s, net_fwd, net_fwd_args, "fwd", fwd_counters_ptr,
+                            fwd_times_ptr);
+            }
+            {
+                ScopedTimer bwd_timer(bwd_hist);
+                execute_net(s, net_bwd, net_bwd_args, "bwd", bwd_counters_ptr,
+                            bwd_times_ptr);
+            }
+            if (k == 0)
+                execute_net(s, net_acc_first, net_acc_first_args, "acc");
+            else
+                execute_net(s, net_acc, net_acc_args, "acc");
+            {
+                TRACE_SCOPE("wait", "stream");
+                s.wait();
+            }
+
+            float* y_hat_logged = y_hat_logged_memory.map_data<float>();
+            for (memory::dim i = 0; i < N * 10; ++i)
+                loss -= net_dst[i] * y_hat_logged[i] / N;
+            y_hat_logged_memory.unmap_data(y_hat_logged);
+        }
+        execute_net(s, net_update, net_update_args, "update");
+        s.wait();
+        if (step % EVAL_EVERY == EVAL_EVERY - 1 || step == UPDATE_STEPS - 1)
+            start_eval(step);
+#ifdef ASYNC_SAVE
+        step_saving.push_back(saver.busy());
+        if ((first_step + step) % SAVE_EVERY == SAVE_EVERY - 1) {
+            TRACE_SCOPE("capture", "save");
+            saver.capture(s, first_step + step);
+        }
+#endif
+        step_ms.push_back(std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - step_begin)
+                              .count());
+        if (step_hist) step_hist->observe(step_begin);
+        if (images_counter) images_counter->add(N * ACC_STEPS);
+        if (loss_gauge) loss_gauge->set(loss / ACC_STEPS);
+
+        std::cout << "step " << step << ": loss " << loss / ACC_STEPS
+                  << std::endl;
+    }
+    auto end = std::chrono::steady_clock::now();
+    ConfusionMatrix last_step_result;
+    if (eval_step >= 0) {
+        finish_eval();
+        last_step_result = eval_result;
+    }
 
+    // setup and first step pay the page faults, later steps are steady
+    // state; their spread compares the OpenMP and THREADPOOL runtimes
+    double steady_ms = 0, steady_sd = 0;
+    for (size_t i = 1; i < step_ms.size(); ++i)
+        steady_ms += step_ms[i] / (step_ms.size() - 1);
+    for (size_t i = 1; i < step_ms.size(); ++i)
+        steady_sd += (step_ms[i] - steady_ms) * (step_ms[i] - steady_ms) /
+                     (step_ms.size() - 1);
+    steady_sd = sqrt(steady_sd);
+    std::cout << "setup "
+              << std::chrono::duration<double, std::milli>(setup_end -
+                                                           setup_begin)
+                     .count()
+              << " ms, first step " << step_ms[0] << " ms, steady step "
+              << steady_ms << " ms (sd " << steady_sd << " ms)" << std::endl;
+#ifdef THREADPOOL
+    pool.report(std::cout);
+#endif
+#ifdef METRICS
+    metrics.report(std::cout);
+#endif
+#ifdef ASYNC_SAVE
+    // the capture is the only stall, the write shows as contention
+    saver.wait();
+    double saving_ms = 0, quiet_ms = 0;
+    int saving_steps = 0, quiet_steps = 0;
+    for (size_t i = 1; i < step_ms.size(); ++i) {
+        if (step_saving[i]) {
+            saving_ms += step_ms[i];
+            ++saving_steps;
+        } else {
+            quiet_ms += step_ms[i];
+            ++quiet_steps;
+        }
+    }
+    // formatted apart, std::cout keeps its format
+    std::ostringstream save_report;
+    save_report << std::fixed << std::setprecision(1) << "saved "
+                << saver.written() << " checkpoints of "
+                << saver.bytes() / (1 << 20) << " MB to " << SAVE_PATH << " ("
+                << saver.skipped() << " skipped while writing): capture "
+                << saver.last_capture_ms() << " ms, write "
+                << saver.last_write_ms() << " ms; steady step "
+                << (saving_steps ? saving_ms / saving_steps : 0)
+                << " ms while writing, "
+                << (quiet_steps ? quiet_ms / quiet_steps : 0)
+                << " ms otherwise";
+    std::cout << save_report.str() << std::endl;
+#endif
+
+    // peak RSS against throughput for this (N, ACC_STEPS)
+    double seconds = std::chrono::duration<double>(end - begin).count();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << "N = " << N << ", micro-batches = " << ACC_STEPS
+              << ", effective batch = " << N * ACC_STEPS << ": "
+              << UPDATE_STEPS * ACC_STEPS * N / seconds << " images/s, "
+              << "peak RSS " << usage.ru_maxrss / 1024 << " MB" << std::endl;
+
+    // accuracy of the last step, to compare heads and input resolutions
+#ifdef GAP_HEAD
+    std::cout << "GAP head";
+#else
+    std::cout << "FC head";
+#endif
+    std::cout << ", input " << IMG << "x" << IMG << ": top-1 "
+              << last_step_result.top1()
+              << " (rows: true class, columns: predicted)" << std::endl;
+    last_step_result.print(std::cout);
+
+#ifdef DETERMINISTIC
+    // tensors after the last step, per thread count: diff two of these
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    std::string checksums_path =
+        "vgg11_checksums_t" + std::to_string(threads) + ".txt";
+    std::ofstream checksums(checksums_path);
+    checksum_net(checksums, "fwd", net_fwd, net_fwd_args);
+    checksum_net(checksums, "bwd", net_bwd, net_bwd_args);
+    std::cout << "checksums written to " << checksums_path << std::endl;
+#endif
+
+#ifdef PERF_COUNTERS
+    if (perf.available()) {
+        fwd_counters.report(std::cout, net_fwd, "forward");
+        bwd_counters.report(std::cout, net_bwd, "backward");
+    }
+#endif
+
+#ifdef TRACE
+    if (Tracer::get().dump("vgg11_trace.json"))
+        std::cout << "trace written to vgg11_trace.json" << std::endl;
+#endif
+
+#ifdef DEPTH_FIRST
+    //-----------------------------------------------------------------------
+    //------------ depth-first conv1-pool2 against layer by layer -----------
+
+    // inference of blocks 1 and 2 on test images with the trained weights
+    for (memory::dim batch : {(memory::dim)1, N}) {
+        memory::dims src_tz = vgg11::conv1::src_dims(batch);
+        auto src_memory = make_memory({{src_tz}, dt::f32, tag::nchw}, eng);
+        std::vector<float> labels(batch * 10);
+        test_t = 0;
+        float* src = src_memory.map_data<float>();
+        read_batch(dataset.test_images, dataset.test_labels, test_t, src,
+                   labels, batch);
+        src_memory.unmap_data(src);
+
+        std::vector<primitive> net_lbl, net_lbl_snapshot;
+        std::vector<std::unordered_map<int, memory>> net_lbl_args,
+            net_lbl_snapshot_args;
+        Conv2DwithReLu conv1_i(eng, net_lbl, net_lbl_args, src_memory,
+                               vgg11::conv1::dst_dims(batch), conv1_strides,
+                               conv1_padding, negative_slope,
+                               conv1.weights_memory, conv1.bias_memory);
+        conv1_i.snapshot(net_lbl_snapshot, net_lbl_snapshot_args);
+        MaxPooling pool1_i(eng, net_lbl, net_lbl_args, conv1_i.dst_memory(),
+                           pool1_kernel, vgg11::pool1::dst_dims(batch),
+                           pool1_strides, pool1_padding, false);
+        Conv2DwithReLu conv2_i(eng, net_lbl, net_lbl_args,
+                               pool1_i.dst_memory(),
+                               vgg11::conv2::dst_dims(batch), conv2_strides,
+                               conv2_padding, negative_slope,
+                               conv2.weights_memory, conv2.bias_memory);
+        conv2_i.snapshot(net_lbl_snapshot, net_lbl_snapshot_args);
+        MaxPooling pool2_i(eng, net_lbl, net_lbl_args, conv2_i.dst_memory(),
+                           pool2_kernel, vgg11::pool2::dst_dims(batch),
+                           pool2_strides, pool2_padding, false);
+        execute_net(s, net_lbl_snapshot, net_lbl_snapshot_args);
+
+        DepthFirstBlocks blocks(eng, src_memory, conv1.weights_memory,
+                                conv1.bias_memory, conv2.weights_memory,
+                                conv2.bias_memory, negative_slope);
+
+        double lbl_ms = median_ms([&] {
+            execute_net(s, net_lbl, net_lbl_args);
+            s.wait();
+        });
+        double df_ms = median_ms([&] { blocks.execute(); });
+
+        // same numbers expected up to summation order, compared one channel
+        // plane of every image at a time
+        auto plain = [&](const memory& m) {
+            auto dims = m.get_desc().dims();
+            auto plain_memory = make_memory({dims, dt::f32, tag::nchw}, eng);
+            memory from = m;
+            reorder(from, plain_memory).execute(s, from, plain_memory);
+            s.wait();
+            return plain_memory;
+        };
+        auto expected_memory = plain(pool2_i.dst_memory());
+        auto got_memory = plain(blocks.dst_memory());
+        const auto dims = expected_memory.get_desc().dims();
+        const size_t plane_bytes = dims[2] * dims[3] * sizeof(float);
+        const size_t image_bytes = dims[1] * plane_bytes;
+        std::vector<float> expected(batch * dims[2] * dims[3]),
+            got(expected.size());
+        float max_diff = 0;
+        for (memory::dim c = 0; c < dims[1]; ++c) {
+            read_from_dnnl_memory(expected.data(), expected_memory,
+                                  c * plane_bytes, plane_bytes, batch,
+                                  image_bytes);
+            read_from_dnnl_memory(got.data(), got_memory, c * plane_bytes,
+                                  plane_bytes, batch, image_bytes);
+            for (size_t i = 0; i < expected.size(); ++i)
+                max_diff = std::max(max_diff, std::abs(expected[i] - got[i]));
+        }
+
+        std::cout << "depth-first conv1-pool2, batch " << batch << ": bands of "
+                  << blocks.band_rows() << " pool2 rows, "
+                  << blocks.scratch_bytes() / 1024 << " KB per thread, "
+                  << lbl_ms << " ms -> " << df_ms << " ms ("
+                  << lbl_ms / df_ms << "x), max |diff| " << max_diff
+                  << std::endl;
+    }
+#endif
+
+#ifdef GEMV_HEAD
+    //-----------------------------------------------------------------------
+    //------------ batch-1 latency: prepacked GEMV fc1-fc4 ------------------
+
+    // one test image through the whole network, fc1-fc4 either as oneDNN
+    // inner products or as DenseGemv over the trained weights
+    {
+        auto src1_memory =
+            make_memory({{1, IN_C, IMG, IMG}, dt::f32, tag::nchw}, eng);
+        load_sample(dataset.test_images[0].data(), src1_memory, 0);
+
+        std::vector<primitive> net_b1, net_b1_snapshot, net_conv,
+            net_conv_snapshot, net_gemv_softmax;
+        std::vector<std::unordered_map<int, memory>> net_b1_args,
+            net_b1_snapshot_args, net_conv_args, net_conv_snapshot_args,
+            net_gemv_softmax_args;
+        memory b1_dst_memory =
+            build_inference_net(eng, net_b1, net_b1_args, net_b1_snapshot,
+                                net_b1_snapshot_args, src1_memory, 1, params);
+        memory conv_dst_memory = build_inference_net(
+            eng, net_conv, net_conv_args, net_conv_snapshot,
+            net_conv_snapshot_args, src1_memory, 1, params, false);
+        execute_net(s, net_b1_snapshot, net_b1_snapshot_args);
+        execute_net(s, net_conv_snapshot, net_conv_snapshot_args);
+        s.wait();
+
+        // fc1-fc3 with their relu fused, fc4 feeds softmax
+        std::vector<std::unique_ptr<DenseGemv>> gemv_fcs;
+        memory fc_src_memory = conv_dst_memory;
+        size_t packed_bytes = 0;
+        for (size_t layer = 8; layer < 12; ++layer) {
+            gemv_fcs.emplace_back(new DenseGemv(
+                eng, fc_src_memory, params[2 * layer].first,
+                params[2 * layer + 1].first, layer < 11, negative_slope));
+            fc_src_memory = gemv_fcs.back()->dst_memory();
+            packed_bytes += gemv_fcs.back()->weights_bytes();
+        }
+        auto gemv_softmax_pd = softmax_forward::primitive_desc(
+            softmax_forward::desc(prop_kind::forward_inference,
+                                  fc_src_memory.get_desc(), 1),
+            eng);
+        auto gemv_dst_memory = make_memory(gemv_softmax_pd.dst_desc(), eng);
+        net_gemv_softmax.push_back(softmax_forward(gemv_softmax_pd));
+        net_gemv_softmax_args.push_back(
+            {{DNNL_ARG_SRC, fc_src_memory}, {DNNL_ARG_DST, gemv_dst_memory}});
+
+        auto b1_ms = sorted_ms(
+            [&] {
+                execute_net(s, net_b1, net_b1_args);
+                s.wait();
+            },
+            200);
+        auto gemv_ms = sorted_ms(
+            [&] {
+                execute_net(s, net_conv, net_conv_args);
+                s.wait();
+                for (auto& fc : gemv_fcs)
+                    fc->execute(s);
+                execute_net(s, net_gemv_softmax, net_gemv_softmax_args);
+                s.wait();
+            },
+            200);
+
+        std::vector<float> expected(10), got(10);
+        read_from_dnnl_memory(expected.data(), b1_dst_memory);
+        read_from_dnnl_memory(got.data(), gemv_dst_memory);
+        float max_diff = 0;
+        for (size_t i = 0; i < expected.size(); ++i)
+            max_diff = std::max(max_diff, std::abs(expected[i] - got[i]));
+
+        auto p = [](const std::vector<double>& ms, double q) {
+            return ms[std::min(ms.size() - 1, (size_t)(q * ms.size()))];
+        };
+        std::cout << "batch-1 latency, inner products: p50 " << p(b1_ms, 0.5)
+                  << " ms, p99 " << p(b1_ms, 0.99) << " ms; GEMV fc1-fc4 ("
+                  << packed_bytes / (1 << 20) << " MB packed): p50 "
+                  << p(gemv_ms, 0.5) << " ms, p99 " << p(gemv_ms, 0.99)
+                  << " ms; max |diff| " << max_diff << std::endl;
+    }
+#endif
+
+#ifdef RESULT_CACHE
+    //-----------------------------------------------------------------------
+    //----------------- serving through the result cache --------------------
+
+    // requests are served EVAL_N at a time: hits are answered from the
+    // cache, the misses of a batch run together through the smallest of the
+    // power-of-two batch graphs (1, 2, 4, ... EVAL_N) that holds them, so a
+    // few misses do not pay for a full EVAL_N batch
+    {
+        struct Bucket {
+            memory::dim batch;
+            memory src_memory, dst_memory;
+            std::vector<primitive> net, net_snapshot;
+            std::vector<std::unordered_map<int, memory>> net_args,
+                net_snapshot_args;
+        };
+        std::vector<Bucket> buckets;
+        for (memory::dim batch = 1;; batch = std::min(2 * batch, EVAL_N)) {
+            buckets.push_back(Bucket());
+            Bucket& b = buckets.back();
+            b.batch = batch;
+            b.src_memory = make_memory(
+                {{batch, IN_C, IMG, IMG}, dt::f32, tag::nchw}, eng);
+            b.dst_memory = build_inference_net(
+                eng, b.net, b.net_args, b.net_snapshot, b.net_snapshot_args,
+                b.src_memory, batch, params);
+            execute_net(eval_s, b.net_snapshot, b.net_snapshot_args);
+            if (batch == EVAL_N) break;
+        }
+        eval_s.wait();
+
+        const size_t distinct =
+            std::min(CACHE_DISTINCT, dataset.test_images.size());
+        auto request = [&](size_t r) {
+            return dataset.test_images[counter_random(INIT_SEED, 2, r) %
+                                       distinct]
+                .data();
+        };
+        std::vector<float> labels(EVAL_N * 10);
+        auto serve = [&](ResultCache* cache, std::vector<float>& answers) {
+            for (size_t first = 0; first < CACHE_REQUESTS; first += EVAL_N) {
+                size_t count = std::min((size_t)EVAL_N, CACHE_REQUESTS - first);
+                std::vector<size_t> misses;
+                for (size_t r = first; r < first + count; ++r)
+                    if (!cache || !cache->lookup(request(r), &answers[r * 10]))
+                        misses.push_back(r);
+                if (misses.empty()) continue;
+
+                Bucket& b = *std::find_if(
+                    buckets.begin(), buckets.end(), [&](const Bucket& b) {
+                        return b.batch >= (memory::dim)misses.size();
+                    });
+                float* src = b.src_memory.map_data<float>();
+                for_each_sample(misses.size(), [&](memory::dim i) {
+                    write_sample(request(misses[i]), 0, i, src, labels);
+                });
+                b.src_memory.unmap_data(src);
+                execute_net(eval_s, b.net, b.net_args, "serve");
+                eval_s.wait();
+
+                float* y_hat = b.dst_memory.map_data<float>();
+                for (size_t i = 0; i < misses.size(); ++i) {
+                    memcpy(&answers[misses[i] * 10], y_hat + i * 10,
+                           10 * sizeof(float));
+                    if (cache) cache->insert(request(misses[i]), y_hat + i * 10);
+                }
+                b.dst_memory.unmap_data(y_hat);
+            }
+        };
+
+        ResultCache results(CACHE_ENTRIES, 28 * 28, 10);
+        std::vector<float> uncached(CACHE_REQUESTS * 10),
+            cached(CACHE_REQUESTS * 10);
+        auto t0 = std::chrono::steady_clock::now();
+        serve(nullptr, uncached);
+        auto t1 = std::chrono::steady_clock::now();
+        serve(&results, cached);
+        auto t2 = std::chrono::steady_clock::now();
+
+        float max_diff = 0;
+        for (size_t i = 0; i < cached.size(); ++i)
+            max_diff = std::max(max_diff, std::abs(cached[i] - uncached[i]));
+        std::cout << CACHE_REQUESTS << " requests over " << distinct
+                  << " images: "
+                  << CACHE_REQUESTS / std::chrono::duration<double>(t1 - t0)
+                                          .count()
+                  << " images/s -> "
+                  << CACHE_REQUESTS / std::chrono::duration<double>(t2 - t1)
+                                          .count()
+                  << " images/s with the cache (misses through graphs of "
+                  << buckets.size() << " batch sizes up to " << EVAL_N
+                  << "), max |diff| " << max_diff << std::endl;
+        results.report(std::cout);
+    }
+#endif
+
+#ifdef FC_LOWRANK
+    //-----------------------------------------------------------------------
+    //----------------- fc1/fc2 low-rank compression report -----------------
+
+    // fc1 and fc2 factorized from the trained weights, the rest of the
+    // forward (conv1 to pool5, fc2 relu on) is shared with net_fwd
+    std::vector<primitive> net_lr(net_fwd.begin(), net_fwd.begin() + fc1_begin);
+    std::vector<std::unordered_map<int, memory>> net_lr_args(
+        net_fwd_args.begin(), net_fwd_args.begin() + fc1_begin);
+    DenseLowRank fc1_lr(eng, net_lr, net_lr_args, pool5_dst_memory, fc1_src_tz,
+                        fc1_dst_tz, fc1, FC1_RANK);
+    ReLU fc1_lr_relu(eng, net_lr, net_lr_args, fc1_lr.dst_memory(),
+                     negative_slope);
+    DenseLowRank fc2_lr(eng, net_lr, net_lr_args, fc1_lr.dst_memory(),
+                        fc2_src_tz, fc2_dst_tz, fc2, FC2_RANK, fc2_dst_memory);
+    net_lr.insert(net_lr.end(), net_fwd.begin() + fc2_relu_begin,
+                  net_fwd.end());
+    net_lr_args.insert(net_lr_args.end(),
+                       net_fwd_args.begin() + fc2_relu_begin,
+                       net_fwd_args.end());
+
+    // accuracy delta over the test set, both through the training graph
+    auto test_top1 = [&](std::vector<primitive>& net,
+                         std::vector<std::unordered_map<int, memory>>& args) {
+        ConfusionMatrix cm;
+        test_t = 0;
+        for (size_t b = 0; b < dataset.test_images.size() / N; ++b) {
+            float* net_src = conv1_src_memory.map_data<float>();
+            read_batch(dataset.test_images, dataset.test_labels, test_t,
+                       net_src, net_dst);
+            conv1_src_memory.unmap_data(net_src);
+
+            execute_net(s, net, args);
+            s.wait();
+            float* y_hat = softmax_dst_memory.map_data<float>();
+            cm.add(y_hat, dataset.test_labels.data() + b * N, N);
+            softmax_dst_memory.unmap_data(y_hat);
+        }
+        return cm.top1();
+    };
+    float top1 = test_top1(net_fwd, net_fwd_args);
+    float top1_lr = test_top1(net_lr, net_lr_args);
+
+    // batch-1 latency of fc1 + relu + fc2, sharing the weights above
+    memory::dims fc1_src1_tz = vgg11::fc1::src_dims(1);
+    memory::dims fc1_dst1_tz = vgg11::fc1::dst_dims(1);
+    memory::dims fc2_dst1_tz = vgg11::fc2::dst_dims(1);
+    auto fc1_src1_memory = make_memory({{fc1_src1_tz}, dt::f32, tag::nchw}, eng);
+    std::vector<primitive> net_b1, net_b1_lr;
+    std::vector<std::unordered_map<int, memory>> net_b1_args, net_b1_lr_args;
+    Dense fc1_b1(eng, net_b1, net_b1_args, fc1_src1_memory, fc1_src1_tz,
+                 fc1_dst1_tz, fc1);
+    ReLU fc1_b1_relu(eng, net_b1, net_b1_args, fc1_b1.dst_memory(),
+                     negative_slope);
+    Dense fc2_b1(eng, net_b1, net_b1_args, fc1_b1.dst_memory(), fc1_dst1_tz,
+                 fc2_dst1_tz, fc2);
+    DenseLowRank fc1_lr_b1(eng, net_b1_lr, net_b1_lr_args, fc1_src1_memory,
+                           fc1_src1_tz, fc1_dst1_tz, fc1_lr);
+    ReLU fc1_lr_b1_relu(eng, net_b1_lr, net_b1_lr_args, fc1_lr_b1.dst_memory(),
+                        negative_slope);
+    DenseLowRank fc2_lr_b1(eng, net_b1_lr, net_b1_lr_args,
+                           fc1_lr_b1.dst_memory(), fc1_dst1_tz,
+                           fc2_dst1_tz, fc2_lr);
+
+    size_t dense_bytes = fc1.weights_memory.get_desc().get_size() +
+                         fc1.bias_memory.get_desc().get_size() +
+                         fc2.weights_memory.get_desc().get_size() +
+                         fc2.bias_memory.get_desc().get_size();
+    size_t lr_bytes = fc1_lr.weights_bytes() + fc2_lr.weights_bytes();
+    std::cout << "low-rank fc1 (rank " << FC1_RANK << ", error "
+              << fc1_lr.error() << "), fc2 (rank " << FC2_RANK << ", error "
+              << fc2_lr.error() << ")" << std::endl
+              << "  weights: " << dense_bytes / (1 << 20) << " MB -> "
+              << lr_bytes / (1 << 20) << " MB" << std::endl
+              << "  top-1: " << top1 << " -> " << top1_lr << std::endl
+              << "  fc1+fc2 batch-1 latency: " << median_ms([&] {
+                     execute_net(s, net_b1, net_b1_args);
+                     s.wait();
+                 }) << " ms -> " << median_ms([&] {
+                     execute_net(s, net_b1_lr, net_b1_lr_args);
+                     s.wait();
+                 }) << " ms" << std::endl;
+#endif
 
     return;
 }
 
+// weights shape and name of every vgg11:: layer with weights, in order;
+// the names are those of the training graph, the init streams
+struct WeightShapes {
+    std::vector<memory::dims> weights;
+    std::vector<std::string> names;
+    int convs = 0, fcs = 0;
+
+    template <class Src, memory::dim OC, memory::dim K, memory::dim S,
+              memory::dim P>
+    void operator()(shapes::Conv<Src, OC, K, S, P>) {
+        weights.push_back(shapes::Conv<Src, OC, K, S, P>::weights_dims());
+        names.push_back("conv" + std::to_string(++convs));
+    }
+    template <class Src, memory::dim O>
+    void operator()(shapes::Dense<Src, O>) {
+        weights.push_back(shapes::Dense<Src, O>::weights_dims());
+#ifdef GAP_HEAD
+        names.push_back("fc");  // the only fc layer
+#else
+        names.push_back("fc" + std::to_string(++fcs));
+#endif
+    }
+    template <class Layer>
+    void operator()(Layer) {}  // no weights
+};
+
+// random weights and biases in the layer order of build_inference_net; the
+// timing of a dense graph does not depend on the values
+std::vector<std::pair<memory, memory>> random_params(engine eng) {
+    WeightShapes layers;
+    vgg11::net::for_each_layer(layers);
+    const std::vector<memory::dims>& weights = layers.weights;
+    std::vector<std::pair<memory, memory>> params;
+    for (size_t l = 0; l < weights.size(); ++l) {
+        const memory::dims& dims = weights[l];
+        const memory::dim fan_out = dims[0];
+        const memory::dim fan_in =
+            std::accumulate(dims.begin() + 1, dims.end(), (memory::dim)1,
+                            std::multiplies<memory::dim>());
+        auto w = make_memory({dims, dt::f32, dims.size() == 4 ? tag::oihw
+                                                                : tag::oi},
+                             eng);
+        init_weights(w, weights_init::he_normal, fan_in, fan_out,
+                     tensor_stream(layers.names[l].c_str()));
+        auto b = make_memory({{fan_out}, dt::f32, tag::x}, eng);
+        init_weights(b, weights_init::zeros, fan_in, fan_out,
+                     tensor_stream(layers.names[l].c_str(), 1));
+        params.push_back({w, memory()});
+        params.push_back({b, memory()});
+    }
+    return params;
+}
+
+// `autotune [slo_ms]`: measure every configuration of the grid, print the
+// table and save the best under the SLO to TUNED_CONFIG, keeping its
+// training keys
+void Autotune(engine::kind engine_kind, int argc, char** argv) {
+    const double slo_ms = argc > 2 ? std::stod(argv[2]) : TUNE_SLO_MS;
+    auto eng = engine(engine_kind, 0);
+    auto params = random_params(eng);
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    const int cores = CPU_COUNT(&allowed);
+
+    // one graph per instance, built on the instance thread so its
+    // primitives are sized for that thread's team
+    TuneFactory make = [&](const TuneCase& c) -> TuneRunner {
+        struct Instance {
+            std::vector<primitive> net, snapshot;
+            std::vector<std::unordered_map<int, memory>> args, snapshot_args;
+            stream s;
+        };
+        auto inst = std::make_shared<Instance>();
+#ifdef _OPENMP
+        omp_set_num_threads(c.threads);
+#endif
+        auto src = make_memory({{c.batch, IN_C, IMG, IMG}, dt::f32, tag::nchw},
+                               eng);
+        float* data = src.map_data<float>();
+        std::fill(data, data + c.batch * IN_C * IMG * IMG, 0.0f);
+        src.unmap_data(data);
+        build_inference_net(eng, inst->net, inst->args, inst->snapshot,
+                            inst->snapshot_args, src, c.batch, params);
+        inst->s = stream(eng);
+        // pack the random weights once, timing never reads garbage
+        execute_net(inst->s, inst->snapshot, inst->snapshot_args);
+        inst->s.wait();
+        return [inst]() {
+            execute_net(inst->s, inst->net, inst->args);
+            inst->s.wait();
+        };
+    };
+
+    auto grid = tune_grid(cores, TUNE_BATCHES, TUNE_LAYOUTS,
+                          TUNE_MAX_IN_FLIGHT);
+    std::cout << "autotune over " << grid.size() << " configurations on "
+              << cores << " cores, p99 <= " << slo_ms << " ms" << std::endl
+              << std::setw(6) << "batch" << std::setw(8) << "threads"
+              << std::setw(10) << "instances" << std::setw(8) << "layout"
+              << std::setw(12) << "images/s" << std::setw(10) << "p50 ms"
+              << std::setw(10) << "p99 ms" << std::endl;
+    std::vector<TuneResult> results;
+    const std::ios_base::fmtflags cout_flags = std::cout.flags();
+    const std::streamsize cout_precision = std::cout.precision();
+    for (auto& c : grid) {
+        activation_format() = layout_tag(c.layout);
+        results.push_back(measure(c, make, TUNE_SECONDS));
+        const TuneResult& r = results.back();
+        std::cout << std::setw(6) << c.batch << std::setw(8) << c.threads
+                  << std::setw(10) << c.instances << std::setw(8) << c.layout
+                  << std::fixed << std::setprecision(1) << std::setw(12)
+                  << r.images_per_s << std::setw(10) << r.p50_ms
+                  << std::setw(10) << r.p99_ms
+                  << (r.p99_ms > slo_ms ? "  over SLO" : "") << std::endl;
+    }
+    std::cout.flags(cout_flags);
+    std::cout.precision(cout_precision);
+    activation_format() = tag::any;
+
+    int best = pick_best(results, slo_ms);
+    if (best < 0) {
+        std::cout << "no configuration meets p99 <= " << slo_ms << " ms, "
+                  << TUNED_CONFIG << " left as is" << std::endl;
+        return;
+    }
+    const TuneResult& r = results[best];
+    RuntimeConfig config;
+    config.train_batch = N;
+    load_config(TUNED_CONFIG, config);
+    config.batch = r.config.batch;
+    config.threads = r.config.threads;
+    config.layout = r.config.layout;
+    std::ostringstream comment;
+    comment << "autotune: " << r.images_per_s << " images/s, p99 "
+            << r.p99_ms << " ms <= " << slo_ms << " ms on " << cores
+            << " cores with " << r.config.instances << " instances";
+    if (!save_config(TUNED_CONFIG, config, comment.str()))
+        throw std::runtime_error(std::string("cannot write ") + TUNED_CONFIG);
+    std::cout << "best: batch " << config.batch << ", " << config.threads
+              << " threads x " << r.config.instances << " instances, layout "
+              << config.layout << ", saved to " << TUNED_CONFIG << std::endl;
+}
+
 int main(int argc, char* argv[]) {
 
 #ifdef DEBUG
@@ -444,6 +2003,8 @@ int main(int argc, char* argv[]) {
 #endif
 
 #ifndef DEBUG
+    if (argc > 1 && std::string(argv[1]) == "autotune")
+        return handle_example_errors(Autotune, engine::kind::cpu, argc, argv);
     return handle_example_errors(VGG11, parse_engine_kind(argc, argv));
 #endif
 }
\ No newline at end of file
@@ -0,0 +1,89 @@
+#ifndef MY_AUGMENT
+#define MY_AUGMENT
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "my_init.hpp"
+
+// Training augmentation fused into the write of the input tensor: a random
+// shift with zero fill (a random crop of the zero-padded image), a
+// horizontal flip and a brightness scale are folded into the indexing and
+// the u8 -> f32 normalization of each row, so an augmented sample costs
+// the same single pass over the IMG x IMG plane as a plain one. Rows are
+// converted with unit stride (reversed when flipped) under omp simd. The
+// transform of sample k of the training stream depends only on
+// (seed, k), like the weights init, never on the thread or batch split.
+
+#ifdef _OPENMP
+#define AUGMENT_SIMD _Pragma("omp simd")
+#else
+#define AUGMENT_SIMD
+#endif
+
+namespace augment {
+
+// RNG stream of the draws, apart from the layer streams of my_init
+const uint64_t STREAM = 0xa06e;
+
+struct Params {
+    int dx = 0, dy = 0;           // pixel (y, x) reads (y + dy, x' + dx)
+    bool flip = false;            // x' = size - 1 - x, else x
+    float scale = 1.0f / 255.0f;  // normalization times brightness
+};
+
+// transform of sample `sample`: shifts in [-max_shift, max_shift], flip
+// with probability 1/2, brightness in [1 - brightness, 1 + brightness]
+inline Params draw(uint64_t sample, int max_shift, float brightness,
+                   uint64_t seed = INIT_SEED) {
+    uint64_t bits = counter_random(seed, STREAM, sample);
+    const uint64_t span = 2 * max_shift + 1;
+    Params p;
+    p.dx = (int)((bits & 0xffff) % span) - max_shift;
+    p.dy = (int)((bits >> 16 & 0xffff) % span) - max_shift;
+    p.flip = bits >> 32 & 1;
+    // bits 40-63
+    float u = to_unit_float((uint32_t)(bits >> 32));
+    p.scale = (1.0f + brightness * (2.0f * u - 1.0f)) / 255.0f;
+    return p;
+}
+
+// the size x size u8 plane, transformed by p and normalized to [0, 1],
+// into each of the `channels` planes of dst (NCHW, one image)
+inline void write_planes(const uint8_t* plane, int size, const Params& p,
+                         float* dst, int channels) {
+    const float scale = p.scale;
+    // columns whose source pixel is inside the plane
+    const int x0 = std::max(0, p.flip ? p.dx : -p.dx);
+    const int x1 = std::min(size, p.flip ? size + p.dx : size - p.dx);
+    for (int y = 0; y < size; ++y) {
+        float* row = dst + (size_t)y * size;
+        const int sy = y + p.dy;
+        if (sy < 0 || sy >= size || x0 >= x1) {
+            std::fill(row, row + size, 0.0f);
+            continue;
+        }
+        std::fill(row, row + x0, 0.0f);
+        std::fill(row + x1, row + size, 0.0f);
+        const uint8_t* in = plane + (size_t)sy * size;
+        if (p.flip) {
+            const uint8_t* src = in + size - 1 + p.dx;
+            AUGMENT_SIMD
+            for (int x = x0; x < x1; ++x)
+                row[x] = std::min(src[-x] * scale, 1.0f);
+        } else {
+            const uint8_t* src = in + p.dx;
+            AUGMENT_SIMD
+            for (int x = x0; x < x1; ++x)
+                row[x] = std::min(src[x] * scale, 1.0f);
+        }
+    }
+    // the input planes are copies of the one gray plane
+    const size_t plane_elems = (size_t)size * size;
+    for (int c = 1; c < channels; ++c)
+        memcpy(dst + c * plane_elems, dst, plane_elems * sizeof(float));
+}
+
+}  // namespace augment
+
+#endif
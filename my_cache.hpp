@@ -0,0 +1,175 @@
+#ifndef MY_CACHE
+#define MY_CACHE
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Results of inference keyed by the raw input bytes, for traffic where the
+// same image comes back (retries, duplicate uploads): a hit skips the
+// resize and the whole forward. The cache is split into shards by hash,
+// each an LRU list under its own mutex, so concurrent lookups rarely
+// contend; the entry count is bounded and the least recently used entry
+// of a full shard is evicted. Entries keep the input bytes, a 64-bit hash
+// collision is a miss rather than a wrong answer.
+
+namespace cache {
+
+inline uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// 8 bytes per step, unaligned input
+inline uint64_t hash_bytes(const uint8_t* data, size_t bytes) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ bytes;
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ mix(word)) * 0x9e3779b97f4a7c15ULL;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, bytes - i);
+    return mix(h ^ mix(tail));
+}
+
+}  // namespace cache
+
+class ResultCache {
+public:
+    // at most `entries` results of `result_size` floats for inputs of
+    // `key_bytes` bytes
+    ResultCache(size_t entries, size_t key_bytes, size_t result_size,
+                size_t shards = 16);
+    ~ResultCache() = default;
+    ResultCache(const ResultCache&) = delete;
+
+    // copy the result for `key` into `result`; false on a miss
+    bool lookup(const uint8_t* key, float* result);
+    // store the result for `key`, evicting the least recently used entry
+    // of its shard when full
+    void insert(const uint8_t* key, const float* result);
+
+    uint64_t hits() const { return hits_m.load(); }
+    uint64_t misses() const { return misses_m.load(); }
+    uint64_t evictions() const { return evictions_m.load(); }
+    double hit_rate() const;
+    size_t size() const;
+    void report(std::ostream& out) const;
+
+private:
+    struct Entry {
+        uint64_t hash;
+        std::vector<uint8_t> key;
+        std::vector<float> result;
+    };
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list<Entry> lru;  // most recent first
+        std::unordered_multimap<uint64_t, std::list<Entry>::iterator> index;
+    };
+
+    Shard& shard(uint64_t hash) { return *shards_m[hash % shards_m.size()]; }
+    // entry of `key` in s, s.lru.end() if none; s.mutex held
+    std::list<Entry>::iterator find(Shard& s, uint64_t hash,
+                                    const uint8_t* key);
+
+    size_t capacity_m, key_bytes_m, result_size_m;
+    std::vector<std::unique_ptr<Shard>> shards_m;
+    std::atomic<uint64_t> hits_m{0}, misses_m{0}, evictions_m{0};
+};
+
+ResultCache::ResultCache(size_t entries, size_t key_bytes, size_t result_size,
+                         size_t shards)
+    : key_bytes_m(key_bytes), result_size_m(result_size) {
+    shards = std::max(shards, (size_t)1);
+    // per shard, at least one entry
+    capacity_m = std::max(entries / shards, (size_t)1);
+    for (size_t i = 0; i < shards; ++i)
+        shards_m.emplace_back(new Shard);
+}
+
+std::list<ResultCache::Entry>::iterator ResultCache::find(
+    Shard& s, uint64_t hash, const uint8_t* key) {
+    auto range = s.index.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
+        if (!memcmp(it->second->key.data(), key, key_bytes_m))
+            return it->second;
+    return s.lru.end();
+}
+
+bool ResultCache::lookup(const uint8_t* key, float* result) {
+    uint64_t hash = cache::hash_bytes(key, key_bytes_m);
+    Shard& s = shard(hash);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto entry = find(s, hash, key);
+    if (entry == s.lru.end()) {
+        misses_m.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    s.lru.splice(s.lru.begin(), s.lru, entry);
+    memcpy(result, entry->result.data(), result_size_m * sizeof(float));
+    hits_m.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void ResultCache::insert(const uint8_t* key, const float* result) {
+    uint64_t hash = cache::hash_bytes(key, key_bytes_m);
+    Shard& s = shard(hash);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto entry = find(s, hash, key);
+    if (entry != s.lru.end()) {
+        // a concurrent miss of the same input got there first
+        s.lru.splice(s.lru.begin(), s.lru, entry);
+        return;
+    }
+    if (s.lru.size() >= capacity_m) {
+        auto range = s.index.equal_range(s.lru.back().hash);
+        for (auto it = range.first; it != range.second; ++it)
+            if (it->second == std::prev(s.lru.end())) {
+                s.index.erase(it);
+                break;
+            }
+        s.lru.pop_back();
+        evictions_m.fetch_add(1, std::memory_order_relaxed);
+    }
+    s.lru.push_front({hash, std::vector<uint8_t>(key, key + key_bytes_m),
+                      std::vector<float>(result, result + result_size_m)});
+    s.index.emplace(hash, s.lru.begin());
+}
+
+double ResultCache::hit_rate() const {
+    uint64_t h = hits(), n = h + misses();
+    return n ? (double)h / n : 0;
+}
+
+size_t ResultCache::size() const {
+    size_t n = 0;
+    for (auto& s : shards_m) {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        n += s->lru.size();
+    }
+    return n;
+}
+
+void ResultCache::report(std::ostream& out) const {
+    out << "result cache: " << size() << " / "
+        << capacity_m * shards_m.size() << " entries, " << hits()
+        << " hits, " << misses() << " misses (hit rate " << hit_rate()
+        << "), " << evictions() << " evictions" << std::endl;
+}
+
+#endif
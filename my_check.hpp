@@ -0,0 +1,170 @@
+#ifndef MY_CHECK
+#define MY_CHECK
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "example_utils.hpp"
+#include "my_trace.hpp"
+#include "oneapi/dnnl/dnnl.hpp"
+
+// Reproducibility: with deterministic_threads() > 0 every convolution and
+// inner product, in every direction, is created and run on a team of
+// exactly that many threads. Those are the primitives that may split a sum
+// (over the batch, or over input channels) by thread count, so the order
+// of their reductions no longer depends on how many threads the rest of the
+// graph uses. The other primitives of the graph (eltwise, pooling, softmax,
+// binary, sum, reorder) compute every output element on one thread.
+// Initialization is counter-based (my_init.hpp). What is guaranteed is
+// what the DETERMINISTIC run checks: the per-tensor checksums written after
+// training match between two runs with different OMP_NUM_THREADS.
+
+// 0 for off
+inline int& deterministic_threads() {
+    static int threads = 0;
+    return threads;
+}
+
+class ScopedThreads {
+    // OpenMP team size for the current scope, nothing if threads <= 0
+public:
+    explicit ScopedThreads(int threads) {
+#ifdef _OPENMP
+        if (threads > 0) {
+            saved_m = omp_get_max_threads();
+            omp_set_num_threads(threads);
+        }
+#endif
+    }
+    ~ScopedThreads() {
+#ifdef _OPENMP
+        if (saved_m > 0) omp_set_num_threads(saved_m);
+#endif
+    }
+    ScopedThreads(const ScopedThreads&) = delete;
+
+private:
+    int saved_m = 0;
+};
+
+// convolution or inner product, any direction
+inline bool is_reduction(const dnnl::primitive& p) {
+    auto kind = p.get_kind();
+    return kind == dnnl::primitive::kind::convolution ||
+           kind == dnnl::primitive::kind::deconvolution ||
+           kind == dnnl::primitive::kind::inner_product;
+}
+
+// primitive_desc of a reduction, created on the team it runs on
+template <typename PD, typename... Args>
+PD make_fixed_team_pd(Args&&... args) {
+    ScopedThreads fixed(deterministic_threads());
+    return PD(std::forward<Args>(args)...);
+}
+
+namespace check {
+
+// h to continue the hash of earlier bytes
+inline uint64_t fnv1a(const unsigned char* data, size_t bytes,
+                      uint64_t h = 0xcbf29ce484222325ULL) {
+    for (size_t i = 0; i < bytes; ++i)
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+inline const char* arg_name(int arg) {
+    switch (arg) {
+        case DNNL_ARG_SRC: return "src";
+        case DNNL_ARG_SRC_1: return "src_1";
+        case DNNL_ARG_DST: return "dst";
+        case DNNL_ARG_WEIGHTS: return "weights";
+        case DNNL_ARG_BIAS: return "bias";
+        case DNNL_ARG_WORKSPACE: return "workspace";
+        case DNNL_ARG_DIFF_SRC: return "diff_src";
+        case DNNL_ARG_DIFF_DST: return "diff_dst";
+        case DNNL_ARG_DIFF_WEIGHTS: return "diff_weights";
+        case DNNL_ARG_DIFF_BIAS: return "diff_bias";
+        default: return "arg";
+    }
+}
+
+}  // namespace check
+
+// hash of the logical contents of a tensor: blocked layouts are reordered
+// to plain first, so two configurations that chose different layouts still
+// compare equal. 1 MB chunks hashed in parallel, combined in order
+inline uint64_t tensor_checksum(const dnnl::memory& mem) {
+    using namespace dnnl;
+    auto md = mem.get_desc();
+    auto dims = md.dims();
+    const memory::format_tag plain[] = {
+        memory::format_tag::undef, memory::format_tag::a,
+        memory::format_tag::ab,    memory::format_tag::abc,
+        memory::format_tag::abcd,  memory::format_tag::abcde};
+
+    memory flat = mem;
+    if (dims.size() >= 1 && dims.size() <= 5) {
+        memory::desc plain_md(dims, md.data_type(), plain[dims.size()]);
+        if (plain_md != md) {
+            flat = memory(plain_md, mem.get_engine());
+            stream s(mem.get_engine());
+            memory src = mem;
+            reorder(src, flat).execute(s, src, flat);
+            s.wait();
+        }
+    }
+
+    const size_t bytes = flat.get_desc().get_size();
+    const size_t chunk = 1 << 20;
+    const long chunks = (long)((bytes + chunk - 1) / chunk);
+    std::vector<uint64_t> partial(chunks);
+    auto data = static_cast<const unsigned char*>(flat.map_data());
+    PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+    for (long c = 0; c < chunks; ++c)
+        partial[c] = check::fnv1a(data + c * chunk,
+                                  std::min(chunk, bytes - c * chunk));
+    flat.unmap_data(const_cast<unsigned char*>(data));
+    return check::fnv1a(reinterpret_cast<const unsigned char*>(partial.data()),
+                        partial.size() * sizeof(uint64_t));
+}
+
+// one line per distinct tensor of the net, in execution order:
+// "<cat> #<index> <primitive> <arg> <dims> <hash>"; diff two files to find
+// the first layer where two configurations part
+inline void checksum_net(
+    std::ostream& out, const char* cat,
+    const std::vector<dnnl::primitive>& net,
+    const std::vector<std::unordered_map<int, dnnl::memory>>& net_args) {
+    std::unordered_set<void*> seen;
+    for (size_t i = 0; i < net.size() && i < net_args.size(); ++i) {
+        // unordered_map order is unspecified, print args sorted
+        std::vector<std::pair<int, dnnl::memory>> args(net_args[i].begin(),
+                                                       net_args[i].end());
+        std::sort(args.begin(), args.end(),
+                  [](const std::pair<int, dnnl::memory>& a,
+                     const std::pair<int, dnnl::memory>& b) {
+                      return a.first < b.first;
+                  });
+        for (auto& a : args) {
+            if (!seen.insert(a.second.get_data_handle()).second) continue;
+            out << cat << " #" << i << " " << trace_primitive_name(net[i])
+                << " " << check::arg_name(a.first) << " ";
+            auto dims = a.second.get_desc().dims();
+            for (size_t d = 0; d < dims.size(); ++d)
+                out << (d ? "x" : "") << dims[d];
+            out << " " << std::hex << std::setw(16) << std::setfill('0')
+                << tensor_checksum(a.second) << std::dec << std::setfill(' ')
+                << std::endl;
+        }
+    }
+}
+
+#endif
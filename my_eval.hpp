@@ -0,0 +1,102 @@
+#ifndef MY_EVAL
+#define MY_EVAL
+
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "oneapi/dnnl/dnnl.hpp"
+
+class ConfusionMatrix {
+    // streaming top-1 accuracy and confusion matrix: rows of softmax output
+    // are consumed batch by batch straight from the mapped dst memory
+public:
+    static const int classes = 10;
+
+    // rows of y_hat ({rows, classes}) against their labels
+    void add(const float* y_hat, const uint8_t* labels, int64_t rows);
+    int64_t count(int truth, int pred) const { return counts[truth][pred]; }
+    int64_t total() const;
+    float top1() const;
+    void print(std::ostream& out) const;
+
+private:
+    int64_t counts[classes][classes] = {};
+};
+
+void ConfusionMatrix::add(const float* y_hat, const uint8_t* labels,
+                          int64_t rows) {
+    for (int64_t i = 0; i < rows; ++i) {
+        const float* row = y_hat + i * classes;
+        int pred = std::max_element(row, row + classes) - row;
+        ++counts[labels[i]][pred];
+    }
+}
+
+int64_t ConfusionMatrix::total() const {
+    int64_t n = 0;
+    for (int t = 0; t < classes; ++t)
+        for (int p = 0; p < classes; ++p)
+            n += counts[t][p];
+    return n;
+}
+
+float ConfusionMatrix::top1() const {
+    int64_t hits = 0;
+    for (int c = 0; c < classes; ++c)
+        hits += counts[c][c];
+    return (float)hits / std::max(total(), (int64_t)1);
+}
+
+void ConfusionMatrix::print(std::ostream& out) const {
+    // rows: true class, columns: predicted class
+    for (int t = 0; t < classes; ++t) {
+        for (int p = 0; p < classes; ++p)
+            out << std::setw(6) << counts[t][p];
+        out << std::endl;
+    }
+}
+
+// disjoint cpu sets for training and evaluation: the last `eval_cores` of
+// the cpus this process may run on go to evaluation
+struct CoreSets {
+    cpu_set_t train, eval;
+};
+
+inline CoreSets split_cores(int eval_cores) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    int reserve = std::min(eval_cores, CPU_COUNT(&allowed) - 1);
+
+    CoreSets sets;
+    CPU_ZERO(&sets.train);
+    CPU_ZERO(&sets.eval);
+    for (int cpu = CPU_SETSIZE - 1; cpu >= 0; --cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (reserve-- > 0)
+            CPU_SET(cpu, &sets.eval);
+        else
+            CPU_SET(cpu, &sets.train);
+    }
+    return sets;
+}
+
+// pin the calling thread and its OpenMP team to `cores`, the team sized
+// to them. A new team would inherit the mask, but a reused one keeps the
+// affinity it was created with, so every member pins itself here
+inline void pin_thread(const cpu_set_t& cores) {
+    pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+#ifdef _OPENMP
+    omp_set_num_threads(CPU_COUNT(&cores));
+#pragma omp parallel
+    pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+#endif
+}
+
+#endif
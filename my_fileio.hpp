@@ -0,0 +1,91 @@
+#ifndef MY_FILEIO
+#define MY_FILEIO
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+// POSIX file helpers shared by the shard writer and the checkpoint saver:
+// full reads and writes that retry short transfers and EINTR, and the
+// tmp -> fsync -> rename -> directory fsync sequence that makes a file
+// appear on disk either whole or not at all.
+
+namespace fileio {
+
+// false at end of file or on error (errno set)
+inline bool read_all(int fd, void* buf, size_t bytes) {
+    char* p = static_cast<char*>(buf);
+    while (bytes > 0) {
+        ssize_t got = read(fd, p, bytes);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        p += got;
+        bytes -= got;
+    }
+    return true;
+}
+
+inline bool write_all(int fd, const void* buf, size_t bytes) {
+    const char* p = static_cast<const char*>(buf);
+    while (bytes > 0) {
+        ssize_t put = write(fd, p, bytes);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return false;
+        p += put;
+        bytes -= put;
+    }
+    return true;
+}
+
+// directory holding `path`
+inline std::string dir_of(const std::string& path) {
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos) return ".";
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+// flush `path`, a file or a directory, to disk
+inline void sync_path(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    bool ok = fd >= 0 && fsync(fd) == 0;
+    int saved_errno = errno;
+    if (fd >= 0) close(fd);
+    if (!ok)
+        throw std::runtime_error("cannot sync " + path + ": " +
+                                 strerror(saved_errno));
+}
+
+// write_body(fd) fills <path>.tmp, returning false (errno set) on error;
+// the file is then fsynced, renamed over `path` and its directory synced,
+// so a crash leaves either the previous `path` or the whole new one.
+// Throws on any failure, the previous `path` untouched
+template <typename F>
+void write_file_atomic(const std::string& path, F&& write_body) {
+    const std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && write_body(fd) && fsync(fd) == 0;
+    int saved_errno = errno;
+    if (fd >= 0 && close(fd) != 0 && ok) {
+        ok = false;
+        saved_errno = errno;
+    }
+    if (ok && rename(tmp.c_str(), path.c_str()) != 0) {
+        ok = false;
+        saved_errno = errno;
+    }
+    if (!ok) {
+        unlink(tmp.c_str());
+        throw std::runtime_error("cannot write " + path + ": " +
+                                 strerror(saved_errno));
+    }
+    // the rename itself is durable once the directory is synced
+    sync_path(dir_of(path));
+}
+
+}  // namespace fileio
+
+#endif
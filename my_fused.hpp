@@ -0,0 +1,383 @@
+#ifndef MY_FUSED
+#define MY_FUSED
+
+#include <unistd.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "example_utils.hpp"
+#include "my_memory.hpp"
+#include "oneapi/dnnl/dnnl.hpp"
+
+using namespace dnnl;
+using tag = memory::format_tag;
+using dt = memory::data_type;
+
+// Depth-first inference of VGG11 blocks 1 and 2. Layer by layer,
+// conv1 -> relu -> pool1 -> conv2 -> relu -> pool2 writes and reads back
+// {N, 64, H, W} and {N, 128, H/2, W/2}, far more than any cache holds.
+// Here every image is cut into bands of pool2 rows, and a band goes through
+// the whole chain before the next one starts, its intermediates in buffers
+// of the thread running it, sized to stay in L2. conv2 needs one pool1 row
+// above and below the band (the halo), i.e. two more conv1 rows each side,
+// which the neighbouring bands compute again.
+//
+// Bands are spread over the OpenMP team; a oneDNN primitive executed from
+// inside the team runs on the calling thread only, so each thread has its
+// own stream, scratchpad and intermediates.
+
+namespace fused {
+
+inline size_t l2_bytes() {
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    return l2 > 0 ? (size_t)l2 : (size_t)1 << 20;
+}
+
+// one image and `rows` rows of md with the strides of the whole tensor:
+// a band of it, once the handle points at the band's first row. H must not
+// be blocked, which holds for every layout oneDNN picks for activations
+inline memory::desc rows_view(const memory::desc& md, memory::dim rows) {
+    dnnl_memory_desc_t view = md.data;
+    view.dims[0] = view.padded_dims[0] = 1;
+    view.dims[2] = view.padded_dims[2] = rows;
+    view.offset0 = 0;
+    return memory::desc(view);
+}
+
+// elements from the start of md to (n, 0, row, 0)
+inline memory::dim row_offset(const memory::desc& md, memory::dim n,
+                              memory::dim row) {
+    const auto& strides = md.data.format_desc.blocking.strides;
+    return md.data.offset0 + n * strides[0] + row * strides[2];
+}
+
+}  // namespace fused
+
+class DepthFirstBlocks {
+public:
+    // src_memory {N, C, H, W} f32, H and W multiples of 4; the weights are
+    // the trained ones (any layout), copied into packed ones by pack()
+    DepthFirstBlocks(engine eng, const memory& src_memory,
+                     const memory& conv1_weights, const memory& conv1_bias,
+                     const memory& conv2_weights, const memory& conv2_bias,
+                     float negative_slope,
+                     size_t cache_bytes = fused::l2_bytes());
+    ~DepthFirstBlocks() = default;
+    DepthFirstBlocks(const DepthFirstBlocks&) = delete;
+
+    // copy the trained weights again, after they changed
+    void pack();
+    // the whole batch, called from outside any parallel region
+    void execute();
+    // {N, C2, H/4, W/4} in the layout a layer-by-layer pool2 would pick
+    memory dst_memory() const { return dst_m; }
+    // pool2 rows per band
+    memory::dim band_rows() const { return band_m; }
+    // intermediates of one band, per thread
+    size_t scratch_bytes() const { return scratch_bytes_m; }
+
+private:
+    // the first, last, middle and only band have different halos, hence
+    // different shapes; index 2 * first + last
+    struct BandShape {
+        bool used = false;
+        reorder::primitive_desc load_pd, store_pd;
+        convolution_forward::primitive_desc conv1_pd, conv2_pd;
+        pooling_forward::primitive_desc pool1_pd, pool2_pd;
+        std::vector<primitive> prims;  // load, conv1, pool1, conv2, pool2,
+                                       // store
+    };
+    struct ThreadScratch {
+        stream s;
+        // raw buffers, viewed with the descs of the band being run
+        memory src, conv1, pool1, conv2, pool2, scratchpad;
+    };
+
+    void make_shape(bool first, bool last, float negative_slope);
+
+    engine eng_m;
+    memory src_m, dst_m;
+    memory trained_m[4];  // conv1 weights, bias, conv2 weights, bias
+    memory packed_m[4];
+    memory::dim n_m, c_m, c1_m, c2_m, h_m, w_m, band_m;
+    size_t scratch_bytes_m = 0;
+    BandShape shapes_m[4];
+    std::vector<ThreadScratch> threads_m;
+};
+
+DepthFirstBlocks::DepthFirstBlocks(engine eng, const memory& src_memory,
+                                   const memory& conv1_weights,
+                                   const memory& conv1_bias,
+                                   const memory& conv2_weights,
+                                   const memory& conv2_bias,
+                                   float negative_slope, size_t cache_bytes)
+    : eng_m(eng),
+      src_m(src_memory),
+      trained_m{conv1_weights, conv1_bias, conv2_weights, conv2_bias} {
+    auto src_tz = src_memory.get_desc().dims();
+    n_m = src_tz[0];
+    c_m = src_tz[1];
+    h_m = src_tz[2];
+    w_m = src_tz[3];
+    c1_m = conv1_weights.get_desc().dims()[0];
+    c2_m = conv2_weights.get_desc().dims()[0];
+
+    // largest band whose intermediates fit in cache_bytes: conv1 src and
+    // dst of 4 * rows + halo rows, pool1 dst, conv2 dst, pool2 dst
+    const memory::dim h2 = h_m / 4;
+    band_m = 1;
+    for (memory::dim rows = h2; rows >= 1; --rows) {
+        if (h2 % rows) continue;
+        size_t floats = c_m * (4 * rows + 6) * w_m +
+                        c1_m * (4 * rows + 4) * w_m +
+                        c1_m * (2 * rows + 2) * (w_m / 2) +
+                        c2_m * 2 * rows * (w_m / 2) + c2_m * rows * (w_m / 4);
+        if (floats * sizeof(float) <= cache_bytes) {
+            band_m = rows;
+            break;
+        }
+    }
+
+    // dst in the layout layer-by-layer conv2 + pool2 would produce
+    const memory::dims conv_strides = {1, 1}, conv_padding = {1, 1};
+    const memory::dims pool_kernel = {2, 2}, pool_padding = {0, 0};
+    auto conv2_desc = convolution_forward::desc(
+        prop_kind::forward_inference, algorithm::convolution_direct,
+        memory::desc({n_m, c1_m, h_m / 2, w_m / 2}, dt::f32, tag::any),
+        memory::desc(conv2_weights.get_desc().dims(), dt::f32, tag::any),
+        memory::desc({c2_m}, dt::f32, tag::any),
+        memory::desc({n_m, c2_m, h_m / 2, w_m / 2}, dt::f32, tag::any),
+        conv_strides, conv_padding, conv_padding);
+    auto conv2_pd = convolution_forward::primitive_desc(conv2_desc, eng);
+    auto pool2_desc = pooling_forward::desc(
+        prop_kind::forward_inference, algorithm::pooling_max,
+        conv2_pd.dst_desc(),
+        memory::desc({n_m, c2_m, h2, w_m / 4}, dt::f32, tag::any),
+        pool_kernel, pool_kernel, pool_padding, pool_padding);
+    auto pool2_pd = pooling_forward::primitive_desc(pool2_desc, eng);
+    dst_m = make_memory(pool2_pd.dst_desc(), eng);
+
+    for (memory::dim r0 = 0; r0 < h2; r0 += band_m) {
+        int shape = 2 * (r0 == 0) + (r0 + band_m == h2);
+        if (!shapes_m[shape].used)
+            make_shape(r0 == 0, r0 + band_m == h2, negative_slope);
+    }
+
+    // per thread buffers, large enough for every band shape
+    size_t bytes[6] = {};
+    for (auto& b : shapes_m) {
+        if (!b.used) continue;
+        memory::desc mds[5] = {b.load_pd.dst_desc(), b.conv1_pd.dst_desc(),
+                               b.pool1_pd.dst_desc(), b.conv2_pd.dst_desc(),
+                               b.pool2_pd.dst_desc()};
+        for (int i = 0; i < 5; ++i)
+            bytes[i] = std::max(bytes[i], mds[i].get_size());
+        memory::desc pads[6] = {
+            b.load_pd.scratchpad_desc(),  b.conv1_pd.scratchpad_desc(),
+            b.pool1_pd.scratchpad_desc(), b.conv2_pd.scratchpad_desc(),
+            b.pool2_pd.scratchpad_desc(), b.store_pd.scratchpad_desc()};
+        for (auto& pad : pads)
+            bytes[5] = std::max(bytes[5], pad.get_size());
+    }
+    for (int i = 0; i < 5; ++i)
+        scratch_bytes_m += bytes[i];
+
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    threads_m.resize(threads);
+    for (auto& t : threads_m) {
+        memory* bufs[6] = {&t.src,   &t.conv1, &t.pool1,
+                           &t.conv2, &t.pool2, &t.scratchpad};
+        for (int i = 0; i < 6; ++i)
+            *bufs[i] = make_memory(
+                memory::desc({(memory::dim)std::max(bytes[i], (size_t)1)},
+                             dt::u8, tag::x),
+                eng);
+        t.s = stream(eng);
+    }
+
+    pack();
+}
+
+void DepthFirstBlocks::make_shape(bool first, bool last,
+                                  float negative_slope) {
+    // pool1 rows of the band: 2 * rows, plus the halo rows that exist;
+    // conv1 dst rows: twice that; conv1 src rows: plus 1 each side
+    // unless that side is the image border, where convolution pads
+    const memory::dim p1_rows = 2 * band_m + !first + !last;
+    const memory::dim c1_rows = 2 * p1_rows;
+    const memory::dim in_rows = c1_rows + !first + !last;
+    const memory::dims conv_strides = {1, 1};
+    const memory::dims padding_l = {first, 1}, padding_r = {last, 1};
+    const memory::dims pool_kernel = {2, 2}, pool_padding = {0, 0};
+
+    primitive_attr attr;  // the scratchpad is per thread
+    attr.set_scratchpad_mode(scratchpad_mode::user);
+    post_ops relu_ops;
+    relu_ops.append_eltwise(1.0f, algorithm::eltwise_relu, negative_slope,
+                            0.0f);
+    primitive_attr relu_attr;
+    relu_attr.set_scratchpad_mode(scratchpad_mode::user);
+    relu_attr.set_post_ops(relu_ops);
+
+    // packed weights as chosen for the first shape, the others follow
+    auto packed_md = [&](int i) {
+        return packed_m[i] ? packed_m[i].get_desc()
+                           : memory::desc(trained_m[i].get_desc().dims(),
+                                          dt::f32, tag::any);
+    };
+
+    BandShape& b = shapes_m[2 * first + last];
+    auto src_md = memory::desc({1, c_m, in_rows, w_m}, dt::f32, tag::nchw);
+    b.load_pd = reorder::primitive_desc(
+        eng_m, fused::rows_view(src_m.get_desc(), in_rows), eng_m, src_md,
+        attr);
+
+    auto conv1_desc = convolution_forward::desc(
+        prop_kind::forward_inference, algorithm::convolution_direct, src_md,
+        packed_md(0), packed_md(1),
+        memory::desc({1, c1_m, c1_rows, w_m}, dt::f32, tag::any),
+        conv_strides, padding_l, padding_r);
+    b.conv1_pd =
+        convolution_forward::primitive_desc(conv1_desc, relu_attr, eng_m);
+
+    auto pool1_desc = pooling_forward::desc(
+        prop_kind::forward_inference, algorithm::pooling_max,
+        b.conv1_pd.dst_desc(),
+        memory::desc({1, c1_m, p1_rows, w_m / 2}, dt::f32, tag::any),
+        pool_kernel, pool_kernel, pool_padding, pool_padding);
+    b.pool1_pd = pooling_forward::primitive_desc(pool1_desc, attr, eng_m);
+
+    auto conv2_desc = convolution_forward::desc(
+        prop_kind::forward_inference, algorithm::convolution_direct,
+        b.pool1_pd.dst_desc(), packed_md(2), packed_md(3),
+        memory::desc({1, c2_m, 2 * band_m, w_m / 2}, dt::f32, tag::any),
+        conv_strides, padding_l, padding_r);
+    b.conv2_pd =
+        convolution_forward::primitive_desc(conv2_desc, relu_attr, eng_m);
+
+    auto pool2_desc = pooling_forward::desc(
+        prop_kind::forward_inference, algorithm::pooling_max,
+        b.conv2_pd.dst_desc(),
+        memory::desc({1, c2_m, band_m, w_m / 4}, dt::f32, tag::any),
+        pool_kernel, pool_kernel, pool_padding, pool_padding);
+    b.pool2_pd = pooling_forward::primitive_desc(pool2_desc, attr, eng_m);
+
+    b.store_pd = reorder::primitive_desc(
+        eng_m, b.pool2_pd.dst_desc(), eng_m,
+        fused::rows_view(dst_m.get_desc(), band_m), attr);
+
+    if (!packed_m[0]) {
+        packed_m[0] = make_memory(b.conv1_pd.weights_desc(), eng_m);
+        packed_m[1] = make_memory(b.conv1_pd.bias_desc(), eng_m);
+        packed_m[2] = make_memory(b.conv2_pd.weights_desc(), eng_m);
+        packed_m[3] = make_memory(b.conv2_pd.bias_desc(), eng_m);
+    }
+
+    b.prims = {reorder(b.load_pd),
+               convolution_forward(b.conv1_pd),
+               pooling_forward(b.pool1_pd),
+               convolution_forward(b.conv2_pd),
+               pooling_forward(b.pool2_pd),
+               reorder(b.store_pd)};
+    b.used = true;
+}
+
+void DepthFirstBlocks::pack() {
+    stream s(eng_m);
+    for (int i = 0; i < 4; ++i)
+        reorder(trained_m[i], packed_m[i]).execute(s, trained_m[i],
+                                                   packed_m[i]);
+    s.wait();
+}
+
+void DepthFirstBlocks::execute() {
+    const memory::dim h2 = h_m / 4;
+    const memory::dim bands = h2 / band_m;
+    const long jobs = (long)(n_m * bands);
+    auto src = static_cast<float*>(src_m.get_data_handle());
+    auto dst = static_cast<float*>(dst_m.get_data_handle());
+    const auto src_md = src_m.get_desc();
+    const auto dst_md = dst_m.get_desc();
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads((int)threads_m.size())
+#endif
+    {
+        int t = 0;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        ThreadScratch& ts = threads_m[t];
+        // memories over the thread's buffers, per band shape
+        std::vector<std::unordered_map<int, memory>> args[4];
+        memory src_view[4], dst_view[4];
+        for (int k = 0; k < 4; ++k) {
+            const BandShape& b = shapes_m[k];
+            if (!b.used) continue;
+            src_view[k] = memory(b.load_pd.src_desc(), eng_m, src);
+            dst_view[k] = memory(b.store_pd.dst_desc(), eng_m, dst);
+            memory tile[5];
+            memory::desc mds[5] = {b.load_pd.dst_desc(), b.conv1_pd.dst_desc(),
+                                   b.pool1_pd.dst_desc(),
+                                   b.conv2_pd.dst_desc(),
+                                   b.pool2_pd.dst_desc()};
+            const memory* bufs[5] = {&ts.src, &ts.conv1, &ts.pool1, &ts.conv2,
+                                     &ts.pool2};
+            for (int i = 0; i < 5; ++i)
+                tile[i] = memory(mds[i], eng_m, bufs[i]->get_data_handle());
+            auto with_pad = [&](const primitive_desc_base& pd) {
+                return memory(pd.scratchpad_desc(), eng_m,
+                              ts.scratchpad.get_data_handle());
+            };
+            args[k] = {
+                {{DNNL_ARG_FROM, src_view[k]},
+                 {DNNL_ARG_TO, tile[0]},
+                 {DNNL_ARG_SCRATCHPAD, with_pad(b.load_pd)}},
+                {{DNNL_ARG_SRC, tile[0]},
+                 {DNNL_ARG_WEIGHTS, packed_m[0]},
+                 {DNNL_ARG_BIAS, packed_m[1]},
+                 {DNNL_ARG_DST, tile[1]},
+                 {DNNL_ARG_SCRATCHPAD, with_pad(b.conv1_pd)}},
+                {{DNNL_ARG_SRC, tile[1]},
+                 {DNNL_ARG_DST, tile[2]},
+                 {DNNL_ARG_SCRATCHPAD, with_pad(b.pool1_pd)}},
+                {{DNNL_ARG_SRC, tile[2]},
+                 {DNNL_ARG_WEIGHTS, packed_m[2]},
+                 {DNNL_ARG_BIAS, packed_m[3]},
+                 {DNNL_ARG_DST, tile[3]},
+                 {DNNL_ARG_SCRATCHPAD, with_pad(b.conv2_pd)}},
+                {{DNNL_ARG_SRC, tile[3]},
+                 {DNNL_ARG_DST, tile[4]},
+                 {DNNL_ARG_SCRATCHPAD, with_pad(b.pool2_pd)}},
+                {{DNNL_ARG_FROM, tile[4]},
+                 {DNNL_ARG_TO, dst_view[k]},
+                 {DNNL_ARG_SCRATCHPAD, with_pad(b.store_pd)}}};
+        }
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+        for (long job = 0; job < jobs; ++job) {
+            memory::dim n = job / bands, r0 = job % bands * band_m;
+            int k = 2 * (r0 == 0) + (r0 + band_m == h2);
+            // first conv1 src row: 4 * r0 less the halo, 3 rows above
+            memory::dim row = r0 == 0 ? 0 : 4 * r0 - 3;
+            src_view[k].set_data_handle(
+                src + fused::row_offset(src_md, n, row));
+            dst_view[k].set_data_handle(
+                dst + fused::row_offset(dst_md, n, r0));
+            const auto& prims = shapes_m[k].prims;
+            for (size_t i = 0; i < prims.size(); ++i)
+                prims[i].execute(ts.s, args[k][i]);
+            ts.s.wait();
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef MY_GEMV
+#define MY_GEMV
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "example_utils.hpp"
+#include "my_memory.hpp"
+#include "oneapi/dnnl/dnnl.hpp"
+
+using namespace dnnl;
+using tag = memory::format_tag;
+using dt = memory::data_type;
+
+// Batch-1 Dense for latency. At batch 1 an inner product is a matrix-vector
+// product, bound by reading the weights once: fc1-fc4 stream about 120M
+// floats per image and reuse none of them. The weights are packed in tiles
+// of 16 rows, column-major within the tile, so every step over the input
+// reads one whole cache line and feeds 16 independent accumulators. Tiles
+// are split across the OpenMP team, bias and relu are applied as each
+// tile finishes, and the weights are prefetched with a non-temporal hint
+// so they do not evict the activations from the cache.
+
+namespace gemv {
+
+const int TILE = 16;           // rows per tile, 64 bytes of f32
+const int PREFETCH_LINES = 8;  // cache lines read ahead within a tile
+
+}  // namespace gemv
+
+class DenseGemv {
+public:
+    // src_memory {1, ...} in any layout, reordered to plain first if
+    // needed; trained_weights {out, ...} (any layout) and trained_bias are
+    // copied into the packed layout by pack()
+    DenseGemv(engine eng, const memory& src_memory,
+              const memory& trained_weights, const memory& trained_bias,
+              bool relu, float negative_slope = 0.0f);
+    ~DenseGemv() = default;
+    DenseGemv(const DenseGemv&) = delete;
+
+    // pack the trained weights again, after they changed
+    void pack();
+    // s runs the src reorder; called from outside any parallel region
+    void execute(stream& s);
+    // {1, out} nc
+    memory dst_memory() const { return dst_m; }
+    size_t weights_bytes() const { return packed_m.get_desc().get_size(); }
+
+private:
+    engine eng_m;
+    memory src_m, plain_src_m, dst_m;
+    memory trained_weights_m, trained_bias_m;
+    memory packed_m;
+    reorder src_reorder_m;
+    std::vector<float> bias_m;  // padded to whole tiles
+    bool reorder_src_m;
+    bool relu_m;
+    float negative_slope_m;
+    memory::dim in_m, out_m, tiles_m;
+};
+
+DenseGemv::DenseGemv(engine eng, const memory& src_memory,
+                     const memory& trained_weights, const memory& trained_bias,
+                     bool relu, float negative_slope)
+    : eng_m(eng),
+      src_m(src_memory),
+      trained_weights_m(trained_weights),
+      trained_bias_m(trained_bias),
+      relu_m(relu),
+      negative_slope_m(negative_slope) {
+    auto src_tz = src_memory.get_desc().dims();
+    if (src_tz[0] != 1) throw std::runtime_error("DenseGemv: batch 1 only");
+    out_m = trained_weights.get_desc().dims()[0];
+    in_m = product(src_tz);
+    tiles_m = (out_m + gemv::TILE - 1) / gemv::TILE;
+
+    // the packed columns follow the plain order of src
+    const tag plain[] = {tag::undef, tag::a,    tag::ab,
+                         tag::abc,   tag::abcd, tag::abcde};
+    auto plain_md = memory::desc(src_tz, dt::f32, plain[src_tz.size()]);
+    reorder_src_m = plain_md != src_memory.get_desc();
+    plain_src_m = reorder_src_m ? make_memory(plain_md, eng) : src_memory;
+    if (reorder_src_m) src_reorder_m = reorder(src_memory, plain_src_m);
+
+    dst_m = make_memory({{1, out_m}, dt::f32, tag::nc}, eng);
+    packed_m = make_memory({{tiles_m * gemv::TILE * in_m}, dt::f32, tag::a},
+                           eng);
+    bias_m.assign(tiles_m * gemv::TILE, 0.0f);
+    pack();
+}
+
+void DenseGemv::pack() {
+    auto weights_tz = trained_weights_m.get_desc().dims();
+    const tag plain = weights_tz.size() == 2 ? tag::oi : tag::oihw;
+    auto plain_weights = make_memory({weights_tz, dt::f32, plain}, eng_m);
+    stream s(eng_m);
+    reorder(trained_weights_m, plain_weights)
+        .execute(s, trained_weights_m, plain_weights);
+    s.wait();
+
+    const float* w = plain_weights.map_data<float>();
+    float* packed = packed_m.map_data<float>();
+    const memory::dim in = in_m, out = out_m;
+    PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+    for (memory::dim t = 0; t < tiles_m; ++t) {
+        float* tile = packed + t * in * gemv::TILE;
+        for (memory::dim k = 0; k < in; ++k)
+            for (int r = 0; r < gemv::TILE; ++r) {
+                memory::dim row = t * gemv::TILE + r;
+                tile[k * gemv::TILE + r] = row < out ? w[row * in + k] : 0.0f;
+            }
+    }
+    packed_m.unmap_data(packed);
+    plain_weights.unmap_data(const_cast<float*>(w));
+
+    read_from_dnnl_memory(bias_m.data(), trained_bias_m);
+}
+
+void DenseGemv::execute(stream& s) {
+    if (reorder_src_m) {
+        src_reorder_m.execute(s, src_m, plain_src_m);
+        s.wait();
+    }
+    const float* x = plain_src_m.map_data<float>();
+    const float* packed = packed_m.map_data<float>();
+    float* y = dst_m.map_data<float>();
+    const memory::dim in = in_m, out = out_m;
+    const float* bias = bias_m.data();
+    const bool relu = relu_m;
+    const float slope = negative_slope_m;
+
+    PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+    for (memory::dim t = 0; t < tiles_m; ++t) {
+        const float* tile = packed + t * in * gemv::TILE;
+        float acc[gemv::TILE] = {};
+        for (memory::dim k = 0; k < in; ++k) {
+            // locality 0: prefetchnta on x86, read once, not kept
+            if (k + gemv::PREFETCH_LINES < in)
+                __builtin_prefetch(
+                    tile + (k + gemv::PREFETCH_LINES) * gemv::TILE, 0, 0);
+            const float xk = x[k];
+            const float* line = tile + k * gemv::TILE;
+            for (int r = 0; r < gemv::TILE; ++r)
+                acc[r] += line[r] * xk;
+        }
+        for (int r = 0; r < gemv::TILE; ++r) {
+            memory::dim row = t * gemv::TILE + r;
+            if (row >= out) break;
+            float v = acc[r] + bias[row];
+            y[row] = relu && v < 0 ? v * slope : v;
+        }
+    }
+
+    dst_m.unmap_data(y);
+    packed_m.unmap_data(const_cast<float*>(packed));
+    plain_src_m.unmap_data(const_cast<float*>(x));
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef MY_INIT
+#define MY_INIT
+
+#include <math.h>
+#include <cstdint>
+#include "example_utils.hpp"
+#include "oneapi/dnnl/dnnl.hpp"
+
+enum class weights_init {
+    he_normal,       // N(0, 2 / fan_in), layers followed by relu
+    xavier_uniform,  // U(-a, a), a = sqrt(6 / (fan_in + fan_out))
+    zeros,
+};
+
+const uint64_t INIT_SEED = 0x5eed;
+
+// counter-based RNG: the value of element i of stream `stream` depends
+// only on (seed, stream, i), never on which thread computes it
+inline uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline uint64_t counter_random(uint64_t seed, uint64_t stream,
+                               uint64_t i) {
+    return splitmix64(splitmix64(seed ^ splitmix64(stream)) + i);
+}
+
+// 24 random bits to a float in (0, 1]
+inline float to_unit_float(uint32_t bits) {
+    return ((bits >> 8) + 1) * (1.0f / (1 << 24));
+}
+
+// stream of tensor `tensor` (0 weights, 1 bias) of the layer named
+// `layer`: a hash of the name, so the values do not depend on how many
+// tensors were built before, nor on which graphs or benches exist
+inline uint64_t tensor_stream(const char* layer, uint64_t tensor = 0) {
+    uint64_t h = 0xcbf29ce484222325ULL;  // FNV-1a
+    for (; *layer; ++layer) h = (h ^ (uint8_t)*layer) * 0x100000001b3ULL;
+    return splitmix64(h) + tensor;
+}
+
+// fill `count` floats in parallel; no state is carried between elements
+inline void init_weights(float* data, size_t count, weights_init kind,
+                         dnnl::memory::dim fan_in, dnnl::memory::dim fan_out,
+                         uint64_t stream, uint64_t seed = INIT_SEED) {
+    const float two_pi = 6.28318530718f;
+    const float he_std = sqrtf(2.0f / fan_in);
+    const float xavier_limit = sqrtf(6.0f / (fan_in + fan_out));
+
+    switch (kind) {
+        case weights_init::he_normal:
+            PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+            for (long j = 0; j < (long)(count + 1) / 2; ++j) {
+                // Box-Muller, both normals of draw j: elements 2j and 2j + 1
+                uint64_t bits = counter_random(seed, stream, j);
+                float u1 = to_unit_float((uint32_t)bits);
+                float u2 = to_unit_float((uint32_t)(bits >> 32));
+                float r = he_std * sqrtf(-2.0f * logf(u1));
+                data[2 * j] = r * cosf(two_pi * u2);
+                if (2 * j + 1 < (long)count)
+                    data[2 * j + 1] = r * sinf(two_pi * u2);
+            }
+            break;
+        case weights_init::xavier_uniform:
+            PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+            for (long i = 0; i < (long)count; ++i) {
+                uint64_t bits = counter_random(seed, stream, i);
+                data[i] = xavier_limit *
+                          (2.0f * to_unit_float((uint32_t)bits) - 1.0f);
+            }
+            break;
+        case weights_init::zeros:
+            PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+            for (long i = 0; i < (long)count; ++i)
+                data[i] = 0.0f;
+            break;
+    }
+}
+
+// initialize a plain-layout memory in place: no staging buffer, no copy
+inline void init_weights(dnnl::memory& mem, weights_init kind,
+                         dnnl::memory::dim fan_in, dnnl::memory::dim fan_out,
+                         uint64_t stream, uint64_t seed = INIT_SEED) {
+    float* data = mem.map_data<float>();
+    init_weights(data, mem.get_desc().get_size() / sizeof(float), kind,
+                 fan_in, fan_out, stream, seed);
+    mem.unmap_data(data);
+}
+
+#endif
@@ -2,13 +2,82 @@
 #define MY_LAYERS
 
 #include <math.h>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <string>
 #include "example_utils.hpp"
+#include "my_check.hpp"
+#include "my_init.hpp"
+#include "my_lowrank.hpp"
+#include "my_memory.hpp"
 #include "oneapi/dnnl/dnnl.hpp"
 
 using namespace dnnl;
 using tag = memory::format_tag;
 using dt = memory::data_type;
 
+// layout of the activations of inference graphs, any lets oneDNN choose
+inline memory::format_tag& activation_format() {
+    static memory::format_tag format = tag::any;
+    return format;
+}
+
+// src_memory in the layout `md`, through a reorder appended to net if the
+// layouts differ
+inline memory reorder_if_needed(
+    engine eng, std::vector<primitive>& net,
+    std::vector<std::unordered_map<int, memory>>& net_args,
+    const memory& src_memory, const memory::desc& md) {
+    if (src_memory.get_desc() == md) return src_memory;
+    auto dst_memory = make_memory(md, eng);
+    net.push_back(reorder(src_memory, dst_memory));
+    net_args.push_back(
+        {{DNNL_ARG_FROM, src_memory}, {DNNL_ARG_TO, dst_memory}});
+    return dst_memory;
+}
+
+class ActivationScratch {
+    // activation checkpointing: the intermediates (conv/relu dst, pooling
+    // workspace) of every checkpointed block are not kept for
+    // backward but recomputed, so slot i of each block shares one buffer
+    // sized for the largest of them
+public:
+    ActivationScratch() = default;
+    ~ActivationScratch();
+    ActivationScratch(const ActivationScratch&) = delete;
+
+    void begin_block() { next_slot = 0; }
+    // memory without storage, valid after bind()
+    memory make(const memory::desc& md, const engine& eng);
+    // allocate the slots and point every memory made so far into them
+    void bind();
+    size_t bytes() const;
+
+private:
+    size_t next_slot = 0;
+    bool owns_slots = false;
+    std::vector<size_t> slot_size;
+    std::vector<void*> slot_ptr;
+    std::vector<std::pair<size_t, memory>> users;
+};
+
+// convolution algorithm of a layer: winograd falls back to direct where
+// no implementation exists (ISA, data type, shape); automatic times both
+// once per shape at graph build and keeps the faster
+enum class conv_algo { direct, winograd, automatic };
+
+// forward convolution pd for `algo`, see conv_algo; the algorithm it ended
+// up with goes to *chosen
+convolution_forward::primitive_desc make_conv_pd(
+    engine eng, prop_kind prop, conv_algo algo, const memory::desc& src_md,
+    const memory::desc& weights_md, const memory::desc& bias_md,
+    const memory::desc& dst_md, const memory::dims& strides,
+    const memory::dims& padding,
+    const primitive_attr& attr = primitive_attr(),
+    algorithm* chosen = nullptr);
+
 class Conv2DwithReLu {
 public:
     Conv2DwithReLu(engine eng, std::vector<primitive>& net,
@@ -16,29 +85,53 @@ public:
                    const memory& src_memory, const memory::dims& src_tz,
                    const memory::dims& dst_tz, const memory::dims& weights_tz,
                    const memory::dims& strides, const memory::dims& padding,
-                   const float& negative_slope);
+                   const float& negative_slope, const char* name,
+                   ActivationScratch* scratch = nullptr,
+                   conv_algo algo = conv_algo::direct);
+    // inference copy over another src (e.g. another batch size), relu fused
+    // as a post-op; weights are packed copies of trained_weights/bias,
+    // filled by snapshot()
+    Conv2DwithReLu(engine eng, std::vector<primitive>& net,
+                   std::vector<std::unordered_map<int, memory>>& net_args,
+                   const memory& src_memory, const memory::dims& dst_tz,
+                   const memory::dims& strides, const memory::dims& padding,
+                   const float& negative_slope, const memory& trained_weights,
+                   const memory& trained_bias,
+                   conv_algo algo = conv_algo::direct);
     ~Conv2DwithReLu() = default;
     Conv2DwithReLu(const Conv2DwithReLu& obj) =
         delete;  // ban copying to avoid some bugs
     memory dst_memory() const { return dst_m; }
     convolution_forward::primitive_desc conv_pd() const { return pd1_m; }
     eltwise_forward::primitive_desc relu_pd() const { return pd2_m; }
-
-    memory conv_dst_memory, weights_memory;  // for backward
+    // the algorithm conv_pd() ended up with, for backward
+    algorithm conv_algorithm() const { return algo_m; }
+    // append conv and relu forward again, for a checkpointed block
+    void recompute(std::vector<primitive>& net,
+                   std::vector<std::unordered_map<int, memory>>& net_args) const;
+    // append the copy of the trained weights, for an inference copy
+    void snapshot(std::vector<primitive>& net,
+                  std::vector<std::unordered_map<int, memory>>& net_args) const;
+
+    memory weights_memory;  // for backward
+    memory bias_memory;     // for weights update
 
 private:
-    std::vector<float> weights;
-    std::vector<float> bias;
+    memory trained_weights_m, trained_bias_m;
     memory dst_m;
     convolution_forward::primitive_desc pd1_m;
     eltwise_forward::primitive_desc pd2_m;
+    algorithm algo_m = algorithm::convolution_direct;
+    std::vector<primitive> fwd_m;
+    std::vector<std::unordered_map<int, memory>> fwd_args_m;
 };
 
 class Conv2DwithReLu_back {
-    // firstly backward relu, calc diff_relu_src based on diff_dst and relu_src
+    // firstly backward relu, calc diff_relu_src based on diff_dst and relu_dst
+    // (in place: diff_relu_src overwrites diff_dst)
     // secondly backward conv: calc diff_weights and diff_bias based on diff_conv_dst and src;
     // calc diff_src based on diff_dst and weights
-    // remember there are always (diff_relu_src == diff_conv_dst) and (relu_src == conv_dst)
+    // remember there are always (diff_relu_src == diff_conv_dst) and (relu_dst == conv_dst)
 public:
     Conv2DwithReLu_back(engine eng, std::vector<primitive>& net,
                         std::vector<std::unordered_map<int, memory>>& net_args,
@@ -47,7 +140,7 @@ public:
                         const memory::dims& padding,
                         const memory& diff_dst_memory, const memory& src_memory,
                         const Conv2DwithReLu& conv_fwd,
-                        float negative_slope = 0.0f);
+                        float negative_slope = 0.0f, bool relu_done = false);
     ~Conv2DwithReLu_back() = default;
     Conv2DwithReLu_back(const Conv2DwithReLu_back&) = delete;
 
@@ -61,68 +154,161 @@ public:
                std::vector<std::unordered_map<int, memory>>& net_args,
                const memory& src_memory, const memory::dims& kernel,
                const memory::dims& dst_tz, const memory::dims& strides,
-               const memory::dims& padding, bool trained = true);
+               const memory::dims& padding, bool trained = true,
+               ActivationScratch* scratch = nullptr);
     ~MaxPooling() = default;
     MaxPooling(const MaxPooling& obj) =
         delete;  // ban copying to avoid some bugs
     memory dst_memory() const { return dst_m; }
     pooling_forward::primitive_desc prim_desc() const { return pd_m; }
+    // append pooling forward again to regenerate the workspace
+    void recompute(std::vector<primitive>& net,
+                   std::vector<std::unordered_map<int, memory>>& net_args) const;
     memory workspace_memory;
 
 private:
     bool iftrain;
     memory dst_m;
     pooling_forward::primitive_desc pd_m;
+    std::unordered_map<int, memory> args_m;
 };
 
 class MaxPooling_back {
     // calc diff_src based on diff_dst and workspace
+    // with relu_src, src is a relu output and its backward is applied first,
+    // to diff_dst in place: the max of a window is the relu output at the
+    // argmax, so masking by dst is exact, on a quarter of the elements, and
+    // diff_src feeds conv backward directly (relu_done there)
 public:
     MaxPooling_back(engine eng, std::vector<primitive>& net,
                     std::vector<std::unordered_map<int, memory>>& net_args,
                     const memory::dims& kernel, const memory::dims& strides,
                     const memory::dims& padding, const memory& diff_dst_memory,
-                    const memory& src_memory, const MaxPooling& pool_bwd);
+                    const memory& src_memory, const MaxPooling& pool_bwd,
+                    bool relu_src = false, float negative_slope = 0.0f);
     ~MaxPooling_back() = default;
     MaxPooling_back(const MaxPooling_back&) = delete;
 
     memory diff_src_memory;
 };
 
+class GlobalAvgPooling {
+    // {batch, C, H, W} -> {batch, C, 1, 1}, one average per channel; no
+    // workspace, backward spreads diff_dst evenly over the H x W window
+public:
+    GlobalAvgPooling(engine eng, std::vector<primitive>& net,
+                     std::vector<std::unordered_map<int, memory>>& net_args,
+                     const memory& src_memory, const memory::dims& src_tz);
+    ~GlobalAvgPooling() = default;
+    GlobalAvgPooling(const GlobalAvgPooling&) = delete;
+    memory dst_memory() const { return dst_m; }
+    pooling_forward::primitive_desc prim_desc() const { return pd_m; }
+    memory::dims kernel() const { return kernel_m; }
+
+private:
+    memory dst_m;
+    memory::dims kernel_m;
+    pooling_forward::primitive_desc pd_m;
+};
+
+class GlobalAvgPooling_back {
+public:
+    GlobalAvgPooling_back(engine eng, std::vector<primitive>& net,
+                          std::vector<std::unordered_map<int, memory>>& net_args,
+                          const memory& diff_dst_memory,
+                          const memory& src_memory,
+                          const GlobalAvgPooling& pool_fwd);
+    ~GlobalAvgPooling_back() = default;
+    GlobalAvgPooling_back(const GlobalAvgPooling_back&) = delete;
+
+    memory diff_src_memory;
+};
+
 class Dense {
 public:
     Dense(engine eng, std::vector<primitive>& net,
           std::vector<std::unordered_map<int, memory>>& net_args,
           const memory& src_memory, const memory::dims& src_tz,
-          const memory::dims& dst_tz, const memory::dims& weights_tz);
+          const memory::dims& dst_tz, const memory::dims& weights_tz,
+          const char* name);
+    // inference copy over another src (e.g. batch 1), sharing the weights
+    Dense(engine eng, std::vector<primitive>& net,
+          std::vector<std::unordered_map<int, memory>>& net_args,
+          const memory& src_memory, const memory::dims& src_tz,
+          const memory::dims& dst_tz, const Dense& other);
+    // inference copy with packed copies of trained_weights/bias, filled by
+    // snapshot()
+    Dense(engine eng, std::vector<primitive>& net,
+          std::vector<std::unordered_map<int, memory>>& net_args,
+          const memory& src_memory, const memory::dims& dst_tz,
+          const memory& trained_weights, const memory& trained_bias);
     ~Dense() = default;
     Dense(const Dense& obj) = delete;
     memory dst_memory() const { return dst_m; }
     dnnl::inner_product_forward::primitive_desc prim_desc() const {
         return pd_m;
     }
+    void snapshot(std::vector<primitive>& net,
+                  std::vector<std::unordered_map<int, memory>>& net_args) const;
 
-    memory weights_memory;
+    memory weights_memory, bias_memory;
 
 private:
-    std::vector<float> weights;
-    std::vector<float> bias;
+    memory trained_weights_m, trained_bias_m;
     memory dst_m;
     dnnl::inner_product_forward::primitive_desc pd_m;
 };
 
+class DenseLowRank {
+    // compressed Dense for inference: W (out x in) ~= B (out x rank) *
+    // A (rank x in), run as two thin inner products src -> rank -> dst,
+    // rank * (in + out) weights instead of in * out
+public:
+    // factorize the trained weights of dense_fwd (truncated SVD); dst is
+    // written into dst_memory if given
+    DenseLowRank(engine eng, std::vector<primitive>& net,
+                 std::vector<std::unordered_map<int, memory>>& net_args,
+                 const memory& src_memory, const memory::dims& src_tz,
+                 const memory::dims& dst_tz, const Dense& dense_fwd,
+                 memory::dim rank, const memory& dst_memory = memory());
+    // inference copy over another src, sharing the factors of other
+    DenseLowRank(engine eng, std::vector<primitive>& net,
+                 std::vector<std::unordered_map<int, memory>>& net_args,
+                 const memory& src_memory, const memory::dims& src_tz,
+                 const memory::dims& dst_tz, const DenseLowRank& other,
+                 const memory& dst_memory = memory());
+    ~DenseLowRank() = default;
+    DenseLowRank(const DenseLowRank& obj) = delete;
+    memory dst_memory() const { return dst_m; }
+    size_t weights_bytes() const;
+    float error() const { return error_m; }  // ||W - B A|| / ||W||
+
+    memory a_weights_memory, b_weights_memory, bias_memory;
+
+private:
+    void build(engine eng, std::vector<primitive>& net,
+               std::vector<std::unordered_map<int, memory>>& net_args,
+               const memory& src_memory, const memory::dims& src_tz,
+               const memory::dims& dst_tz, const memory& dst_memory);
+
+    memory::dim rank_m;
+    float error_m = 0;
+    memory dst_m;
+};
+
 class ReLU {
 public:
     ReLU(engine eng, std::vector<primitive>& net,
          std::vector<std::unordered_map<int, memory>>& net_args,
          const memory& src_memory, const float& negative_slope) {
+        // in place, backward only needs dst
         auto desc = dnnl::eltwise_forward::desc(
-            dnnl::prop_kind::forward_training, algorithm::eltwise_relu,
-            src_memory.get_desc(), negative_slope);
+            dnnl::prop_kind::forward_training,
+            algorithm::eltwise_relu_use_dst_for_bwd, src_memory.get_desc(),
+            negative_slope);
         auto pd = dnnl::eltwise_forward::primitive_desc(desc, eng);
 
-        // create relu dst memory
-        auto dst_memory = memory(pd.dst_desc(), eng);
+        auto dst_memory = src_memory;
 
         net.push_back(dnnl::eltwise_forward(pd));
         net_args.push_back(
@@ -142,12 +328,12 @@ private:
 };
 
 class ReLU_back {
-    // calc diff_src based on diff_dst and src
+    // calc diff_src based on diff_dst and relu dst, in place over diff_dst
 public:
     ReLU_back(engine eng, std::vector<primitive>& net,
               std::vector<std::unordered_map<int, memory>>& net_args,
-              const memory& diff_dst_memory, const memory& src_memory,
-              const ReLU& relu_fwd, float negative_slope = 0.0f);
+              const memory& diff_dst_memory, const ReLU& relu_fwd,
+              float negative_slope = 0.0f);
 
     memory diff_src_memory;
 };
@@ -177,34 +363,207 @@ public:
     memory diff_src_memory, diff_weights_memory, diff_bias_memory;
 };
 
+class GradAccumulator {
+    // sum the gradients of K micro-batches into acc_memory:
+    // net_first copies diff into acc (first micro-batch), net_acc adds diff
+    // to acc in place (the others), so diff can be reused by every backward
+public:
+    GradAccumulator(engine eng, std::vector<primitive>& net_first,
+                    std::vector<std::unordered_map<int, memory>>& net_first_args,
+                    std::vector<primitive>& net_acc,
+                    std::vector<std::unordered_map<int, memory>>& net_acc_args,
+                    const memory& diff_memory);
+    ~GradAccumulator() = default;
+    GradAccumulator(const GradAccumulator&) = delete;
+
+    memory acc_memory;
+};
+
+class SGDUpdate {
+    // param = param - lr * grad, in place
+public:
+    SGDUpdate(engine eng, std::vector<primitive>& net,
+              std::vector<std::unordered_map<int, memory>>& net_args,
+              const memory& param_memory, const memory& grad_memory,
+              float learning_rate);
+    ~SGDUpdate() = default;
+    SGDUpdate(const SGDUpdate&) = delete;
+};
+
+ActivationScratch::~ActivationScratch() {
+    if (owns_slots)
+        for (auto ptr : slot_ptr)
+            free(ptr);
+}
+
+memory ActivationScratch::make(const memory::desc& md, const engine& eng) {
+    if (next_slot == slot_size.size())
+        slot_size.push_back(0);
+    slot_size[next_slot] = std::max(slot_size[next_slot], md.get_size());
+    auto mem = memory(md, eng, DNNL_MEMORY_NONE);
+    users.push_back({next_slot++, mem});
+    return mem;
+}
+
+void ActivationScratch::bind() {
+    assert(slot_ptr.empty() && "bind once, after the graph is built");
+    MemoryArena* arena = default_arena();
+    owns_slots = !arena;
+    for (size_t i = 0; i < slot_size.size(); ++i) {
+        // 64 bytes alignment, size rounded up as aligned_alloc requires
+        void* ptr = arena ? arena->allocate(slot_size[i])
+                          : aligned_alloc(64, (slot_size[i] + 63) / 64 * 64);
+        if (!ptr) throw std::bad_alloc();
+        slot_ptr.push_back(ptr);
+    }
+    for (auto& user : users)
+        user.second.set_data_handle(slot_ptr[user.first]);
+}
+
+size_t ActivationScratch::bytes() const {
+    return std::accumulate(slot_size.begin(), slot_size.end(), (size_t)0);
+}
+
+namespace conv_bench {
+
+// best of a few runs of pd over zeroed buffers, outside the arena
+inline double time_ms(engine eng,
+                      const convolution_forward::primitive_desc& pd) {
+    stream s(eng);
+    std::unordered_map<int, memory> args = {
+        {DNNL_ARG_SRC, memory(pd.src_desc(), eng)},
+        {DNNL_ARG_WEIGHTS, memory(pd.weights_desc(), eng)},
+        {DNNL_ARG_BIAS, memory(pd.bias_desc(), eng)},
+        {DNNL_ARG_DST, memory(pd.dst_desc(), eng)}};
+    for (auto& a : args) {
+        void* data = a.second.map_data();
+        memset(data, 0, a.second.get_desc().get_size());
+        a.second.unmap_data(data);
+    }
+
+    convolution_forward conv(pd);
+    conv.execute(s, args);  // warm-up
+    s.wait();
+    double best = 1e30;
+    for (int run = 0; run < 3; ++run) {
+        auto begin = std::chrono::steady_clock::now();
+        conv.execute(s, args);
+        s.wait();
+        best = std::min(best, std::chrono::duration<double, std::milli>(
+                                  std::chrono::steady_clock::now() - begin)
+                                  .count());
+    }
+    return best;
+}
+
+// shape, layouts and attributes: a winner timed for one activation
+// layout is not reused for another
+inline std::string shape_key(prop_kind prop, const memory::desc& src_md,
+                             const memory::desc& weights_md,
+                             const memory::desc& dst_md,
+                             const memory::dims& strides,
+                             const memory::dims& padding,
+                             const primitive_attr& attr) {
+    std::ostringstream key;
+    key << (int)prop;
+    for (auto dims : {src_md.dims(), weights_md.dims(), strides, padding})
+        for (auto d : dims)
+            key << "," << d;
+    // format_kind any, or the blocking strides and inner blocks
+    for (auto md : {src_md, weights_md, dst_md}) {
+        const auto& data = md.data;
+        key << "|" << (int)data.format_kind;
+        if (data.format_kind != dnnl_blocked) continue;
+        const auto& blk = data.format_desc.blocking;
+        for (int i = 0; i < data.ndims; ++i)
+            key << "," << blk.strides[i];
+        for (int i = 0; i < blk.inner_nblks; ++i)
+            key << "," << blk.inner_blks[i] << "@" << blk.inner_idxs[i];
+    }
+    key << "|" << attr.get_post_ops().len();
+    return key.str();
+}
+
+}  // namespace conv_bench
+
+convolution_forward::primitive_desc make_conv_pd(
+    engine eng, prop_kind prop, conv_algo algo, const memory::desc& src_md,
+    const memory::desc& weights_md, const memory::desc& bias_md,
+    const memory::desc& dst_md, const memory::dims& strides,
+    const memory::dims& padding, const primitive_attr& attr,
+    algorithm* chosen) {
+    auto make = [&](algorithm alg) {
+        auto desc = convolution_forward::desc(prop, alg, src_md, weights_md,
+                                              bias_md, dst_md, strides,
+                                              padding, padding);
+        auto pd = make_fixed_team_pd<convolution_forward::primitive_desc>(
+            desc, attr, eng);
+        if (chosen) *chosen = alg;
+        return pd;
+    };
+    if (algo == conv_algo::direct) return make(algorithm::convolution_direct);
+
+    convolution_forward::primitive_desc wino_pd;
+    try {
+        wino_pd = make(algorithm::convolution_winograd);
+    } catch (const dnnl::error&) {
+        return make(algorithm::convolution_direct);
+    }
+    if (algo == conv_algo::winograd) return wino_pd;
+
+    // winner per shape, layers of the same shape are timed once
+    static std::map<std::string, algorithm> winners;
+    auto key = conv_bench::shape_key(prop, src_md, weights_md, dst_md,
+                                     strides, padding, attr);
+    auto found = winners.find(key);
+    if (found != winners.end()) {
+        if (found->second == algorithm::convolution_direct)
+            return make(algorithm::convolution_direct);
+        if (chosen) *chosen = algorithm::convolution_winograd;
+        return wino_pd;
+    }
+
+    auto direct_pd = make(algorithm::convolution_direct);
+    double direct_ms = conv_bench::time_ms(eng, direct_pd);
+    double wino_ms = conv_bench::time_ms(eng, wino_pd);
+    winners[key] = wino_ms < direct_ms ? algorithm::convolution_winograd
+                                       : algorithm::convolution_direct;
+    std::cout << "conv " << key << ": direct " << direct_ms
+              << " ms, winograd " << wino_ms << " ms" << std::endl;
+    if (chosen) *chosen = winners[key];
+    return wino_ms < direct_ms ? wino_pd : direct_pd;
+}
+
 Conv2DwithReLu::Conv2DwithReLu(
     dnnl::engine eng, std::vector<primitive>& net,
     std::vector<std::unordered_map<int, memory>>& net_args,
     const memory& src_memory, const memory::dims& src_tz,
     const memory::dims& dst_tz, const memory::dims& weights_tz,
     const memory::dims& strides, const memory::dims& padding,
-    const float& negative_slope)
-    : weights(product(weights_tz)), bias(weights_tz.at(0)) {
-    // initializing non-zero values for weights and bias
-    for (size_t i = 0; i < weights.size(); ++i)
-        weights[i] = sinf((float)i);
-    for (size_t i = 0; i < bias.size(); ++i)
-        bias[i] = sinf((float)i);
-
+    const float& negative_slope, const char* name, ActivationScratch* scratch,
+    conv_algo algo) {
     memory::dims bias_tz = {weights_tz[0]};
+    // He-normal weights (conv is followed by relu), zero bias; the RNG
+    // stream is the layer's name
+    memory::dim fan_in = product(weights_tz) / weights_tz[0];
+    memory::dim fan_out = product(weights_tz) / weights_tz[1];
 
 #ifdef USEREORDER
-    auto user_weights_memory = memory({{weights_tz}, dt::f32, tag::oihw}, eng);
-    write_to_dnnl_memory(weights.data(), user_weights_memory);
-    auto user_bias_memory = memory({{bias_tz}, dt::f32, tag::x}, eng);
-    write_to_dnnl_memory(bias.data(), user_bias_memory);
+    auto user_weights_memory = make_memory({{weights_tz}, dt::f32, tag::oihw}, eng);
+    init_weights(user_weights_memory, weights_init::he_normal, fan_in, fan_out,
+                 tensor_stream(name));
+    auto user_bias_memory = make_memory({{bias_tz}, dt::f32, tag::x}, eng);
+    init_weights(user_bias_memory, weights_init::zeros, fan_in, fan_out,
+                 tensor_stream(name, 1));
 #endif
 
 #ifndef USEREORDER
-    auto weights_memory = memory({{weights_tz}, dt::f32, tag::oihw}, eng);
-    write_to_dnnl_memory(weights.data(), weights_memory);
-    auto bias_memory = memory({{bias_tz}, dt::f32, tag::x}, eng);
-    write_to_dnnl_memory(bias.data(), bias_memory);
+    weights_memory = make_memory({{weights_tz}, dt::f32, tag::oihw}, eng);
+    init_weights(weights_memory, weights_init::he_normal, fan_in, fan_out,
+                 tensor_stream(name));
+    bias_memory = make_memory({{bias_tz}, dt::f32, tag::x}, eng);
+    init_weights(bias_memory, weights_init::zeros, fan_in, fan_out,
+                 tensor_stream(name, 1));
 #endif
 
     auto src_md = memory::desc({src_tz}, dt::f32, tag::any);
@@ -212,33 +571,37 @@ Conv2DwithReLu::Conv2DwithReLu(
     auto weights_md = memory::desc({weights_tz}, dt::f32, tag::any);
     auto dst_md = memory::desc({dst_tz}, dt::f32, tag::any);
 
-    auto desc = convolution_forward::desc(
-        prop_kind::forward, algorithm::convolution_direct, src_md, weights_md,
-        bias_md, dst_md, strides, padding, padding);
-    auto pd = convolution_forward::primitive_desc(desc, eng);
+    auto pd = make_conv_pd(eng, prop_kind::forward, algo, src_md, weights_md,
+                           bias_md, dst_md, strides, padding,
+                           primitive_attr(), &algo_m);
 
 #ifdef USEREORDER
-    // create reorder primitives between user input and conv src if needed
-    auto weights_memory = user_weights_memory;
-    if (pd.weights_desc() != user_weights_memory.get_desc()) {
-        weights_memory = memory(pd.weights_desc(), eng);
-        net.push_back(reorder(user_weights_memory, weights_memory));
-        net_args.push_back({{DNNL_ARG_FROM, user_weights_memory},
-                            {DNNL_ARG_TO, weights_memory}});
-    }
-
-    // added by rbj (159 modified as well)
-    auto bias_memory = user_bias_memory;
-    if (pd.bias_desc() != user_bias_memory.get_desc()) {
-        bias_memory = memory(pd.bias_desc(), eng);
-        net.push_back(reorder(user_bias_memory, bias_memory));
-        net_args.push_back(
-            {{DNNL_ARG_FROM, user_bias_memory}, {DNNL_ARG_TO, bias_memory}});
+    // copy the user weights into the layout conv picked, once: SGDUpdate
+    // trains weights_memory, a reorder in the net would overwrite it from
+    // the never-updated user weights at every step
+    weights_memory = user_weights_memory;
+    bias_memory = user_bias_memory;
+    if (pd.weights_desc() != user_weights_memory.get_desc() ||
+        pd.bias_desc() != user_bias_memory.get_desc()) {
+        stream s(eng);
+        if (pd.weights_desc() != user_weights_memory.get_desc()) {
+            weights_memory = make_memory(pd.weights_desc(), eng);
+            reorder(user_weights_memory, weights_memory)
+                .execute(s, user_weights_memory, weights_memory);
+        }
+        // added by rbj (159 modified as well)
+        if (pd.bias_desc() != user_bias_memory.get_desc()) {
+            bias_memory = make_memory(pd.bias_desc(), eng);
+            reorder(user_bias_memory, bias_memory)
+                .execute(s, user_bias_memory, bias_memory);
+        }
+        s.wait();
     }
 #endif
 
     // create memory for conv dst
-    conv_dst_memory = memory(pd.dst_desc(), eng);
+    auto conv_dst_memory = scratch ? scratch->make(pd.dst_desc(), eng)
+                                   : make_memory(pd.dst_desc(), eng);
 
     // finally create a convolution primitive
     net.push_back(convolution_forward(pd));
@@ -246,38 +609,103 @@ Conv2DwithReLu::Conv2DwithReLu(
                         {DNNL_ARG_WEIGHTS, weights_memory},
                         {DNNL_ARG_BIAS, bias_memory},
                         {DNNL_ARG_DST, conv_dst_memory}});
+    fwd_m.push_back(net.back());
+    fwd_args_m.push_back(net_args.back());
 
-    // ReLU
+    // ReLU, in place over conv dst: backward only needs relu dst
     auto relu_desc = eltwise_forward::desc(
-        prop_kind::forward_training, algorithm::eltwise_relu,
+        prop_kind::forward_training, algorithm::eltwise_relu_use_dst_for_bwd,
         conv_dst_memory.get_desc(), negative_slope);
     auto relu_pd = eltwise_forward::primitive_desc(relu_desc, eng);
 
-    // create relu dst memory
-    auto relu_dst_memory = memory(relu_pd.dst_desc(), eng);
+    auto relu_dst_memory = conv_dst_memory;
 
     net.push_back(eltwise_forward(relu_pd));
     net_args.push_back(
         {{DNNL_ARG_SRC, conv_dst_memory}, {DNNL_ARG_DST, relu_dst_memory}});
+    fwd_m.push_back(net.back());
+    fwd_args_m.push_back(net_args.back());
     dst_m = relu_dst_memory;
     pd1_m = pd;
     pd2_m = relu_pd;
 }
 
+Conv2DwithReLu::Conv2DwithReLu(
+    dnnl::engine eng, std::vector<primitive>& net,
+    std::vector<std::unordered_map<int, memory>>& net_args,
+    const memory& src_memory, const memory::dims& dst_tz,
+    const memory::dims& strides, const memory::dims& padding,
+    const float& negative_slope, const memory& trained_weights,
+    const memory& trained_bias, conv_algo algo)
+    : trained_weights_m(trained_weights), trained_bias_m(trained_bias) {
+    auto src_md = memory::desc(src_memory.get_desc().dims(), dt::f32,
+                               activation_format());
+    auto weights_md =
+        memory::desc(trained_weights.get_desc().dims(), dt::f32, tag::any);
+    auto bias_md = memory::desc(trained_bias.get_desc().dims(), dt::f32,
+                                tag::any);
+    auto dst_md = memory::desc({dst_tz}, dt::f32, activation_format());
+
+    // no backward, so relu need not keep its own dst
+    post_ops relu_ops;
+    relu_ops.append_eltwise(1.0f, algorithm::eltwise_relu, negative_slope,
+                            0.0f);
+    primitive_attr relu_attr;
+    relu_attr.set_post_ops(relu_ops);
+
+    auto pd = make_conv_pd(eng, prop_kind::forward_inference, algo, src_md,
+                           weights_md, bias_md, dst_md, strides, padding,
+                           relu_attr, &algo_m);
+
+    weights_memory = make_memory(pd.weights_desc(), eng);
+    bias_memory = make_memory(pd.bias_desc(), eng);
+    auto src = reorder_if_needed(eng, net, net_args, src_memory,
+                                 pd.src_desc());
+    auto dst_memory = make_memory(pd.dst_desc(), eng);
+
+    net.push_back(convolution_forward(pd));
+    net_args.push_back({{DNNL_ARG_SRC, src},
+                        {DNNL_ARG_WEIGHTS, weights_memory},
+                        {DNNL_ARG_BIAS, bias_memory},
+                        {DNNL_ARG_DST, dst_memory}});
+    dst_m = dst_memory;
+    pd1_m = pd;
+}
+
+void Conv2DwithReLu::recompute(
+    std::vector<primitive>& net,
+    std::vector<std::unordered_map<int, memory>>& net_args) const {
+    net.insert(net.end(), fwd_m.begin(), fwd_m.end());
+    net_args.insert(net_args.end(), fwd_args_m.begin(), fwd_args_m.end());
+}
+
+void Conv2DwithReLu::snapshot(
+    std::vector<primitive>& net,
+    std::vector<std::unordered_map<int, memory>>& net_args) const {
+    net.push_back(reorder(trained_weights_m, weights_memory));
+    net_args.push_back({{DNNL_ARG_FROM, trained_weights_m},
+                        {DNNL_ARG_TO, weights_memory}});
+    net.push_back(reorder(trained_bias_m, bias_memory));
+    net_args.push_back(
+        {{DNNL_ARG_FROM, trained_bias_m}, {DNNL_ARG_TO, bias_memory}});
+}
+
 MaxPooling::MaxPooling(dnnl::engine eng, std::vector<primitive>& net,
                        std::vector<std::unordered_map<int, memory>>& net_args,
                        const memory& src_memory, const memory::dims& kernel,
                        const memory::dims& dst_tz, const memory::dims& strides,
-                       const memory::dims& padding, bool trained)
+                       const memory::dims& padding, bool trained,
+                       ActivationScratch* scratch)
     : iftrain(trained) {
     auto dst_md = memory::desc({dst_tz}, dt::f32, tag::any);
 
     //[Create pooling primitive]
     auto desc = pooling_forward::desc(
-        prop_kind::forward_training, algorithm::pooling_max,
+        trained ? prop_kind::forward_training : prop_kind::forward_inference,
+        algorithm::pooling_max,
         src_memory.get_desc(), dst_md, strides, kernel, padding, padding);
     auto pd = pooling_forward::primitive_desc(desc, eng);
-    auto dst_memory = memory(pd.dst_desc(), eng);
+    auto dst_memory = make_memory(pd.dst_desc(), eng);
     //[Create pooling primitive]
 
     net.push_back(pooling_forward(pd));
@@ -287,10 +715,43 @@ MaxPooling::MaxPooling(dnnl::engine eng, std::vector<primitive>& net,
 
     // create pooling workspace memory if training
     if (trained) {
-        workspace_memory = memory(pd.workspace_desc(), eng);
+        workspace_memory = scratch ? scratch->make(pd.workspace_desc(), eng)
+                                   : make_memory(pd.workspace_desc(), eng);
         net_args.back().insert({DNNL_ARG_WORKSPACE, workspace_memory});
     }
 
+    dst_m = dst_memory;
+    pd_m = pd;
+    args_m = net_args.back();
+}
+
+void MaxPooling::recompute(
+    std::vector<primitive>& net,
+    std::vector<std::unordered_map<int, memory>>& net_args) const {
+    // dst is rewritten with the same values, the next block is done with it
+    net.push_back(pooling_forward(pd_m));
+    net_args.push_back(args_m);
+}
+
+GlobalAvgPooling::GlobalAvgPooling(
+    engine eng, std::vector<primitive>& net,
+    std::vector<std::unordered_map<int, memory>>& net_args,
+    const memory& src_memory, const memory::dims& src_tz)
+    : kernel_m({src_tz[2], src_tz[3]}) {
+    memory::dims dst_tz = {src_tz[0], src_tz[1], 1, 1};
+    memory::dims padding = {0, 0};
+    auto dst_md = memory::desc({dst_tz}, dt::f32, tag::any);
+
+    auto desc = pooling_forward::desc(
+        prop_kind::forward_training, algorithm::pooling_avg_exclude_padding,
+        src_memory.get_desc(), dst_md, kernel_m, kernel_m, padding, padding);
+    auto pd = pooling_forward::primitive_desc(desc, eng);
+    auto dst_memory = make_memory(pd.dst_desc(), eng);
+
+    net.push_back(pooling_forward(pd));
+    net_args.push_back(
+        {{DNNL_ARG_SRC, src_memory}, {DNNL_ARG_DST, dst_memory}});
+
     dst_m = dst_memory;
     pd_m = pd;
 }
@@ -298,23 +759,22 @@ MaxPooling::MaxPooling(dnnl::engine eng, std::vector<primitive>& net,
 Dense::Dense(dnnl::engine eng, std::vector<primitive>& net,
              std::vector<std::unordered_map<int, memory>>& net_args,
              const memory& src_memory, const memory::dims& src_tz,
-             const memory::dims& dst_tz, const memory::dims& weights_tz)
-    : weights(product(weights_tz)), bias(weights_tz.at(0)) {
-    // initializing non-zero values for weights and bias
-    for (size_t i = 0; i < weights.size(); ++i)
-        weights[i] = sinf((float)i);
-    for (size_t i = 0; i < bias.size(); ++i)
-        bias[i] = sinf((float)i);
-
+             const memory::dims& dst_tz, const memory::dims& weights_tz,
+             const char* name) {
     memory::dims bias_tz = {weights_tz[0]};
+    // Xavier-uniform weights, zero bias; the RNG stream is the layer's name
+    memory::dim fan_in = product(weights_tz) / weights_tz[0];
+    memory::dim fan_out = weights_tz[0];
 
-    // create memory for user data
-    weights_memory = memory(
+    // create memory for user data, initialized in place
+    weights_memory = make_memory(
         {{weights_tz}, dt::f32, (weights_tz.size() == 2 ? tag::oi : tag::oihw)},
         eng);
-    write_to_dnnl_memory(weights.data(), weights_memory);
-    auto bias_memory = memory({{bias_tz}, dt::f32, tag::x}, eng);
-    write_to_dnnl_memory(bias.data(), bias_memory);
+    init_weights(weights_memory, weights_init::xavier_uniform, fan_in,
+                 fan_out, tensor_stream(name));
+    bias_memory = make_memory({{bias_tz}, dt::f32, tag::x}, eng);
+    init_weights(bias_memory, weights_init::zeros, fan_in, fan_out,
+                 tensor_stream(name, 1));
 
     // create memory descriptors for convolution data w/ no specified format
     auto src_md = memory::desc({src_tz}, dt::f32, tag::any);
@@ -325,9 +785,10 @@ Dense::Dense(dnnl::engine eng, std::vector<primitive>& net,
     // create a inner_product
     auto desc = inner_product_forward::desc(prop_kind::forward_training, src_md,
                                             weights_md, bias_md, dst_md);
-    auto pd = inner_product_forward::primitive_desc(desc, eng);
+    auto pd = make_fixed_team_pd<inner_product_forward::primitive_desc>(
+        desc, eng);
 
-    auto dst_memory = memory(pd.dst_desc(), eng);
+    auto dst_memory = make_memory(pd.dst_desc(), eng);
 
     // create convolution primitive and add it to net
     net.push_back(inner_product_forward(pd));
@@ -340,6 +801,160 @@ Dense::Dense(dnnl::engine eng, std::vector<primitive>& net,
     pd_m = pd;
 }
 
+Dense::Dense(dnnl::engine eng, std::vector<primitive>& net,
+             std::vector<std::unordered_map<int, memory>>& net_args,
+             const memory& src_memory, const memory::dims& /* src_tz */,
+             const memory::dims& dst_tz, const Dense& other)
+    : weights_memory(other.weights_memory), bias_memory(other.bias_memory) {
+    auto desc = inner_product_forward::desc(
+        prop_kind::forward_inference, src_memory.get_desc(),
+        weights_memory.get_desc(), bias_memory.get_desc(),
+        memory::desc({dst_tz}, dt::f32, tag::any));
+    auto pd = make_fixed_team_pd<inner_product_forward::primitive_desc>(
+        desc, eng);
+
+    auto dst_memory = make_memory(pd.dst_desc(), eng);
+
+    net.push_back(inner_product_forward(pd));
+    net_args.push_back({{DNNL_ARG_SRC, src_memory},
+                        {DNNL_ARG_WEIGHTS, weights_memory},
+                        {DNNL_ARG_BIAS, bias_memory},
+                        {DNNL_ARG_DST, dst_memory}});
+
+    dst_m = dst_memory;
+    pd_m = pd;
+}
+
+Dense::Dense(dnnl::engine eng, std::vector<primitive>& net,
+             std::vector<std::unordered_map<int, memory>>& net_args,
+             const memory& src_memory, const memory::dims& dst_tz,
+             const memory& trained_weights, const memory& trained_bias)
+    : trained_weights_m(trained_weights), trained_bias_m(trained_bias) {
+    auto src_md =
+        memory::desc(src_memory.get_desc().dims(), dt::f32, tag::any);
+    auto weights_md =
+        memory::desc(trained_weights.get_desc().dims(), dt::f32, tag::any);
+    auto bias_md = memory::desc(trained_bias.get_desc().dims(), dt::f32,
+                                tag::any);
+    auto desc = inner_product_forward::desc(
+        prop_kind::forward_inference, src_md, weights_md, bias_md,
+        memory::desc({dst_tz}, dt::f32, tag::any));
+    auto pd = make_fixed_team_pd<inner_product_forward::primitive_desc>(
+        desc, eng);
+
+    weights_memory = make_memory(pd.weights_desc(), eng);
+    bias_memory = make_memory(pd.bias_desc(), eng);
+    auto src = reorder_if_needed(eng, net, net_args, src_memory,
+                                 pd.src_desc());
+    auto dst_memory = make_memory(pd.dst_desc(), eng);
+
+    net.push_back(inner_product_forward(pd));
+    net_args.push_back({{DNNL_ARG_SRC, src},
+                        {DNNL_ARG_WEIGHTS, weights_memory},
+                        {DNNL_ARG_BIAS, bias_memory},
+                        {DNNL_ARG_DST, dst_memory}});
+
+    dst_m = dst_memory;
+    pd_m = pd;
+}
+
+void Dense::snapshot(
+    std::vector<primitive>& net,
+    std::vector<std::unordered_map<int, memory>>& net_args) const {
+    net.push_back(reorder(trained_weights_m, weights_memory));
+    net_args.push_back({{DNNL_ARG_FROM, trained_weights_m},
+                        {DNNL_ARG_TO, weights_memory}});
+    net.push_back(reorder(trained_bias_m, bias_memory));
+    net_args.push_back(
+        {{DNNL_ARG_FROM, trained_bias_m}, {DNNL_ARG_TO, bias_memory}});
+}
+
+DenseLowRank::DenseLowRank(
+    engine eng, std::vector<primitive>& net,
+    std::vector<std::unordered_map<int, memory>>& net_args,
+    const memory& src_memory, const memory::dims& src_tz,
+    const memory::dims& dst_tz, const Dense& dense_fwd, memory::dim rank,
+    const memory& dst_memory)
+    : bias_memory(dense_fwd.bias_memory), rank_m(rank) {
+    // the user weights are plain oi / oihw: a row-major out x in matrix
+    memory::dims weights_tz = dense_fwd.weights_memory.get_desc().dims();
+    memory::dim out = weights_tz[0];
+    memory::dim in = product(weights_tz) / out;
+
+    std::vector<float> a, b;
+    float* w = dense_fwd.weights_memory.map_data<float>();
+    error_m = low_rank_factorize(w, out, in, rank, b, a);
+    dense_fwd.weights_memory.unmap_data(w);
+    rank_m = (memory::dim)a.size() / in;
+
+    memory::dims a_tz = weights_tz;
+    a_tz[0] = rank_m;
+    a_weights_memory = make_memory(
+        {{a_tz}, dt::f32, (a_tz.size() == 2 ? tag::oi : tag::oihw)}, eng);
+    write_to_dnnl_memory(a.data(), a_weights_memory);
+    b_weights_memory = make_memory({{out, rank_m}, dt::f32, tag::oi}, eng);
+    write_to_dnnl_memory(b.data(), b_weights_memory);
+
+    build(eng, net, net_args, src_memory, src_tz, dst_tz, dst_memory);
+}
+
+DenseLowRank::DenseLowRank(
+    engine eng, std::vector<primitive>& net,
+    std::vector<std::unordered_map<int, memory>>& net_args,
+    const memory& src_memory, const memory::dims& src_tz,
+    const memory::dims& dst_tz, const DenseLowRank& other,
+    const memory& dst_memory)
+    : a_weights_memory(other.a_weights_memory),
+      b_weights_memory(other.b_weights_memory),
+      bias_memory(other.bias_memory),
+      rank_m(other.rank_m),
+      error_m(other.error_m) {
+    build(eng, net, net_args, src_memory, src_tz, dst_tz, dst_memory);
+}
+
+void DenseLowRank::build(
+    engine eng, std::vector<primitive>& net,
+    std::vector<std::unordered_map<int, memory>>& net_args,
+    const memory& src_memory, const memory::dims& src_tz,
+    const memory::dims& dst_tz, const memory& dst_memory) {
+    memory::dims mid_tz = {src_tz[0], rank_m};
+
+    // src -> rank, no bias
+    auto a_desc = inner_product_forward::desc(
+        prop_kind::forward_inference, src_memory.get_desc(),
+        a_weights_memory.get_desc(), memory::desc({mid_tz}, dt::f32, tag::nc));
+    auto a_pd = make_fixed_team_pd<inner_product_forward::primitive_desc>(
+        a_desc, eng);
+    auto mid_memory = make_memory(a_pd.dst_desc(), eng);
+
+    net.push_back(inner_product_forward(a_pd));
+    net_args.push_back({{DNNL_ARG_SRC, src_memory},
+                        {DNNL_ARG_WEIGHTS, a_weights_memory},
+                        {DNNL_ARG_DST, mid_memory}});
+
+    // rank -> dst, with the bias of the original layer
+    auto dst_md = dst_memory ? dst_memory.get_desc()
+                             : memory::desc({dst_tz}, dt::f32, tag::nc);
+    auto b_desc = inner_product_forward::desc(
+        prop_kind::forward_inference, mid_memory.get_desc(),
+        b_weights_memory.get_desc(), bias_memory.get_desc(), dst_md);
+    auto b_pd = make_fixed_team_pd<inner_product_forward::primitive_desc>(
+        b_desc, eng);
+    dst_m = dst_memory ? dst_memory : make_memory(b_pd.dst_desc(), eng);
+
+    net.push_back(inner_product_forward(b_pd));
+    net_args.push_back({{DNNL_ARG_SRC, mid_memory},
+                        {DNNL_ARG_WEIGHTS, b_weights_memory},
+                        {DNNL_ARG_BIAS, bias_memory},
+                        {DNNL_ARG_DST, dst_m}});
+}
+
+size_t DenseLowRank::weights_bytes() const {
+    return a_weights_memory.get_desc().get_size() +
+           b_weights_memory.get_desc().get_size() +
+           bias_memory.get_desc().get_size();
+}
+
 CrossEntropyLoss::CrossEntropyLoss(
     dnnl::engine eng, std::vector<primitive>& net,
     std::vector<std::unordered_map<int, memory>>& net_args,
@@ -352,7 +967,7 @@ CrossEntropyLoss::CrossEntropyLoss(
     float upper = 1 - 1e-7;  // beta
 
     auto y_md = memory::desc({y_tz}, dt::f32, tag::nc);
-    auto y_hat_cliped_memory = memory(y_md, eng);
+    auto y_hat_cliped_memory = make_memory(y_md, eng);
 
     auto clip_desc =
         eltwise_forward::desc(prop_kind::forward_training,
@@ -364,7 +979,7 @@ CrossEntropyLoss::CrossEntropyLoss(
         {{DNNL_ARG_SRC, y_hat_memory}, {DNNL_ARG_DST, y_hat_cliped_memory}});
 
     // 1) Perform elementwise log on y_hat_cliped
-    auto y_hat_logged_memory = memory(y_md, eng);
+    auto y_hat_logged_memory = make_memory(y_md, eng);
 
     auto log_desc = eltwise_forward::desc(prop_kind::forward_training,
                                           algorithm::eltwise_log, y_md);
@@ -386,10 +1001,10 @@ Dense_back::Dense_back(engine eng, std::vector<primitive>& net,
     // std::vector<float> diff_fc_weights(product(weights_tz));
     // std::vector<float> diff_fc_bias(product(bias_tz));
 
-    diff_weights_memory = memory(
+    diff_weights_memory = make_memory(
         {{weights_tz}, dt::f32, (weights_tz.size() == 2 ? tag::oi : tag::oihw)},
         eng);
-    diff_bias_memory = memory({{bias_tz}, dt::f32, tag::x}, eng);
+    diff_bias_memory = make_memory({{bias_tz}, dt::f32, tag::x}, eng);
 
     auto src_md = src_memory.get_desc();
     auto diff_dst_md = diff_dst_memory.get_desc();
@@ -398,21 +1013,27 @@ Dense_back::Dense_back(engine eng, std::vector<primitive>& net,
     auto bwd_weights_desc = inner_product_backward_weights::desc(
         src_md, diff_weights_memory.get_desc(), diff_bias_memory.get_desc(),
         diff_dst_md);
-    auto bwd_weights_pd = inner_product_backward_weights::primitive_desc(
-        bwd_weights_desc, eng, fwd_pd);
+    inner_product_backward_weights::primitive_desc bwd_weights_pd;
+    {
+        // sized for the team it will run on in deterministic mode
+        ScopedThreads weights_bwd_threads(deterministic_threads());
+        bwd_weights_pd = inner_product_backward_weights::primitive_desc(
+            bwd_weights_desc, eng, fwd_pd);
+    }
 
     net.push_back(inner_product_backward_weights(bwd_weights_pd));
     net_args.push_back({{DNNL_ARG_DIFF_DST, diff_dst_memory},
                         {DNNL_ARG_SRC, src_memory},
-                        {DNNL_ARG_WEIGHTS, diff_weights_memory},
-                        {DNNL_ARG_BIAS, diff_bias_memory}});
+                        {DNNL_ARG_DIFF_WEIGHTS, diff_weights_memory},
+                        {DNNL_ARG_DIFF_BIAS, diff_bias_memory}});
 
     auto bwd_data_desc = inner_product_backward_data::desc(
         src_md, dense_fwd.weights_memory.get_desc(), diff_dst_md);
     auto bwd_data_pd =
-        inner_product_backward_data::primitive_desc(bwd_data_desc, eng, fwd_pd);
+        make_fixed_team_pd<inner_product_backward_data::primitive_desc>(
+            bwd_data_desc, eng, fwd_pd);
 
-    diff_src_memory = memory(src_md, eng);
+    diff_src_memory = make_memory(src_md, eng);
 
     net.push_back(inner_product_backward_data(bwd_data_pd));
     net_args.push_back({{DNNL_ARG_DIFF_DST, diff_dst_memory},
@@ -424,19 +1045,20 @@ Dense_back::Dense_back(engine eng, std::vector<primitive>& net,
 
 ReLU_back::ReLU_back(engine eng, std::vector<primitive>& net,
                      std::vector<std::unordered_map<int, memory>>& net_args,
-                     const memory& diff_dst_memory, const memory& src_memory,
-                     const ReLU& relu_fwd, float negative_slope) {
-    auto src_md = src_memory.get_desc();
-    diff_src_memory = memory(src_md, eng);
-
-    auto bwd_desc = eltwise_backward::desc(algorithm::eltwise_relu,
-                                           diff_src_memory.get_desc(), src_md,
-                                           negative_slope);
+                     const memory& diff_dst_memory, const ReLU& relu_fwd,
+                     float negative_slope) {
+    auto dst_memory = relu_fwd.dst_memory();
+    auto dst_md = dst_memory.get_desc();
+    diff_src_memory = diff_dst_memory;
+
+    auto bwd_desc = eltwise_backward::desc(
+        algorithm::eltwise_relu_use_dst_for_bwd, diff_src_memory.get_desc(),
+        dst_md, negative_slope);
     auto bwd_pd =
         eltwise_backward::primitive_desc(bwd_desc, eng, relu_fwd.prim_desc());
 
     net.push_back(eltwise_backward(bwd_pd));
-    net_args.push_back({{DNNL_ARG_SRC, src_memory},
+    net_args.push_back({{DNNL_ARG_DST, dst_memory},
                         {DNNL_ARG_DIFF_DST, diff_dst_memory},
                         {DNNL_ARG_DIFF_SRC, diff_src_memory}});
 }
@@ -446,9 +1068,28 @@ MaxPooling_back::MaxPooling_back(
     std::vector<std::unordered_map<int, memory>>& net_args,
     const memory::dims& kernel, const memory::dims& strides,
     const memory::dims& padding, const memory& diff_dst_memory,
-    const memory& src_memory, const MaxPooling& pool_bwd) {
+    const memory& src_memory, const MaxPooling& pool_bwd, bool relu_src,
+    float negative_slope) {
+    if (relu_src) {
+        auto dst_md = pool_bwd.dst_memory().get_desc();
+        auto hint_desc = eltwise_forward::desc(
+            prop_kind::forward_training,
+            algorithm::eltwise_relu_use_dst_for_bwd, dst_md, negative_slope);
+        auto hint_pd = eltwise_forward::primitive_desc(hint_desc, eng);
+        auto relu_bwd_desc = eltwise_backward::desc(
+            algorithm::eltwise_relu_use_dst_for_bwd,
+            diff_dst_memory.get_desc(), dst_md, negative_slope);
+        auto relu_bwd_pd =
+            eltwise_backward::primitive_desc(relu_bwd_desc, eng, hint_pd);
+
+        net.push_back(eltwise_backward(relu_bwd_pd));
+        net_args.push_back({{DNNL_ARG_DST, pool_bwd.dst_memory()},
+                            {DNNL_ARG_DIFF_DST, diff_dst_memory},
+                            {DNNL_ARG_DIFF_SRC, diff_dst_memory}});
+    }
+
     auto src_md = src_memory.get_desc();
-    diff_src_memory = memory(src_md, eng);
+    diff_src_memory = make_memory(src_md, eng);
     auto bwd_desc = pooling_backward::desc(
         algorithm::pooling_max, diff_src_memory.get_desc(),
         diff_dst_memory.get_desc(), strides, kernel, padding, padding);
@@ -456,48 +1097,86 @@ MaxPooling_back::MaxPooling_back(
         pooling_backward::primitive_desc(bwd_desc, eng, pool_bwd.prim_desc());
 
     net.push_back(pooling_backward(bwd_pd));
-    net_args.push_back({{DNNL_ARG_DST, diff_dst_memory},
+    net_args.push_back({{DNNL_ARG_DIFF_DST, diff_dst_memory},
                         {DNNL_ARG_WORKSPACE, pool_bwd.workspace_memory},
                         {DNNL_ARG_DIFF_SRC, diff_src_memory}});
 }
 
+GlobalAvgPooling_back::GlobalAvgPooling_back(
+    engine eng, std::vector<primitive>& net,
+    std::vector<std::unordered_map<int, memory>>& net_args,
+    const memory& diff_dst_memory, const memory& src_memory,
+    const GlobalAvgPooling& pool_fwd) {
+    memory::dims padding = {0, 0};
+    diff_src_memory = make_memory(src_memory.get_desc(), eng);
+    auto bwd_desc = pooling_backward::desc(
+        algorithm::pooling_avg_exclude_padding, diff_src_memory.get_desc(),
+        diff_dst_memory.get_desc(), pool_fwd.kernel(), pool_fwd.kernel(),
+        padding, padding);
+    auto bwd_pd =
+        pooling_backward::primitive_desc(bwd_desc, eng, pool_fwd.prim_desc());
+
+    net.push_back(pooling_backward(bwd_pd));
+    net_args.push_back({{DNNL_ARG_DIFF_DST, diff_dst_memory},
+                        {DNNL_ARG_DIFF_SRC, diff_src_memory}});
+}
+
 Conv2DwithReLu_back::Conv2DwithReLu_back(
     engine eng, std::vector<primitive>& net,
     std::vector<std::unordered_map<int, memory>>& net_args,
     const memory::dims& weights_tz, const memory::dims& strides,
     const memory::dims& padding, const memory& diff_dst_memory,
     const memory& src_memory, const Conv2DwithReLu& conv_fwd,
-    float negative_slope) {
-    // 1) relu back
-    auto relu_src_md = conv_fwd.conv_dst_memory.get_desc();
-    auto diff_relu_src_memory = memory(relu_src_md, eng);
+    float negative_slope, bool relu_done) {
+    // 1) relu back, in place over diff_dst, unless pooling back did it
+    auto relu_dst_md = conv_fwd.dst_memory().get_desc();
+    auto diff_relu_src_memory = diff_dst_memory;
     auto diff_relu_src_md = diff_relu_src_memory.get_desc();
 
-    auto relu_bwd_desc = eltwise_backward::desc(algorithm::eltwise_relu,
-                                                diff_relu_src_md, relu_src_md);
-    auto relu_bwd_pd = eltwise_backward::primitive_desc(
-        relu_bwd_desc, eng, conv_fwd.relu_pd(), negative_slope);
-
-    net.push_back(eltwise_backward(relu_bwd_pd));
-    net_args.push_back({{DNNL_ARG_SRC, conv_fwd.conv_dst_memory},
-                        {DNNL_ARG_DIFF_DST, diff_dst_memory},
-                        {DNNL_ARG_DIFF_SRC, diff_relu_src_memory}});
+    if (!relu_done) {
+        auto relu_bwd_desc = eltwise_backward::desc(
+            algorithm::eltwise_relu_use_dst_for_bwd, diff_relu_src_md,
+            relu_dst_md, negative_slope);
+        auto relu_bwd_pd = eltwise_backward::primitive_desc(
+            relu_bwd_desc, eng, conv_fwd.relu_pd());
+
+        net.push_back(eltwise_backward(relu_bwd_pd));
+        net_args.push_back({{DNNL_ARG_DST, conv_fwd.dst_memory()},
+                            {DNNL_ARG_DIFF_DST, diff_dst_memory},
+                            {DNNL_ARG_DIFF_SRC, diff_relu_src_memory}});
+    }
 
     // 2) convolution back (weights)
     memory::dims bias_tz = {weights_tz[0]};
 
-    diff_weights_memory = memory({{weights_tz}, dt::f32, tag::oihw}, eng);
-    diff_bias_memory = memory({{bias_tz}, dt::f32, tag::x}, eng);
+    diff_weights_memory = make_memory({{weights_tz}, dt::f32, tag::oihw}, eng);
+    diff_bias_memory = make_memory({{bias_tz}, dt::f32, tag::x}, eng);
 
     auto weights_md = memory::desc({weights_tz}, dt::f32, tag::any);
 
     auto src_md = src_memory.get_desc();
 
-    auto conv_weights_bwd_desc = convolution_backward_weights::desc(
-        algorithm::convolution_direct, src_md, diff_weights_memory.get_desc(),
-        diff_relu_src_md, strides, padding, padding);
-    auto conv_weights_bwd_pd = convolution_backward_weights::primitive_desc(
-        conv_weights_bwd_desc, eng, conv_fwd.conv_pd());
+    // same algorithm as forward where backward supports it, else direct
+    auto make_weights_bwd_pd = [&](algorithm alg) {
+        auto desc = convolution_backward_weights::desc(
+            alg, src_md, diff_weights_memory.get_desc(),
+            diff_bias_memory.get_desc(), diff_relu_src_md, strides, padding,
+            padding);
+        return convolution_backward_weights::primitive_desc(
+            desc, eng, conv_fwd.conv_pd());
+    };
+    convolution_backward_weights::primitive_desc conv_weights_bwd_pd;
+    {
+        // sized for the team it will run on in deterministic mode
+        ScopedThreads weights_bwd_threads(deterministic_threads());
+        try {
+            conv_weights_bwd_pd =
+                make_weights_bwd_pd(conv_fwd.conv_algorithm());
+        } catch (const dnnl::error&) {
+            conv_weights_bwd_pd =
+                make_weights_bwd_pd(algorithm::convolution_direct);
+        }
+    }
 
     net.push_back(convolution_backward_weights(conv_weights_bwd_pd));
     net_args.push_back({{DNNL_ARG_DIFF_DST, diff_relu_src_memory},
@@ -505,13 +1184,21 @@ Conv2DwithReLu_back::Conv2DwithReLu_back(
                         {DNNL_ARG_DIFF_WEIGHTS, diff_weights_memory},
                         {DNNL_ARG_DIFF_BIAS, diff_bias_memory}});
 
-    diff_src_memory = memory(src_md, eng);
-
-    auto conv_data_bwd_desc = convolution_backward_data::desc(
-        algorithm::convolution_direct, diff_src_memory.get_desc(), weights_md,
-        diff_relu_src_md, strides, padding, padding);
-    auto conv_data_bwd_pd = convolution_backward_data::primitive_desc(
-        conv_data_bwd_desc, eng, conv_fwd.conv_pd());
+    diff_src_memory = make_memory(src_md, eng);
+
+    auto make_data_bwd_pd = [&](algorithm alg) {
+        auto desc = convolution_backward_data::desc(
+            alg, diff_src_memory.get_desc(), weights_md, diff_relu_src_md,
+            strides, padding, padding);
+        return make_fixed_team_pd<convolution_backward_data::primitive_desc>(
+            desc, eng, conv_fwd.conv_pd());
+    };
+    convolution_backward_data::primitive_desc conv_data_bwd_pd;
+    try {
+        conv_data_bwd_pd = make_data_bwd_pd(conv_fwd.conv_algorithm());
+    } catch (const dnnl::error&) {
+        conv_data_bwd_pd = make_data_bwd_pd(algorithm::convolution_direct);
+    }
 
     net.push_back(convolution_backward_data(conv_data_bwd_pd));
     net_args.push_back({{DNNL_ARG_DIFF_DST, diff_relu_src_memory},
@@ -519,4 +1206,41 @@ Conv2DwithReLu_back::Conv2DwithReLu_back(
                         {DNNL_ARG_DIFF_SRC, diff_src_memory}});
 }
 
+GradAccumulator::GradAccumulator(
+    engine eng, std::vector<primitive>& net_first,
+    std::vector<std::unordered_map<int, memory>>& net_first_args,
+    std::vector<primitive>& net_acc,
+    std::vector<std::unordered_map<int, memory>>& net_acc_args,
+    const memory& diff_memory) {
+    auto diff_md = diff_memory.get_desc();
+    acc_memory = make_memory(diff_md, eng);
+
+    // first micro-batch: acc = diff
+    net_first.push_back(reorder(diff_memory, acc_memory));
+    net_first_args.push_back(
+        {{DNNL_ARG_FROM, diff_memory}, {DNNL_ARG_TO, acc_memory}});
+
+    // other micro-batches: acc = acc + diff (dst == src0 runs in place)
+    auto sum_pd = sum::primitive_desc(diff_md, {1.0f, 1.0f},
+                                      {diff_md, diff_md}, eng);
+    net_acc.push_back(sum(sum_pd));
+    net_acc_args.push_back({{DNNL_ARG_MULTIPLE_SRC, acc_memory},
+                            {DNNL_ARG_MULTIPLE_SRC + 1, diff_memory},
+                            {DNNL_ARG_DST, acc_memory}});
+}
+
+SGDUpdate::SGDUpdate(engine eng, std::vector<primitive>& net,
+                     std::vector<std::unordered_map<int, memory>>& net_args,
+                     const memory& param_memory, const memory& grad_memory,
+                     float learning_rate) {
+    // a fused axpy: the sum primitive scales every source on the fly
+    auto param_md = param_memory.get_desc();
+    auto sum_pd = sum::primitive_desc(param_md, {1.0f, -learning_rate},
+                                      {param_md, grad_memory.get_desc()}, eng);
+    net.push_back(sum(sum_pd));
+    net_args.push_back({{DNNL_ARG_MULTIPLE_SRC, param_memory},
+                        {DNNL_ARG_MULTIPLE_SRC + 1, grad_memory},
+                        {DNNL_ARG_DST, param_memory}});
+}
+
 #endif
\ No newline at end of file
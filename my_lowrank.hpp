@@ -0,0 +1,200 @@
+#ifndef MY_LOWRANK
+#define MY_LOWRANK
+
+#include <math.h>
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+#include "example_utils.hpp"
+#include "my_init.hpp"
+
+// Truncated SVD of a trained weights matrix by randomized subspace
+// iteration (Halko et al.): W (m x n, row-major, m = out, n = in) is
+// approximated by B (m x k) * A (k x n), with the singular values split
+// evenly between the two factors (B = U sqrt(S), A = sqrt(S) V^T).
+// Only products with W are needed, so the m x n matrix is read a few times
+// and never decomposed directly.
+
+namespace lowrank {
+
+// orthonormalize the columns of X (rows x cols, row-major), modified
+// Gram-Schmidt; a column that collapses to zero stays zero
+inline void orthonormalize(std::vector<float>& X, int64_t rows, int64_t cols) {
+    for (int64_t j = 0; j < cols; ++j) {
+        for (int64_t q = 0; q < j; ++q) {
+            double dot = 0;
+            for (int64_t i = 0; i < rows; ++i)
+                dot += (double)X[i * cols + j] * X[i * cols + q];
+            for (int64_t i = 0; i < rows; ++i)
+                X[i * cols + j] -= (float)dot * X[i * cols + q];
+        }
+        double norm = 0;
+        for (int64_t i = 0; i < rows; ++i)
+            norm += (double)X[i * cols + j] * X[i * cols + j];
+        float scale = norm > 1e-20 ? (float)(1.0 / sqrt(norm)) : 0.0f;
+        for (int64_t i = 0; i < rows; ++i)
+            X[i * cols + j] *= scale;
+    }
+}
+
+// Y (m x l) = W (m x n) * X (n x l)
+inline void mul(const float* W, const std::vector<float>& X, int64_t m,
+                int64_t n, int64_t l, std::vector<float>& Y) {
+    Y.assign(m * l, 0.0f);
+    PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+    for (int64_t i = 0; i < m; ++i)
+        for (int64_t p = 0; p < n; ++p) {
+            float w = W[i * n + p];
+            for (int64_t j = 0; j < l; ++j)
+                Y[i * l + j] += w * X[p * l + j];
+        }
+}
+
+// Z (n x l) = W^T (n x m) * Y (m x l), W rows streamed once per chunk
+inline void mul_t(const float* W, const std::vector<float>& Y, int64_t m,
+                  int64_t n, int64_t l, std::vector<float>& Z) {
+    const int64_t chunk = 256;
+    Z.assign(n * l, 0.0f);
+    PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+    for (int64_t p0 = 0; p0 < n; p0 += chunk)
+        for (int64_t i = 0; i < m; ++i)
+            for (int64_t p = p0; p < std::min(p0 + chunk, n); ++p) {
+                float w = W[i * n + p];
+                for (int64_t j = 0; j < l; ++j)
+                    Z[p * l + j] += w * Y[i * l + j];
+            }
+}
+
+// eigen decomposition of a symmetric matrix by cyclic Jacobi rotations:
+// G (l x l) is destroyed, its eigenvalues are left on the diagonal and the
+// eigenvectors in the columns of V
+inline void jacobi_eigen(std::vector<double>& G, int64_t l,
+                         std::vector<double>& V) {
+    V.assign(l * l, 0.0);
+    for (int64_t i = 0; i < l; ++i)
+        V[i * l + i] = 1.0;
+    for (int sweep = 0; sweep < 50; ++sweep) {
+        double off = 0;
+        for (int64_t p = 0; p < l; ++p)
+            for (int64_t q = p + 1; q < l; ++q)
+                off += G[p * l + q] * G[p * l + q];
+        if (off < 1e-22) break;
+        for (int64_t p = 0; p < l; ++p)
+            for (int64_t q = p + 1; q < l; ++q) {
+                double gpq = G[p * l + q];
+                if (fabs(gpq) < 1e-300) continue;
+                double theta = (G[q * l + q] - G[p * l + p]) / (2 * gpq);
+                double t = (theta >= 0 ? 1.0 : -1.0) /
+                           (fabs(theta) + sqrt(theta * theta + 1));
+                double c = 1 / sqrt(t * t + 1), s = t * c;
+                for (int64_t r = 0; r < l; ++r) {  // columns p, q
+                    double grp = G[r * l + p], grq = G[r * l + q];
+                    G[r * l + p] = c * grp - s * grq;
+                    G[r * l + q] = s * grp + c * grq;
+                }
+                for (int64_t r = 0; r < l; ++r) {  // rows p, q
+                    double gpr = G[p * l + r], gqr = G[q * l + r];
+                    G[p * l + r] = c * gpr - s * gqr;
+                    G[q * l + r] = s * gpr + c * gqr;
+                }
+                for (int64_t r = 0; r < l; ++r) {
+                    double vrp = V[r * l + p], vrq = V[r * l + q];
+                    V[r * l + p] = c * vrp - s * vrq;
+                    V[r * l + q] = s * vrp + c * vrq;
+                }
+            }
+    }
+}
+
+}  // namespace lowrank
+
+// W (m x n) ~= B (m x k) * A (k x n); returns ||W - B A||_F / ||W||_F
+inline float low_rank_factorize(const float* W, int64_t m, int64_t n,
+                                int64_t k, std::vector<float>& B,
+                                std::vector<float>& A, int power_iters = 2,
+                                uint64_t seed = INIT_SEED) {
+    using namespace lowrank;
+    const int64_t l = std::min(k + 10, std::min(m, n));  // oversampling
+    k = std::min(k, l);
+
+    // range finder: Q spans the dominant column space of W; any Gaussian
+    // omega does, so every factorization draws from the same stream
+    std::vector<float> omega(n * l), Y, Z;
+    init_weights(omega.data(), omega.size(), weights_init::he_normal, 2, 2,
+                 tensor_stream("lowrank_sketch"), seed);
+    mul(W, omega, m, n, l, Y);
+    orthonormalize(Y, m, l);
+    for (int it = 0; it < power_iters; ++it) {
+        mul_t(W, Y, m, n, l, Z);
+        orthonormalize(Z, n, l);
+        mul(W, Z, m, n, l, Y);
+        orthonormalize(Y, m, l);
+    }
+    const std::vector<float>& Q = Y;
+
+    // Bs (l x n) = Q^T W, stored transposed as mul_t gives (n x l)
+    std::vector<float> BsT;
+    mul_t(W, Q, m, n, l, BsT);
+
+    // Bs Bs^T = Ug diag(sigma^2) Ug^T
+    std::vector<double> G(l * l, 0.0), Ug;
+    PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+    for (int64_t a = 0; a < l; ++a)
+        for (int64_t b = 0; b < l; ++b) {
+            double dot = 0;
+            for (int64_t p = 0; p < n; ++p)
+                dot += (double)BsT[p * l + a] * BsT[p * l + b];
+            G[a * l + b] = dot;
+        }
+    jacobi_eigen(G, l, Ug);
+
+    std::vector<int64_t> order(l);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int64_t a, int64_t b) {
+        return G[a * l + a] > G[b * l + b];
+    });
+
+    // B = Q Ug_k sqrt(S_k), A = sqrt(S_k)^-1 Ug_k^T Bs (= sqrt(S_k) V_k^T)
+    B.assign(m * k, 0.0f);
+    A.assign(k * n, 0.0f);
+    for (int64_t r = 0; r < k; ++r) {
+        int64_t e = order[r];
+        double sigma = sqrt(std::max(G[e * l + e], 0.0));
+        double root = sqrt(sigma);
+        float b_scale = (float)root;
+        float a_scale = sigma > 0 ? (float)(1.0 / root) : 0.0f;
+        PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+        for (int64_t i = 0; i < m; ++i) {
+            double dot = 0;
+            for (int64_t j = 0; j < l; ++j)
+                dot += Q[i * l + j] * Ug[j * l + e];
+            B[i * k + r] = (float)dot * b_scale;
+        }
+        PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+        for (int64_t p = 0; p < n; ++p) {
+            double dot = 0;
+            for (int64_t j = 0; j < l; ++j)
+                dot += Ug[j * l + e] * BsT[p * l + j];
+            A[r * n + p] = (float)dot * a_scale;
+        }
+    }
+
+    // relative reconstruction error, per row then summed in a fixed order
+    std::vector<double> row_err(m, 0.0), row_norm(m, 0.0);
+    PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+    for (int64_t i = 0; i < m; ++i)
+        for (int64_t p = 0; p < n; ++p) {
+            float approx = 0;
+            for (int64_t r = 0; r < k; ++r)
+                approx += B[i * k + r] * A[r * n + p];
+            float w = W[i * n + p];
+            row_err[i] += (double)(w - approx) * (w - approx);
+            row_norm[i] += (double)w * w;
+        }
+    double err = std::accumulate(row_err.begin(), row_err.end(), 0.0);
+    double norm = std::accumulate(row_norm.begin(), row_norm.end(), 0.0);
+    return norm > 0 ? (float)sqrt(err / norm) : 0.0f;
+}
+
+#endif
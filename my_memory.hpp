@@ -0,0 +1,126 @@
+#ifndef MY_MEMORY
+#define MY_MEMORY
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <new>
+#include "example_utils.hpp"
+#include "oneapi/dnnl/dnnl.hpp"
+
+class MemoryArena {
+    // one virtual reservation for all tensors of the graph: backed by 2 MB
+    // huge pages, bound to the NUMA node of the constructing thread and
+    // carved with a bump pointer, tensors are never freed one by one
+public:
+    explicit MemoryArena(size_t reserve_bytes);
+    ~MemoryArena();
+    MemoryArena(const MemoryArena&) = delete;
+
+    void* allocate(size_t bytes);
+    // touch every page handed out so far, so the page faults are paid at
+    // setup (in parallel) instead of in the first training step
+    void populate();
+    size_t used() const { return offset_m; }
+    bool huge_pages() const { return huge_m; }
+
+    static const size_t page_size = 2 << 20;  // 2 MB
+    static const size_t alignment = 64;       // cache line, AVX-512 loads
+
+private:
+    char* base_m = nullptr;
+    size_t size_m = 0;
+    size_t offset_m = 0;
+    bool huge_m = false;
+};
+
+// arena used by make_memory, nullptr for the default oneDNN allocation
+inline MemoryArena*& default_arena() {
+    static MemoryArena* arena = nullptr;
+    return arena;
+}
+
+// bytes of every tensor made by make_memory so far
+inline std::atomic<size_t>& allocated_bytes() {
+    static std::atomic<size_t> bytes{0};
+    return bytes;
+}
+
+// every dnnl::memory of the graph is created here: carved from the default
+// arena on CPU engines, allocated by oneDNN otherwise
+inline dnnl::memory make_memory(const dnnl::memory::desc& md,
+                                const dnnl::engine& eng) {
+    allocated_bytes().fetch_add(md.get_size(), std::memory_order_relaxed);
+    MemoryArena* arena = default_arena();
+    if (!arena || eng.get_kind() != dnnl::engine::kind::cpu)
+        return dnnl::memory(md, eng);
+    return dnnl::memory(md, eng, arena->allocate(md.get_size()));
+}
+
+MemoryArena::MemoryArena(size_t reserve_bytes) {
+    size_m = (reserve_bytes + page_size - 1) / page_size * page_size;
+
+    // explicit huge pages first, they need pages reserved by the admin;
+    // without MAP_NORESERVE the mmap fails with ENOMEM when fewer than
+    // size_m are free, instead of a SIGBUS at the first touch
+    void* ptr = mmap(nullptr, size_m, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    huge_m = ptr != MAP_FAILED;
+    if (!huge_m) {
+        // transparent huge pages: over-reserve to align the base to 2 MB
+        ptr = mmap(nullptr, size_m + page_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ptr == MAP_FAILED) throw std::bad_alloc();
+        char* raw = static_cast<char*>(ptr);
+        char* aligned = reinterpret_cast<char*>(
+            (reinterpret_cast<uintptr_t>(raw) + page_size - 1) / page_size *
+            page_size);
+        if (aligned != raw) munmap(raw, aligned - raw);
+        munmap(aligned + size_m, raw + page_size - aligned);
+        ptr = aligned;
+#ifdef MADV_HUGEPAGE
+        huge_m = madvise(ptr, size_m, MADV_HUGEPAGE) == 0;
+#endif
+    }
+    base_m = static_cast<char*>(ptr);
+
+#if defined(SYS_getcpu) && defined(SYS_mbind)
+    // bind to the local node; errors (no NUMA support) are not fatal
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 && node < 64) {
+        const int mpol_bind = 2;
+        unsigned long nodemask = 1UL << node;
+        syscall(SYS_mbind, base_m, size_m, mpol_bind, &nodemask, 64, 0);
+    }
+#endif
+}
+
+MemoryArena::~MemoryArena() {
+    if (default_arena() == this) default_arena() = nullptr;
+    munmap(base_m, size_m);
+}
+
+void* MemoryArena::allocate(size_t bytes) {
+    size_t begin = (offset_m + alignment - 1) / alignment * alignment;
+    if (begin + bytes > size_m) throw std::bad_alloc();
+    offset_m = begin + bytes;
+    return base_m + begin;
+}
+
+void MemoryArena::populate() {
+    // base pages, in case the kernel did not grant huge ones
+    const long small_page = sysconf(_SC_PAGESIZE);
+    const long pages = (long)((offset_m + small_page - 1) / small_page);
+    PRAGMA_OMP_PARALLEL_FOR_COLLAPSE(1)
+    for (long p = 0; p < pages; ++p) {
+        // read-modify-write keeps the weights already written
+        volatile char* byte = base_m + p * small_page;
+        *byte = *byte;
+    }
+}
+
+#endif
@@ -0,0 +1,418 @@
+#ifndef MY_METRICS
+#define MY_METRICS
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "my_trace.hpp"
+#include "oneapi/dnnl/dnnl.hpp"
+
+// Metrics of a running process, served in the Prometheus text format so
+// training and serving can be watched without a profiler. Compute threads
+// only touch relaxed atomics of metrics registered at setup; rendering
+// reads the same atomics from the server thread, so a scrape never blocks
+// a step. Latency histograms are HDR-style: every power of two of
+// nanoseconds is split into 8 linear buckets (at most 12.5% error), and
+// are exposed with power-of-two `le` bounds, which fall on bucket edges.
+
+class Counter {
+public:
+    void add(uint64_t n = 1) { value_m.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_m.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_m{0};
+};
+
+class Gauge {
+public:
+    void set(double v) { value_m.store(v, std::memory_order_relaxed); }
+    double value() const { return value_m.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> value_m{0};
+};
+
+class Histogram {
+public:
+    static const int sub_buckets = 8;
+    // 8 exact buckets below 8 ns, then 8 per power of two up to 2^48 ns
+    static const int buckets = (48 - 2) * sub_buckets;
+
+    void observe_ns(uint64_t ns);
+    void observe(std::chrono::steady_clock::time_point since) {
+        observe_ns(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - since)
+                       .count());
+    }
+    uint64_t count() const { return count_m.load(std::memory_order_relaxed); }
+    uint64_t sum_ns() const { return sum_m.load(std::memory_order_relaxed); }
+    // observations of at most `ns`, exact when ns + 1 is a bucket edge
+    uint64_t count_up_to(uint64_t ns) const;
+    // upper edge of the bucket holding quantile q
+    double quantile_ns(double q) const;
+
+    static int bucket(uint64_t ns);
+    // first value of the next bucket
+    static uint64_t bucket_end(int b);
+
+private:
+    std::atomic<uint64_t> counts_m[buckets] = {};
+    std::atomic<uint64_t> count_m{0}, sum_m{0};
+};
+
+class ScopedTimer {
+    // observes the time of the scope, nothing for a null histogram
+public:
+    explicit ScopedTimer(Histogram* hist) : hist_m(hist) {
+        if (hist_m) begin_m = std::chrono::steady_clock::now();
+    }
+    ~ScopedTimer() {
+        if (hist_m) hist_m->observe(begin_m);
+    }
+    ScopedTimer(const ScopedTimer&) = delete;
+
+private:
+    Histogram* hist_m;
+    std::chrono::steady_clock::time_point begin_m;
+};
+
+class MetricsRegistry {
+    // register everything at setup; references stay valid for the life of
+    // the registry. `labels` is the inside of {}, e.g. net="fwd"
+public:
+    Counter& counter(const std::string& name, const std::string& help,
+                     const std::string& labels = "");
+    Gauge& gauge(const std::string& name, const std::string& help,
+                 const std::string& labels = "");
+    // read when rendered, on the server thread
+    void gauge_fn(const std::string& name, const std::string& help,
+                  std::function<double()> fn);
+    Histogram& histogram(const std::string& name, const std::string& help,
+                         const std::string& labels = "");
+
+    // Prometheus text exposition format 0.0.4
+    std::string render() const;
+    // count, mean, p50 / p99 of every histogram series
+    void report(std::ostream& out) const;
+
+private:
+    struct Series {
+        std::string labels;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+        std::function<double()> fn;
+    };
+    struct Family {
+        std::string name, help, type;
+        std::deque<Series> series;
+    };
+    Series& add(const std::string& name, const std::string& help,
+                const char* type, const std::string& labels);
+
+    mutable std::mutex mutex_m;  // registration against rendering only
+    std::deque<Family> families_m;
+};
+
+// registry of the process
+inline MetricsRegistry& default_metrics() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+class LayerTimes {
+    // one histogram per primitive of a net, labelled with its index and kind
+public:
+    LayerTimes(MetricsRegistry& registry, const char* net,
+               const std::vector<dnnl::primitive>& prims);
+    LayerTimes(const LayerTimes&) = delete;
+
+    // primitive `layer` has finished (stream waited on)
+    void observe(size_t layer, std::chrono::steady_clock::time_point since) {
+        hist_m[layer]->observe(since);
+    }
+
+private:
+    std::vector<Histogram*> hist_m;
+};
+
+class MetricsServer {
+    // serves registry.render() to every connection, HTTP/1.0, on
+    // "host:port" (TCP) or "unix:<path>" (Unix socket)
+public:
+    MetricsServer(const MetricsRegistry& registry, const std::string& endpoint);
+    ~MetricsServer();
+    MetricsServer(const MetricsServer&) = delete;
+
+private:
+    void serve();
+
+    const MetricsRegistry& registry_m;
+    std::string unix_path_m;
+    int fd_m = -1;
+    std::atomic<bool> stop_m{false};
+    std::thread thread_m;
+};
+
+// resident set size of the process, from /proc/self/statm
+inline double resident_bytes() {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+    return (double)resident * sysconf(_SC_PAGESIZE);
+}
+
+int Histogram::bucket(uint64_t ns) {
+    if (ns < (uint64_t)sub_buckets) return (int)ns;
+    int e = 63 - __builtin_clzll(ns);  // 2^e <= ns, e >= 3
+    int b = (e - 2) * sub_buckets + (int)((ns >> (e - 3)) & (sub_buckets - 1));
+    return b < buckets ? b : buckets - 1;
+}
+
+uint64_t Histogram::bucket_end(int b) {
+    if (b < sub_buckets) return b + 1;
+    int e = b / sub_buckets + 2, sub = b % sub_buckets;
+    return (uint64_t)(sub_buckets + sub + 1) << (e - 3);
+}
+
+void Histogram::observe_ns(uint64_t ns) {
+    counts_m[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    sum_m.fetch_add(ns, std::memory_order_relaxed);
+    count_m.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count_up_to(uint64_t ns) const {
+    uint64_t n = 0;
+    for (int b = 0; b < buckets && bucket_end(b) <= ns + 1; ++b)
+        n += counts_m[b].load(std::memory_order_relaxed);
+    return n;
+}
+
+double Histogram::quantile_ns(double q) const {
+    uint64_t n = count(), seen = 0;
+    for (int b = 0; b < buckets; ++b) {
+        seen += counts_m[b].load(std::memory_order_relaxed);
+        if (n && seen >= q * n) return (double)bucket_end(b);
+    }
+    return 0;
+}
+
+MetricsRegistry::Series& MetricsRegistry::add(const std::string& name,
+                                              const std::string& help,
+                                              const char* type,
+                                              const std::string& labels) {
+    std::lock_guard<std::mutex> lock(mutex_m);
+    Family* family = nullptr;
+    for (auto& f : families_m)
+        if (f.name == name) family = &f;
+    if (!family) {
+        families_m.push_back({name, help, type, {}});
+        family = &families_m.back();
+    } else if (family->type != type) {
+        throw std::runtime_error("metric " + name + " registered as " +
+                                 family->type + " and " + type);
+    }
+    family->series.push_back({labels, nullptr, nullptr, nullptr, nullptr});
+    return family->series.back();
+}
+
+Counter& MetricsRegistry::counter(const std::string& name,
+                                  const std::string& help,
+                                  const std::string& labels) {
+    Series& s = add(name, help, "counter", labels);
+    s.counter.reset(new Counter);
+    return *s.counter;
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& help,
+                              const std::string& labels) {
+    Series& s = add(name, help, "gauge", labels);
+    s.gauge.reset(new Gauge);
+    return *s.gauge;
+}
+
+void MetricsRegistry::gauge_fn(const std::string& name,
+                               const std::string& help,
+                               std::function<double()> fn) {
+    Series& s = add(name, help, "gauge", "");
+    s.fn = fn;
+}
+
+Histogram& MetricsRegistry::histogram(const std::string& name,
+                                      const std::string& help,
+                                      const std::string& labels) {
+    Series& s = add(name, help, "histogram", labels);
+    s.histogram.reset(new Histogram);
+    return *s.histogram;
+}
+
+std::string MetricsRegistry::render() const {
+    std::ostringstream out;
+    out << std::setprecision(9);
+    std::lock_guard<std::mutex> lock(mutex_m);
+    for (auto& f : families_m) {
+        out << "# HELP " << f.name << " " << f.help << "\n"
+            << "# TYPE " << f.name << " " << f.type << "\n";
+        for (auto& s : f.series) {
+            std::string braces = s.labels.empty() ? "" : "{" + s.labels + "}";
+            if (s.counter) {
+                out << f.name << braces << " " << s.counter->value() << "\n";
+            } else if (s.gauge || s.fn) {
+                out << f.name << braces << " "
+                    << (s.fn ? s.fn() : s.gauge->value()) << "\n";
+            } else if (s.histogram) {
+                const Histogram& h = *s.histogram;
+                std::string sep = s.labels.empty() ? "" : s.labels + ",";
+                uint64_t below = 0;
+                for (int e = 10; e <= 36; ++e) {  // ~1 us to ~69 s
+                    below = h.count_up_to((1ULL << e) - 1);
+                    out << f.name << "_bucket{" << sep << "le=\""
+                        << ((double)(1ULL << e) / 1e9) << "\"} " << below
+                        << "\n";
+                }
+                // observed while rendering: keep the buckets monotonic
+                uint64_t count = std::max(h.count(), below);
+                out << f.name << "_bucket{" << sep << "le=\"+Inf\"} " << count
+                    << "\n"
+                    << f.name << "_sum" << braces << " " << h.sum_ns() / 1e9
+                    << "\n"
+                    << f.name << "_count" << braces << " " << count << "\n";
+            }
+        }
+    }
+    return out.str();
+}
+
+void MetricsRegistry::report(std::ostream& out) const {
+    std::lock_guard<std::mutex> lock(mutex_m);
+    // the caller's format is restored on return
+    const std::ios_base::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3);
+    for (auto& f : families_m) {
+        if (f.type != "histogram") continue;
+        for (auto& s : f.series) {
+            const Histogram& h = *s.histogram;
+            if (!h.count()) continue;
+            out << f.name << (s.labels.empty() ? "" : "{" + s.labels + "}")
+                << ": " << h.count() << " x, mean "
+                << h.sum_ns() / 1e6 / h.count() << " ms, p50 "
+                << h.quantile_ns(0.5) / 1e6 << " ms, p99 "
+                << h.quantile_ns(0.99) / 1e6 << " ms" << std::endl;
+        }
+    }
+    out.flags(flags);
+    out.precision(precision);
+}
+
+LayerTimes::LayerTimes(MetricsRegistry& registry, const char* net,
+                       const std::vector<dnnl::primitive>& prims) {
+    for (size_t i = 0; i < prims.size(); ++i)
+        hist_m.push_back(&registry.histogram(
+            "vgg11_layer_seconds", "Time of one primitive of a net",
+            std::string("net=\"") + net + "\",layer=\"" + std::to_string(i) +
+                "\",primitive=\"" + trace_primitive_name(prims[i]) + "\""));
+}
+
+MetricsServer::MetricsServer(const MetricsRegistry& registry,
+                             const std::string& endpoint)
+    : registry_m(registry) {
+    if (endpoint.compare(0, 5, "unix:") == 0) {
+        unix_path_m = endpoint.substr(5);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (unix_path_m.size() >= sizeof(addr.sun_path))
+            throw std::runtime_error("metrics: socket path too long");
+        strcpy(addr.sun_path, unix_path_m.c_str());
+        unlink(unix_path_m.c_str());
+        fd_m = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_m < 0 || bind(fd_m, (sockaddr*)&addr, sizeof(addr)) != 0)
+            throw std::runtime_error("metrics: cannot bind " + endpoint);
+    } else {
+        size_t colon = endpoint.rfind(':');
+        std::string host = colon == std::string::npos
+                               ? "127.0.0.1"
+                               : endpoint.substr(0, colon);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)std::stoi(endpoint.substr(colon + 1)));
+        if (inet_pton(AF_INET, host.empty() ? "127.0.0.1" : host.c_str(),
+                      &addr.sin_addr) != 1)
+            throw std::runtime_error("metrics: bad address " + endpoint);
+        fd_m = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        if (fd_m >= 0)
+            setsockopt(fd_m, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd_m < 0 || bind(fd_m, (sockaddr*)&addr, sizeof(addr)) != 0)
+            throw std::runtime_error("metrics: cannot bind " + endpoint);
+    }
+    if (listen(fd_m, 8) != 0)
+        throw std::runtime_error("metrics: cannot listen on " + endpoint);
+    thread_m = std::thread(&MetricsServer::serve, this);
+}
+
+MetricsServer::~MetricsServer() {
+    stop_m = true;
+    thread_m.join();
+    close(fd_m);
+    if (!unix_path_m.empty()) unlink(unix_path_m.c_str());
+}
+
+void MetricsServer::serve() {
+#ifdef TRACE
+    trace_thread_name("metrics");
+#endif
+    while (!stop_m) {
+        pollfd p = {fd_m, POLLIN, 0};
+        if (poll(&p, 1, 200) <= 0) continue;  // wake up to check stop_m
+        int client = accept(fd_m, nullptr, nullptr);
+        if (client < 0) continue;
+        // the request itself does not matter, every path gets the metrics
+        pollfd c = {client, POLLIN, 0};
+        char request[4096];
+        if (poll(&c, 1, 1000) > 0) {
+            ssize_t got = read(client, request, sizeof(request));
+            (void)got;
+        }
+        std::string body = registry_m.render();
+        std::string response =
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: " +
+            std::to_string(body.size()) + "\r\n\r\n" + body;
+        const char* p_out = response.data();
+        size_t left = response.size();
+        while (left > 0) {
+            ssize_t put = send(client, p_out, left, MSG_NOSIGNAL);
+            if (put <= 0) break;
+            p_out += put;
+            left -= put;
+        }
+        close(client);
+    }
+}
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef MY_PERF
+#define MY_PERF
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "my_trace.hpp"
+#include "oneapi/dnnl/dnnl.hpp"
+
+// Hardware counters per primitive through perf_event_open. oneDNN runs a
+// primitive on the OpenMP team, so every team thread gets its own counter
+// group, all enabled/disabled together and summed.
+//
+// Only generic events are used: LLC references stand for L2 misses and
+// memory traffic is estimated as LLC misses * 64 bytes. FLOPs are not a
+// generic event (FP_ARITH_* is model specific), they come from the shapes.
+
+enum perf_event_id {
+    perf_cycles,
+    perf_instructions,
+    perf_l1d_reads,
+    perf_l1d_misses,
+    perf_llc_refs,
+    perf_llc_misses,
+    perf_events_count,
+};
+
+using PerfCounts = std::array<uint64_t, perf_events_count>;
+
+class PerfCounters {
+public:
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters&) = delete;
+
+    // false when perf_event_open is not allowed (perf_event_paranoid)
+    bool available() const { return !leaders.empty(); }
+    void start();
+    // counts since start(), scaled if the kernel had to multiplex
+    PerfCounts stop();
+
+private:
+    std::vector<int> leaders;
+    std::vector<int> fds;
+};
+
+namespace perf {
+
+inline int open_event(uint32_t type, uint64_t config, int group_fd) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group_fd == -1;  // members follow the leader
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // calling thread, any cpu
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+inline uint64_t cache_event(uint64_t cache, uint64_t result) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+}
+
+}  // namespace perf
+
+PerfCounters::PerfCounters() {
+    const std::pair<uint32_t, uint64_t> events[perf_events_count] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE,
+         perf::cache_event(PERF_COUNT_HW_CACHE_L1D,
+                           PERF_COUNT_HW_CACHE_RESULT_ACCESS)},
+        {PERF_TYPE_HW_CACHE,
+         perf::cache_event(PERF_COUNT_HW_CACHE_L1D,
+                           PERF_COUNT_HW_CACHE_RESULT_MISS)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    };
+
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    std::vector<std::vector<int>> groups(threads);
+    // one group per team thread, opened by that thread
+#ifdef _OPENMP
+#pragma omp parallel num_threads(threads)
+#endif
+    {
+        int t = 0;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        int leader = -1;
+        for (int e = 0; e < perf_events_count; ++e) {
+            int fd = perf::open_event(events[e].first, events[e].second,
+                                      leader);
+            if (fd < 0) break;
+            if (leader < 0) leader = fd;
+            groups[t].push_back(fd);
+        }
+    }
+
+    // a group missing an event would be summed wrongly, drop it
+    for (auto& g : groups) {
+        if ((int)g.size() == perf_events_count) {
+            leaders.push_back(g[0]);
+            fds.insert(fds.end(), g.begin(), g.end());
+        } else {
+            for (int fd : g)
+                close(fd);
+        }
+    }
+}
+
+PerfCounters::~PerfCounters() {
+    for (int fd : fds)
+        close(fd);
+}
+
+void PerfCounters::start() {
+    for (int fd : leaders) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+PerfCounts PerfCounters::stop() {
+    for (int fd : leaders)
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    PerfCounts counts = {};
+    for (int fd : leaders) {
+        // {nr, time_enabled, time_running, value[nr]}
+        uint64_t buf[3 + perf_events_count];
+        if (read(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) continue;
+        double scale = buf[2] ? (double)buf[1] / buf[2] : 0.0;
+        for (int e = 0; e < perf_events_count; ++e)
+            counts[e] += (uint64_t)(buf[3 + e] * scale);
+    }
+    return counts;
+}
+
+class LayerCounters {
+    // per primitive totals of one net, accumulated over its executions
+public:
+    LayerCounters(PerfCounters& perf, size_t layers)
+        : perf_m(perf), counts_m(layers), ns_m(layers), runs_m(layers) {}
+    LayerCounters(const LayerCounters&) = delete;
+
+    void begin() {
+        perf_m.start();
+        begin_m = std::chrono::steady_clock::now();
+    }
+    // primitive `layer` has finished (stream waited on)
+    void end(size_t layer);
+    // IPC, L1 / L2 / LLC miss rates, bandwidth and FLOP rate per primitive
+    void report(std::ostream& out, const std::vector<dnnl::primitive>& net,
+                const char* title) const;
+
+private:
+    PerfCounters& perf_m;
+    std::chrono::steady_clock::time_point begin_m;
+    std::vector<PerfCounts> counts_m;
+    std::vector<double> ns_m;
+    std::vector<uint64_t> runs_m;
+};
+
+void LayerCounters::end(size_t layer) {
+    PerfCounts c = perf_m.stop();
+    ns_m[layer] += std::chrono::duration<double, std::nano>(
+                       std::chrono::steady_clock::now() - begin_m)
+                       .count();
+    for (int e = 0; e < perf_events_count; ++e)
+        counts_m[layer][e] += c[e];
+    ++runs_m[layer];
+}
+
+namespace perf {
+
+inline int64_t volume(const dnnl_memory_desc_t* md) {
+    if (!md || md->ndims == 0) return 0;
+    int64_t v = 1;
+    for (int d = 0; d < md->ndims; ++d)
+        v *= md->dims[d];
+    return v;
+}
+
+inline std::string shape(const dnnl_memory_desc_t* md) {
+    if (!md || md->ndims == 0) return "-";
+    std::ostringstream s;
+    for (int d = 0; d < md->ndims; ++d)
+        s << (d ? "x" : "") << md->dims[d];
+    return s.str();
+}
+
+// multiply-adds counted as 2, for convolution and inner product only;
+// forward, backward data and backward weights cost the same
+inline double flops(const dnnl::primitive& p) {
+    auto pd = p.get_primitive_desc();
+    auto kind = p.get_kind();
+    if (kind != dnnl::primitive::kind::convolution &&
+        kind != dnnl::primitive::kind::inner_product)
+        return 0;
+    auto weights = dnnl_primitive_desc_query_md(pd, dnnl_query_weights_md, 0);
+    if (volume(weights) == 0)
+        weights = dnnl_primitive_desc_query_md(pd, dnnl_query_diff_weights_md,
+                                               0);
+    auto dst = dnnl_primitive_desc_query_md(pd, dnnl_query_dst_md, 0);
+    if (volume(dst) == 0)
+        dst = dnnl_primitive_desc_query_md(pd, dnnl_query_diff_dst_md, 0);
+    if (volume(weights) == 0) return 0;
+    // each dst element reduces over weights / OC
+    return 2.0 * volume(dst) * (volume(weights) / weights->dims[0]);
+}
+
+inline double ratio(uint64_t a, uint64_t b) { return b ? (double)a / b : 0; }
+
+}  // namespace perf
+
+void LayerCounters::report(std::ostream& out,
+                           const std::vector<dnnl::primitive>& net,
+                           const char* title) const {
+    // the caller's format is restored on return
+    const std::ios_base::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << title << ": per primitive, averaged over its runs" << std::endl
+        << std::setw(4) << "#" << std::setw(32) << "primitive"
+        << std::setw(22) << "src" << std::setw(22) << "dst" << std::setw(10)
+        << "ms" << std::setw(7) << "IPC" << std::setw(8) << "L1 miss"
+        << std::setw(8) << "L2 miss" << std::setw(9) << "LLC miss"
+        << std::setw(9) << "GB/s" << std::setw(9) << "GFLOP/s" << std::endl;
+    out << std::fixed;
+    for (size_t i = 0; i < net.size() && i < runs_m.size(); ++i) {
+        if (!runs_m[i]) continue;
+        const PerfCounts& c = counts_m[i];
+        auto pd = net[i].get_primitive_desc();
+        auto src = dnnl_primitive_desc_query_md(pd, dnnl_query_src_md, 0);
+        if (perf::volume(src) == 0)
+            src = dnnl_primitive_desc_query_md(pd, dnnl_query_diff_dst_md, 0);
+        auto dst = dnnl_primitive_desc_query_md(pd, dnnl_query_dst_md, 0);
+        if (perf::volume(dst) == 0)
+            dst = dnnl_primitive_desc_query_md(pd, dnnl_query_diff_src_md, 0);
+        if (perf::volume(dst) == 0)
+            dst = dnnl_primitive_desc_query_md(pd, dnnl_query_diff_weights_md,
+                                               0);
+
+        double ns = ns_m[i] / runs_m[i];
+        double bytes = 64.0 * c[perf_llc_misses] / runs_m[i];
+        out << std::setw(4) << i << std::setw(32)
+            << trace_primitive_name(net[i]) << std::setw(22)
+            << perf::shape(src) << std::setw(22) << perf::shape(dst)
+            << std::setw(10) << std::setprecision(3) << ns / 1e6
+            << std::setw(7) << std::setprecision(2)
+            << perf::ratio(c[perf_instructions], c[perf_cycles])
+            << std::setw(8)
+            << perf::ratio(c[perf_l1d_misses], c[perf_l1d_reads])
+            << std::setw(8) << perf::ratio(c[perf_llc_refs], c[perf_l1d_misses])
+            << std::setw(9)
+            << perf::ratio(c[perf_llc_misses], c[perf_llc_refs])
+            << std::setw(9) << std::setprecision(1) << bytes / ns
+            << std::setw(9) << perf::flops(net[i]) / ns << std::endl;
+    }
+    out.flags(flags);
+    out.precision(precision);
+}
+
+#endif
@@ -0,0 +1,296 @@
+#ifndef MY_SAVE
+#define MY_SAVE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "my_check.hpp"
+#include "my_fileio.hpp"
+#include "my_memory.hpp"
+#include "oneapi/dnnl/dnnl.hpp"
+
+// Weights saved without stalling training. capture() reorders every tensor
+// into a plain-layout staging copy at a step boundary, which costs about a
+// memcpy of the weights; a background thread then serializes the copy and
+// fsyncs it while the next steps run. A checkpoint is written to
+// "<path>.tmp" and renamed over <path> only once it is on disk, so a crash
+// mid-write leaves the previous one intact. A capture while the previous
+// checkpoint is still being written is skipped rather than waited for.
+//
+// File: SaveHeader, then per tensor its ndims, dims (int64) and the f32
+// data in plain layout (abcd...), then the FNV-1a hash of everything after
+// the header.
+
+struct SaveHeader {
+    char magic[4];  // "VGGW"
+    uint32_t version;
+    int64_t step;
+    uint32_t tensors;
+    uint32_t reserved;
+};
+
+namespace save {
+
+const char MAGIC[4] = {'V', 'G', 'G', 'W'};
+const uint32_t VERSION = 1;
+
+inline dnnl::memory::desc plain_desc(const dnnl::memory::desc& md) {
+    using tag = dnnl::memory::format_tag;
+    const tag plain[] = {tag::undef, tag::a, tag::ab, tag::abc, tag::abcd,
+                         tag::abcde};
+    auto dims = md.dims();
+    if (dims.empty() || dims.size() > 5)
+        throw std::runtime_error("save: unsupported tensor rank");
+    return dnnl::memory::desc(dims, md.data_type(), plain[dims.size()]);
+}
+
+const uint64_t FNV_BASIS = 0xcbf29ce484222325ULL;
+
+inline uint64_t fnv1a(uint64_t h, const void* data, size_t bytes) {
+    return check::fnv1a(static_cast<const unsigned char*>(data), bytes, h);
+}
+
+}  // namespace save
+
+class AsyncSaver {
+public:
+    // `tensors` are saved in this order, all f32
+    AsyncSaver(dnnl::engine eng, const std::vector<dnnl::memory>& tensors,
+               const std::string& path);
+    // waits for the checkpoint being written
+    ~AsyncSaver();
+    AsyncSaver(const AsyncSaver&) = delete;
+
+    // copy the tensors on `s` and queue the write; false, copying nothing,
+    // if the previous checkpoint is still being written. Throws if that
+    // one failed
+    bool capture(dnnl::stream& s, int64_t step);
+    // a checkpoint is being written
+    bool busy();
+    // wait for the checkpoint being written, throws if it failed
+    void wait();
+
+    size_t bytes() const { return bytes_m; }
+    int written() const;
+    int skipped() const { return skipped_m; }
+    double last_capture_ms() const { return capture_ms_m; }
+    // of the last finished write
+    double last_write_ms() const;
+
+private:
+    void writer();
+    // staging -> <path>, atomically; throws on failure
+    void write_file(int64_t step);
+
+    std::string path_m;
+    std::vector<dnnl::memory> staging_m;
+    std::vector<dnnl::primitive> copies_m;
+    std::vector<std::unordered_map<int, dnnl::memory>> copies_args_m;
+    size_t bytes_m = 0;
+    int written_m = 0, skipped_m = 0;
+    double capture_ms_m = 0, write_ms_m = 0;
+
+    mutable std::mutex mutex_m;
+    std::condition_variable cv_m;
+    bool pending_m = false, stop_m = false;
+    int64_t step_m = 0;
+    std::string error_m;
+    std::thread writer_m;
+};
+
+AsyncSaver::AsyncSaver(dnnl::engine eng,
+                       const std::vector<dnnl::memory>& tensors,
+                       const std::string& path)
+    : path_m(path) {
+    for (auto tensor : tensors) {
+        auto md = tensor.get_desc();
+        if (md.data_type() != dnnl::memory::data_type::f32)
+            throw std::runtime_error("AsyncSaver: f32 tensors only");
+        auto staging = make_memory(save::plain_desc(md), eng);
+        copies_m.push_back(dnnl::reorder(tensor, staging));
+        copies_args_m.push_back(
+            {{DNNL_ARG_FROM, tensor}, {DNNL_ARG_TO, staging}});
+        staging_m.push_back(staging);
+        bytes_m += staging.get_desc().get_size();
+    }
+    writer_m = std::thread(&AsyncSaver::writer, this);
+}
+
+AsyncSaver::~AsyncSaver() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_m);
+        cv_m.wait(lock, [&] { return !pending_m; });
+        stop_m = true;
+    }
+    cv_m.notify_all();
+    writer_m.join();
+}
+
+bool AsyncSaver::capture(dnnl::stream& s, int64_t step) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_m);
+        if (!error_m.empty()) throw std::runtime_error(error_m);
+        if (pending_m) {
+            ++skipped_m;
+            return false;
+        }
+    }
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < copies_m.size(); ++i)
+        copies_m[i].execute(s, copies_args_m[i]);
+    s.wait();
+    capture_ms_m = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - begin)
+                       .count();
+    {
+        std::lock_guard<std::mutex> lock(mutex_m);
+        pending_m = true;
+        step_m = step;
+    }
+    cv_m.notify_all();
+    return true;
+}
+
+int AsyncSaver::written() const {
+    std::lock_guard<std::mutex> lock(mutex_m);
+    return written_m;
+}
+
+double AsyncSaver::last_write_ms() const {
+    std::lock_guard<std::mutex> lock(mutex_m);
+    return write_ms_m;
+}
+
+bool AsyncSaver::busy() {
+    std::lock_guard<std::mutex> lock(mutex_m);
+    return pending_m;
+}
+
+void AsyncSaver::wait() {
+    std::unique_lock<std::mutex> lock(mutex_m);
+    cv_m.wait(lock, [&] { return !pending_m; });
+    if (!error_m.empty()) throw std::runtime_error(error_m);
+}
+
+void AsyncSaver::writer() {
+    for (;;) {
+        int64_t step;
+        {
+            std::unique_lock<std::mutex> lock(mutex_m);
+            cv_m.wait(lock, [&] { return stop_m || pending_m; });
+            if (!pending_m) return;
+            step = step_m;
+        }
+        auto begin = std::chrono::steady_clock::now();
+        std::string error;
+        try {
+            write_file(step);
+        } catch (const std::exception& e) {
+            error = std::string("cannot save: ") + e.what();
+        }
+        bool ok = error.empty();
+        {
+            std::lock_guard<std::mutex> lock(mutex_m);
+            write_ms_m = std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - begin)
+                             .count();
+            if (ok) ++written_m;
+            else error_m = error;
+            pending_m = false;
+        }
+        cv_m.notify_all();
+    }
+}
+
+void AsyncSaver::write_file(int64_t step) {
+    SaveHeader h;
+    memcpy(h.magic, save::MAGIC, 4);
+    h.version = save::VERSION;
+    h.step = step;
+    h.tensors = (uint32_t)staging_m.size();
+    h.reserved = 0;
+    fileio::write_file_atomic(path_m, [&](int fd) {
+        bool ok = fileio::write_all(fd, &h, sizeof(h));
+        uint64_t hash = save::FNV_BASIS;
+        for (size_t i = 0; ok && i < staging_m.size(); ++i) {
+            auto dims = staging_m[i].get_desc().dims();
+            uint32_t ndims = (uint32_t)dims.size();
+            auto data = staging_m[i].map_data<float>();
+            size_t bytes = staging_m[i].get_desc().get_size();
+            hash = save::fnv1a(hash, &ndims, sizeof(ndims));
+            hash = save::fnv1a(hash, dims.data(), ndims * sizeof(int64_t));
+            hash = save::fnv1a(hash, data, bytes);
+            ok = fileio::write_all(fd, &ndims, sizeof(ndims)) &&
+                 fileio::write_all(fd, dims.data(), ndims * sizeof(int64_t)) &&
+                 fileio::write_all(fd, data, bytes);
+            staging_m[i].unmap_data(data);
+        }
+        return ok && fileio::write_all(fd, &hash, sizeof(hash));
+    });
+}
+
+// read the checkpoint at `path` into `tensors`, which must have the shapes
+// it was saved from; false if there is none, throws if it is corrupt
+inline bool load_saved(const std::string& path,
+                       std::vector<dnnl::memory>& tensors, int64_t& step) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    auto fail = [&](const std::string& why) {
+        close(fd);
+        throw std::runtime_error("corrupt checkpoint " + path + ": " + why);
+    };
+
+    SaveHeader h;
+    if (!fileio::read_all(fd, &h, sizeof(h)) ||
+        memcmp(h.magic, save::MAGIC, 4) || h.version != save::VERSION)
+        fail("bad header");
+    if (h.tensors != tensors.size()) fail("tensor count");
+
+    // everything is read and hashed before any tensor is touched
+    std::vector<dnnl::memory> plain;
+    uint64_t hash = save::FNV_BASIS;
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        auto md = save::plain_desc(tensors[i].get_desc());
+        auto want = md.dims();
+        uint32_t ndims = 0;
+        if (!fileio::read_all(fd, &ndims, sizeof(ndims)) ||
+            ndims != want.size())
+            fail("rank of tensor " + std::to_string(i));
+        dnnl::memory::dims dims(ndims);
+        if (!fileio::read_all(fd, dims.data(), ndims * sizeof(int64_t)) ||
+            dims != want)
+            fail("shape of tensor " + std::to_string(i));
+        plain.push_back(dnnl::memory(md, tensors[i].get_engine()));
+        auto data = plain.back().map_data<float>();
+        bool ok = fileio::read_all(fd, data, md.get_size());
+        hash = save::fnv1a(hash, &ndims, sizeof(ndims));
+        hash = save::fnv1a(hash, dims.data(), ndims * sizeof(int64_t));
+        hash = save::fnv1a(hash, data, md.get_size());
+        plain.back().unmap_data(data);
+        if (!ok) fail("truncated");
+    }
+    uint64_t saved_hash = 0;
+    if (!fileio::read_all(fd, &saved_hash, sizeof(saved_hash)) ||
+        saved_hash != hash)
+        fail("checksum");
+    close(fd);
+
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        dnnl::stream s(tensors[i].get_engine());
+        dnnl::reorder(plain[i], tensors[i])
+            .execute(s, plain[i], tensors[i]);
+        s.wait();
+    }
+    step = h.step;
+    return true;
+}
+
+#endif
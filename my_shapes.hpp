@@ -0,0 +1,198 @@
+#ifndef MY_SHAPES
+#define MY_SHAPES
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "oneapi/dnnl/dnnl.hpp"
+
+// Layer shapes as types. Every layer states the per-image shape it expects
+// and its kernel, stride and padding as template parameters; Net<...>
+// static_asserts that each layer gets what the previous one produces, so a
+// wrong shape fails the build instead of a oneDNN descriptor at runtime.
+// The batch is not part of the type, it is read at startup (RuntimeConfig),
+// so sizes here are per image and buffers scale linearly with the batch.
+//
+// Net also sizes the layer outputs at compile time: plan_elems() for
+// training, where every output is kept for backward, and the two ping-pong
+// slots of inference, where a layer only needs its input alive. Graphs are
+// built from the layer types with for_each_layer.
+
+namespace shapes {
+
+using dim = dnnl::memory::dim;
+
+// per image offsets are rounded to 16 floats, so with any batch every
+// buffer starts on a cache line
+constexpr dim aligned(dim elems) { return (elems + 15) / 16 * 16; }
+
+// {batch, C, H, W}
+template <dim C, dim H, dim W>
+struct Shape {
+    static_assert(C > 0 && H > 0 && W > 0, "empty shape");
+    static constexpr int rank() { return 4; }
+    static constexpr dim c() { return C; }
+    static constexpr dim h() { return H; }
+    static constexpr dim w() { return W; }
+    static constexpr dim elems() { return C * H * W; }
+    static dnnl::memory::dims dims(dim batch) { return {batch, C, H, W}; }
+};
+
+// {batch, C}, the output of a Dense
+template <dim C>
+struct Flat {
+    static_assert(C > 0, "empty shape");
+    static constexpr int rank() { return 2; }
+    static constexpr dim c() { return C; }
+    static constexpr dim h() { return 1; }
+    static constexpr dim w() { return 1; }
+    static constexpr dim elems() { return C; }
+    static dnnl::memory::dims dims(dim batch) { return {batch, C}; }
+};
+
+template <class A, class B>
+struct same_shape
+    : std::integral_constant<bool, A::rank() == B::rank() && A::c() == B::c() &&
+                                       A::h() == B::h() && A::w() == B::w()> {};
+
+// K x K convolution with bias and fused relu (Conv2DwithReLu)
+template <class Src, dim OC, dim K, dim S, dim P>
+struct Conv {
+    static_assert(Src::rank() == 4, "conv over a flat input");
+    static_assert(K > 0 && S > 0 && P >= 0 && P < K, "conv: bad window");
+    static_assert((Src::h() + 2 * P - K) % S == 0 &&
+                      (Src::w() + 2 * P - K) % S == 0,
+                  "conv: the window does not tile the input");
+    using src = Src;
+    using dst = Shape<OC, (Src::h() + 2 * P - K) / S + 1,
+                      (Src::w() + 2 * P - K) / S + 1>;
+    static constexpr dim weights_elems() { return OC * Src::c() * K * K + OC; }
+    static dnnl::memory::dims src_dims(dim batch) { return src::dims(batch); }
+    static dnnl::memory::dims dst_dims(dim batch) { return dst::dims(batch); }
+    static dnnl::memory::dims weights_dims() { return {OC, Src::c(), K, K}; }
+    static dnnl::memory::dims strides() { return {S, S}; }
+    static dnnl::memory::dims padding() { return {P, P}; }
+};
+
+// K x K max pooling, no padding (MaxPooling)
+template <class Src, dim K, dim S>
+struct MaxPool {
+    static_assert(Src::rank() == 4, "pooling over a flat input");
+    static_assert(K > 0 && S > 0, "pooling: bad window");
+    static_assert((Src::h() - K) % S == 0 && (Src::w() - K) % S == 0,
+                  "pooling: the window does not tile the input");
+    using src = Src;
+    using dst = Shape<Src::c(), (Src::h() - K) / S + 1, (Src::w() - K) / S + 1>;
+    static constexpr dim weights_elems() { return 0; }
+    static dnnl::memory::dims src_dims(dim batch) { return src::dims(batch); }
+    static dnnl::memory::dims dst_dims(dim batch) { return dst::dims(batch); }
+    static dnnl::memory::dims kernel() { return {K, K}; }
+    static dnnl::memory::dims strides() { return {S, S}; }
+    static dnnl::memory::dims padding() { return {0, 0}; }
+};
+
+// average over H x W (GlobalAvgPooling)
+template <class Src>
+struct GlobalPool {
+    static_assert(Src::rank() == 4, "pooling over a flat input");
+    using src = Src;
+    using dst = Shape<Src::c(), 1, 1>;
+    static constexpr dim weights_elems() { return 0; }
+    static dnnl::memory::dims src_dims(dim batch) { return src::dims(batch); }
+    static dnnl::memory::dims dst_dims(dim batch) { return dst::dims(batch); }
+};
+
+// fully connected over all of Src, weights {O, Src dims} (Dense)
+template <class Src, dim O>
+struct Dense {
+    using src = Src;
+    using dst = Flat<O>;
+    static constexpr dim weights_elems() { return O * Src::elems() + O; }
+    static dnnl::memory::dims src_dims(dim batch) { return src::dims(batch); }
+    static dnnl::memory::dims dst_dims(dim batch) { return dst::dims(batch); }
+    // {O, C, H, W} or {O, C}
+    static dnnl::memory::dims weights_dims() { return Src::dims(O); }
+};
+
+// elementwise, out of place (ReLU)
+template <class Src>
+struct Relu {
+    using src = Src;
+    using dst = Src;
+    static constexpr dim weights_elems() { return 0; }
+};
+
+namespace detail {
+
+template <class... Layers>
+struct chain;
+
+template <class Last>
+struct chain<Last> {
+    using dst = typename Last::dst;
+};
+
+template <class A, class B, class... Rest>
+struct chain<A, B, Rest...> {
+    static_assert(same_shape<typename A::dst, typename B::src>::value,
+                  "layer input does not match the previous layer output");
+    using dst = typename chain<B, Rest...>::dst;
+};
+
+}  // namespace detail
+
+template <class... Layers>
+struct Net {
+    static_assert(sizeof...(Layers) > 0, "empty net");
+    using src = typename std::tuple_element<0, std::tuple<Layers...>>::type::src;
+    using dst = typename detail::chain<Layers...>::dst;
+    template <size_t i>
+    using layer = typename std::tuple_element<i, std::tuple<Layers...>>::type;
+
+    static constexpr size_t size() { return sizeof...(Layers); }
+
+    // floats of all weights and biases
+    static constexpr dim weights_elems() {
+        const dim e[] = {Layers::weights_elems()...};
+        dim sum = 0;
+        for (size_t i = 0; i < size(); ++i)
+            sum += e[i];
+        return sum;
+    }
+    // training: all outputs kept, plan_elems() * batch floats
+    static constexpr dim plan_elems() {
+        const dim e[] = {aligned(Layers::dst::elems())...};
+        dim sum = 0;
+        for (size_t i = 0; i < size(); ++i)
+            sum += e[i];
+        return sum;
+    }
+    // inference: two slots of slot_elems() floats per image, layer i
+    // writing slot i % 2; the net src is not part of the plan
+    static constexpr dim slot_elems() {
+        const dim e[] = {aligned(Layers::dst::elems())...};
+        dim max = 0;
+        for (size_t i = 0; i < size(); ++i)
+            max = e[i] > max ? e[i] : max;
+        return max;
+    }
+
+    // f(Layer()) for every layer in order; f overloads operator() on the
+    // layer kinds (Conv<...>, MaxPool<...>, ...)
+    template <class F>
+    static void for_each_layer(F& f) {
+        for_each_layer(f, std::index_sequence_for<Layers...>());
+    }
+
+private:
+    template <class F, size_t... I>
+    static void for_each_layer(F& f, std::index_sequence<I...>) {
+        const int expand[] = {0, (f(layer<I>()), 0)...};
+        (void)expand;
+    }
+};
+
+}  // namespace shapes
+
+#endif
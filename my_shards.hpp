@@ -0,0 +1,268 @@
+#ifndef MY_SHARDS
+#define MY_SHARDS
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "my_fileio.hpp"
+#include "my_init.hpp"
+
+// Sharded training set for data that does not fit in memory. A shard is a
+// header followed by fixed-size records {label, rows * cols pixels}, all
+// decoded uint8 and already shuffled, so reading is sequential. The index
+// (index.txt in the shard directory) lists "rows cols" then one
+// "<file> <count>" line per shard.
+//
+// ShardReader streams the shards in a new shuffled order every epoch from a
+// background thread: posix_fadvise(SEQUENTIAL) on the current shard,
+// WILLNEED on the next one so the kernel reads ahead while this one is
+// parsed, DONTNEED once it is copied out so the page cache does not grow
+// with the dataset. At most `prefetch` shards wait in memory, plus the
+// shuffle window, whatever the size of the set.
+
+struct ShardHeader {
+    char magic[4];  // "VGGS"
+    uint32_t version;
+    uint32_t count;  // records
+    uint32_t rows, cols;
+};
+
+namespace shards {
+
+const char MAGIC[4] = {'V', 'G', 'G', 'S'};
+const uint32_t VERSION = 1;
+
+inline std::string shard_name(size_t k) {
+    char name[32];
+    snprintf(name, sizeof(name), "shard_%05zu.bin", k);
+    return name;
+}
+
+// Fisher-Yates with the counter-based RNG, same order for the same seed
+inline std::vector<size_t> permutation(size_t n, uint64_t seed,
+                                       uint64_t stream) {
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i)
+        order[i] = i;
+    for (size_t i = n; i > 1; --i)
+        std::swap(order[i - 1],
+                  order[counter_random(seed, stream, i) % i]);
+    return order;
+}
+
+}  // namespace shards
+
+// shuffle (images, labels) and write them as shards of `per_shard` records
+// into `dir`, created if missing. Returns the number of shards. The index
+// is written last, atomically, once every shard is on disk: a directory
+// with an index is complete
+inline size_t write_shards(const std::string& dir,
+                           const std::vector<std::vector<uint8_t>>& images,
+                           const std::vector<uint8_t>& labels, uint32_t rows,
+                           uint32_t cols, size_t per_shard,
+                           uint64_t seed = INIT_SEED) {
+    mkdir(dir.c_str(), 0755);
+    auto order = shards::permutation(images.size(), seed, 0);
+    const size_t pixels = (size_t)rows * cols;
+
+    std::string index =
+        std::to_string(rows) + " " + std::to_string(cols) + "\n";
+
+    size_t k = 0;
+    for (size_t first = 0; first < order.size(); first += per_shard, ++k) {
+        size_t count = std::min(per_shard, order.size() - first);
+        std::string name = shards::shard_name(k);
+        std::ofstream out(dir + "/" + name, std::ios::binary);
+        ShardHeader h;
+        memcpy(h.magic, shards::MAGIC, 4);
+        h.version = shards::VERSION;
+        h.count = (uint32_t)count;
+        h.rows = rows;
+        h.cols = cols;
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        for (size_t r = first; r < first + count; ++r) {
+            const auto& pic = images[order[r]];
+            if (pic.size() != pixels)
+                throw std::runtime_error("write_shards: image size mismatch");
+            out.put((char)labels[order[r]]);
+            out.write(reinterpret_cast<const char*>(pic.data()), pixels);
+        }
+        out.close();
+        if (!out) throw std::runtime_error("cannot write " + dir + "/" + name);
+        fileio::sync_path(dir + "/" + name);
+        index += name + " " + std::to_string(count) + "\n";
+    }
+    fileio::write_file_atomic(dir + "/index.txt", [&](int fd) {
+        return fileio::write_all(fd, index.data(), index.size());
+    });
+    return k;
+}
+
+class ShardReader {
+public:
+    // `window` records are kept to draw from, `prefetch` shards read ahead
+    ShardReader(const std::string& dir, size_t window, size_t prefetch = 2,
+                uint64_t seed = INIT_SEED);
+    ~ShardReader();
+    ShardReader(const ShardReader&) = delete;
+
+    uint32_t rows() const { return rows_m; }
+    uint32_t cols() const { return cols_m; }
+    // records in the index, one epoch
+    size_t size() const { return size_m; }
+    // next record of the endless shuffled stream: rows * cols pixels into
+    // `pixels`, returns the label
+    uint8_t next(uint8_t* pixels);
+
+private:
+    void produce();
+    // next record in shard order into `record`
+    void pull(uint8_t* record);
+
+    std::string dir_m;
+    std::vector<std::string> files_m;
+    std::vector<uint32_t> counts_m;
+    uint32_t rows_m = 0, cols_m = 0;
+    size_t record_m = 0, size_m = 0;
+    size_t prefetch_m;
+    uint64_t seed_m;
+
+    // producer -> consumer, shards with their header stripped
+    std::mutex mutex_m;
+    std::condition_variable cv_m;
+    std::deque<std::vector<uint8_t>> ready_m;
+    std::string error_m;
+    bool stop_m = false;
+    std::thread producer_m;
+
+    // consumer side
+    std::vector<uint8_t> current_m;
+    size_t cursor_m = 0;
+    std::vector<uint8_t> window_m;  // `window` records
+    size_t window_size_m, filled_m = 0;
+    uint64_t draws_m = 0;
+};
+
+ShardReader::ShardReader(const std::string& dir, size_t window,
+                         size_t prefetch, uint64_t seed)
+    : dir_m(dir),
+      prefetch_m(std::max(prefetch, (size_t)1)),
+      seed_m(seed),
+      window_size_m(std::max(window, (size_t)1)) {
+    std::ifstream index(dir + "/index.txt");
+    if (!(index >> rows_m >> cols_m))
+        throw std::runtime_error("cannot read " + dir + "/index.txt");
+    std::string file;
+    uint32_t count;
+    while (index >> file >> count) {
+        files_m.push_back(file);
+        counts_m.push_back(count);
+        size_m += count;
+    }
+    if (size_m == 0) throw std::runtime_error("empty shard index in " + dir);
+    record_m = 1 + (size_t)rows_m * cols_m;
+    window_size_m = std::min(window_size_m, size_m);
+    window_m.resize(window_size_m * record_m);
+
+    producer_m = std::thread(&ShardReader::produce, this);
+}
+
+ShardReader::~ShardReader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_m);
+        stop_m = true;
+    }
+    cv_m.notify_all();
+    producer_m.join();
+}
+
+void ShardReader::produce() {
+    for (uint64_t epoch = 1;; ++epoch) {
+        auto order = shards::permutation(files_m.size(), seed_m, epoch);
+        for (size_t k = 0; k < order.size(); ++k) {
+            std::string path = dir_m + "/" + files_m[order[k]];
+            int fd = open(path.c_str(), O_RDONLY);
+            std::vector<uint8_t> shard;
+            ShardHeader h;
+            bool ok = fd >= 0;
+            if (ok) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                // start the next shard's readahead while this one is read
+                if (k + 1 < order.size()) {
+                    std::string next = dir_m + "/" + files_m[order[k + 1]];
+                    int nfd = open(next.c_str(), O_RDONLY);
+                    if (nfd >= 0) {
+                        posix_fadvise(nfd, 0, 0, POSIX_FADV_WILLNEED);
+                        close(nfd);
+                    }
+                }
+                ok = fileio::read_all(fd, &h, sizeof(h)) &&
+                     !memcmp(h.magic, shards::MAGIC, 4) &&
+                     h.version == shards::VERSION && h.rows == rows_m &&
+                     h.cols == cols_m;
+                if (ok) {
+                    shard.resize((size_t)h.count * record_m);
+                    ok = fileio::read_all(fd, shard.data(), shard.size());
+                }
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                close(fd);
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_m);
+            if (!ok) {
+                error_m = "bad shard " + path;
+                stop_m = true;
+            }
+            cv_m.wait(lock, [&] {
+                return stop_m || ready_m.size() < prefetch_m;
+            });
+            if (stop_m) {
+                cv_m.notify_all();
+                return;
+            }
+            if (!shard.empty()) ready_m.push_back(std::move(shard));
+            cv_m.notify_all();
+        }
+    }
+}
+
+void ShardReader::pull(uint8_t* record) {
+    while (cursor_m * record_m >= current_m.size()) {
+        std::unique_lock<std::mutex> lock(mutex_m);
+        cv_m.wait(lock, [&] { return stop_m || !ready_m.empty(); });
+        if (ready_m.empty()) throw std::runtime_error(error_m);
+        current_m = std::move(ready_m.front());
+        ready_m.pop_front();
+        cursor_m = 0;
+        cv_m.notify_all();
+    }
+    memcpy(record, current_m.data() + cursor_m * record_m, record_m);
+    ++cursor_m;
+}
+
+uint8_t ShardReader::next(uint8_t* pixels) {
+    while (filled_m < window_size_m)
+        pull(window_m.data() + filled_m++ * record_m);
+    // draw a random slot, hand it out and refill it from the stream
+    size_t slot = counter_random(seed_m, ~0ULL, draws_m++) % window_size_m;
+    uint8_t* record = window_m.data() + slot * record_m;
+    uint8_t label = record[0];
+    memcpy(pixels, record + 1, record_m - 1);
+    pull(record);
+    return label;
+}
+
+#endif
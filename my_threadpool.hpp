@@ -0,0 +1,310 @@
+#ifndef MY_THREADPOOL
+#define MY_THREADPOOL
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "oneapi/dnnl/dnnl_threadpool_iface.hpp"
+
+// One work-stealing pool for oneDNN (through threadpool_iface, with oneDNN
+// built for the THREADPOOL runtime), batch preparation and evaluation, so
+// they share the cores instead of oversubscribing them with an OpenMP team
+// plus threads of their own.
+//
+// Every worker owns a deque per priority: it pops its own newest task
+// (cache-warm), idle workers steal the oldest task of another. Threads
+// outside the pool push to a shared queue. A thread waiting in
+// parallel_for runs tasks meanwhile, but only ones at least as urgent as
+// its own, so training never waits behind an evaluation chunk. Tasks
+// inherit the priority of the thread that queued them.
+
+enum class task_priority { high, normal, low };
+const int task_priorities = 3;
+
+inline const char* task_priority_name(int prio) {
+    static const char* names[task_priorities] = {"high", "normal", "low"};
+    return names[prio];
+}
+
+namespace pool {
+
+// per thread, for the one pool of the process
+struct ThreadState {
+    int queue = -1;  // own deque, -1 outside the pool
+    int depth = 0;   // parallel_for chunks running on this thread
+    task_priority prio = task_priority::normal;
+};
+
+inline ThreadState& this_thread() {
+    thread_local ThreadState state;
+    return state;
+}
+
+}  // namespace pool
+
+class ScopedPriority {
+    // priority of the tasks the calling thread queues in this scope
+public:
+    explicit ScopedPriority(task_priority prio)
+        : saved_m(pool::this_thread().prio) {
+        pool::this_thread().prio = prio;
+    }
+    ~ScopedPriority() { pool::this_thread().prio = saved_m; }
+    ScopedPriority(const ScopedPriority&) = delete;
+
+private:
+    task_priority saved_m;
+};
+
+class WaitStats {
+    // time from queueing to start, in log2 buckets of nanoseconds
+public:
+    static const int buckets = 48;
+
+    void add(uint64_t ns);
+    uint64_t count() const { return count_m.load(); }
+    double mean_us() const;
+    double max_us() const { return max_ns_m.load() / 1e3; }
+    // upper bound of the bucket holding quantile q, at most the max
+    double quantile_us(double q) const;
+
+private:
+    std::atomic<uint64_t> hist_m[buckets] = {};
+    std::atomic<uint64_t> count_m{0}, sum_ns_m{0}, max_ns_m{0};
+};
+
+class WorkStealingPool : public dnnl::threadpool_interop::threadpool_iface {
+public:
+    // `threads` including the thread calling parallel_for, which works too
+    explicit WorkStealingPool(int threads);
+    ~WorkStealingPool();
+    WorkStealingPool(const WorkStealingPool&) = delete;
+
+    // threadpool_iface, synchronous: parallel_for returns once fn(i, n)
+    // ran for every i
+    int get_num_threads() const override { return threads_m; }
+    bool get_in_parallel() const override {
+        return pool::this_thread().depth > 0;
+    }
+    void parallel_for(int n, const std::function<void(int, int)>& fn) override;
+    uint64_t get_flags() const override { return 0; }
+
+    // fn on a worker, its own parallel_for chunks at the same priority
+    std::future<void> submit(std::function<void()> fn, task_priority prio);
+    // queue wait per priority and steals
+    void report(std::ostream& out) const;
+
+private:
+    struct Task {
+        std::function<void()> fn;
+        task_priority prio;
+        bool chunk;  // of a parallel_for
+        std::chrono::steady_clock::time_point queued;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks[task_priorities];
+    };
+
+    void push(Task task);
+    // run one task of priority `up_to` or more urgent; false if none
+    bool try_run(task_priority up_to);
+    void work(int queue);
+
+    int threads_m;
+    // one per worker, the last for threads outside the pool
+    std::vector<std::unique_ptr<Queue>> queues_m;
+    std::vector<std::thread> workers_m;
+    std::atomic<int> pending_m{0};
+    std::mutex sleep_m;
+    std::condition_variable wake_m;
+    bool stop_m = false;
+    WaitStats wait_m[task_priorities];
+    std::atomic<uint64_t> steals_m{0};
+};
+
+// pool of batch preparation, nullptr to prepare on the calling thread
+inline WorkStealingPool*& default_pool() {
+    static WorkStealingPool* pool = nullptr;
+    return pool;
+}
+
+void WaitStats::add(uint64_t ns) {
+    int b = 0;
+    while (b < buckets - 1 && (ns >> (b + 1))) ++b;
+    hist_m[b].fetch_add(1, std::memory_order_relaxed);
+    count_m.fetch_add(1, std::memory_order_relaxed);
+    sum_ns_m.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max = max_ns_m.load(std::memory_order_relaxed);
+    while (ns > max && !max_ns_m.compare_exchange_weak(max, ns)) {
+    }
+}
+
+double WaitStats::mean_us() const {
+    uint64_t n = count_m.load();
+    return n ? sum_ns_m.load() / 1e3 / n : 0;
+}
+
+double WaitStats::quantile_us(double q) const {
+    uint64_t n = count_m.load(), seen = 0;
+    for (int b = 0; b < buckets; ++b) {
+        seen += hist_m[b].load();
+        if (n && seen >= q * n)
+            return std::min((double)(2ULL << b) / 1e3, max_us());
+    }
+    return 0;
+}
+
+WorkStealingPool::WorkStealingPool(int threads)
+    : threads_m(std::max(threads, 1)) {
+    // at least one worker, or submitted tasks would never run
+    int workers = std::max(threads_m - 1, 1);
+    for (int q = 0; q <= workers; ++q)
+        queues_m.emplace_back(new Queue);
+    for (int q = 0; q < workers; ++q)
+        workers_m.emplace_back(&WorkStealingPool::work, this, q);
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_m);
+        stop_m = true;
+    }
+    wake_m.notify_all();
+    for (auto& w : workers_m)
+        w.join();
+}
+
+void WorkStealingPool::push(Task task) {
+    int q = pool::this_thread().queue;
+    Queue& queue = *queues_m[q >= 0 ? q : queues_m.size() - 1];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks[(int)task.prio].push_back(std::move(task));
+    }
+    pending_m.fetch_add(1);
+    { std::lock_guard<std::mutex> lock(sleep_m); }
+    wake_m.notify_one();
+}
+
+bool WorkStealingPool::try_run(task_priority up_to) {
+    pool::ThreadState& me = pool::this_thread();
+    const int queues = queues_m.size();
+    const int own = me.queue >= 0 ? me.queue : queues - 1;
+    Task task;
+    bool found = false;
+    for (int p = 0; p <= (int)up_to && !found; ++p) {
+        // own newest first, then the oldest of the others
+        for (int k = 0; k < queues && !found; ++k) {
+            Queue& queue = *queues_m[(own + k) % queues];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            auto& tasks = queue.tasks[p];
+            if (tasks.empty()) continue;
+            if (k == 0) {
+                task = std::move(tasks.back());
+                tasks.pop_back();
+            } else {
+                task = std::move(tasks.front());
+                tasks.pop_front();
+                steals_m.fetch_add(1, std::memory_order_relaxed);
+            }
+            found = true;
+        }
+    }
+    if (!found) return false;
+    pending_m.fetch_sub(1);
+    wait_m[(int)task.prio].add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - task.queued)
+            .count());
+
+    task_priority saved = me.prio;
+    me.prio = task.prio;
+    me.depth += task.chunk;
+    task.fn();
+    me.depth -= task.chunk;
+    me.prio = saved;
+    return true;
+}
+
+void WorkStealingPool::work(int queue) {
+    pool::this_thread().queue = queue;
+    for (;;) {
+        if (try_run(task_priority::low)) continue;
+        std::unique_lock<std::mutex> lock(sleep_m);
+        wake_m.wait(lock, [&] { return stop_m || pending_m.load() > 0; });
+        if (stop_m) return;
+    }
+}
+
+void WorkStealingPool::parallel_for(
+    int n, const std::function<void(int, int)>& fn) {
+    if (n <= 0) return;
+    pool::ThreadState& me = pool::this_thread();
+    std::atomic<int> left{n - 1};
+    auto now = std::chrono::steady_clock::now();
+    for (int i = 1; i < n; ++i)
+        push({[&fn, &left, i, n] {
+                  fn(i, n);
+                  left.fetch_sub(1, std::memory_order_release);
+              },
+              me.prio, true, now});
+
+    ++me.depth;
+    fn(0, n);
+    --me.depth;
+    // help rather than block; yield when only less urgent work is left
+    while (left.load(std::memory_order_acquire) > 0)
+        if (!try_run(me.prio)) std::this_thread::yield();
+}
+
+std::future<void> WorkStealingPool::submit(std::function<void()> fn,
+                                           task_priority prio) {
+    auto done = std::make_shared<std::promise<void>>();
+    auto future = done->get_future();
+    push({[fn, done] {
+              try {
+                  fn();
+                  done->set_value();
+              } catch (...) {
+                  done->set_exception(std::current_exception());
+              }
+          },
+          prio, false, std::chrono::steady_clock::now()});
+    return future;
+}
+
+void WorkStealingPool::report(std::ostream& out) const {
+    // the caller's format is restored on return
+    const std::ios_base::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << "pool of " << threads_m << " threads, " << steals_m.load()
+        << " steals; queue wait in us:" << std::endl
+        << std::setw(8) << "priority" << std::setw(10) << "tasks"
+        << std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10)
+        << "p99" << std::setw(10) << "max" << std::endl;
+    out << std::fixed << std::setprecision(1);
+    for (int p = 0; p < task_priorities; ++p) {
+        const WaitStats& w = wait_m[p];
+        out << std::setw(8) << task_priority_name(p) << std::setw(10)
+            << w.count() << std::setw(10) << w.mean_us() << std::setw(10)
+            << w.quantile_us(0.5) << std::setw(10) << w.quantile_us(0.99)
+            << std::setw(10) << w.max_us() << std::endl;
+    }
+    out.flags(flags);
+    out.precision(precision);
+}
+
+#endif
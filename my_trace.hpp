@@ -0,0 +1,186 @@
+#ifndef MY_TRACE
+#define MY_TRACE
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "oneapi/dnnl/dnnl.hpp"
+
+// Timeline tracing to the Chrome trace format (chrome://tracing, Perfetto).
+// Every thread appends complete events to its own ring buffer, no lock
+// and no allocation on that path; the rings are merged only by dump().
+// Hooks are TRACE_SCOPE / TRACE_SCOPE_INDEX, empty unless TRACE is defined
+// before this header is included.
+
+struct TraceEvent {
+    const char* name;  // string literals only, nothing is copied
+    const char* cat;
+    int64_t index;  // position in its net, -1 if none
+    uint64_t begin_ns;
+    uint64_t end_ns;
+};
+
+class TraceRing {
+    // written by its thread only; when full the oldest events are dropped
+public:
+    static const size_t capacity = 1 << 16;  // power of two
+
+    TraceRing(long tid, const char* name)
+        : tid(tid), name(name), events(capacity) {}
+    TraceRing(const TraceRing&) = delete;
+
+    void push(const TraceEvent& e) {
+        size_t h = head.load(std::memory_order_relaxed);
+        events[h & (capacity - 1)] = e;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    const long tid;
+    const char* name;
+    std::atomic<size_t> head{0};
+    std::vector<TraceEvent> events;
+};
+
+inline uint64_t trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+class Tracer {
+public:
+    static Tracer& get() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    // ring of the calling thread, registered on its first event
+    TraceRing& ring() {
+        thread_local TraceRing* mine = nullptr;
+        if (!mine) {
+            std::lock_guard<std::mutex> lock(mutex_m);
+            rings_m.emplace_back(
+                new TraceRing(syscall(SYS_gettid), "worker"));
+            mine = rings_m.back().get();
+        }
+        return *mine;
+    }
+
+    // write every ring as Chrome JSON; threads should be quiet meanwhile
+    bool dump(const std::string& path);
+
+private:
+    Tracer() : origin_m(trace_now()) {}
+
+    uint64_t origin_m;
+    std::mutex mutex_m;
+    std::vector<std::unique_ptr<TraceRing>> rings_m;
+};
+
+bool Tracer::dump(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) return false;
+    std::lock_guard<std::mutex> lock(mutex_m);
+
+    // microseconds, nanoseconds kept as decimals
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    for (auto& r : rings_m) {
+        out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\","
+            << "\"pid\":0,\"tid\":" << r->tid << ",\"args\":{\"name\":\""
+            << r->name << "\"}}";
+        first = false;
+
+        size_t head = r->head.load(std::memory_order_acquire);
+        size_t begin = head > TraceRing::capacity ? head - TraceRing::capacity
+                                                  : 0;
+        for (size_t i = begin; i < head; ++i) {
+            const TraceEvent& e = r->events[i & (TraceRing::capacity - 1)];
+            out << ",\n{\"name\":\"" << e.name << "\",\"cat\":\"" << e.cat
+                << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << r->tid
+                << ",\"ts\":" << (e.begin_ns - origin_m) / 1000.0
+                << ",\"dur\":" << (e.end_ns - e.begin_ns) / 1000.0;
+            if (e.index >= 0) out << ",\"args\":{\"index\":" << e.index << "}";
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+    return (bool)out;
+}
+
+// name shown for the calling thread
+inline void trace_thread_name(const char* name) {
+    Tracer::get().ring().name = name;
+}
+
+class TraceScope {
+public:
+    TraceScope(const char* name, const char* cat, int64_t index = -1)
+        : name_m(name), cat_m(cat), index_m(index), begin_m(trace_now()) {}
+    ~TraceScope() {
+        Tracer::get().ring().push(
+            {name_m, cat_m, index_m, begin_m, trace_now()});
+    }
+    TraceScope(const TraceScope&) = delete;
+
+private:
+    const char* name_m;
+    const char* cat_m;
+    int64_t index_m;
+    uint64_t begin_m;
+};
+
+// forward / backward-data / backward-weights told apart by prop kind
+inline const char* trace_primitive_name(const dnnl::primitive& p) {
+    dnnl_prop_kind_t prop = dnnl_prop_kind_undef;
+    dnnl_primitive_desc_query(p.get_primitive_desc(), dnnl_query_prop_kind,
+                              0, &prop);
+    bool fwd = prop == dnnl_forward_training || prop == dnnl_forward_inference;
+    bool bwd_w = prop == dnnl_backward_weights;
+
+    using kind = dnnl::primitive::kind;
+    switch (p.get_kind()) {
+        case kind::reorder: return "reorder";
+        case kind::sum: return "sum";
+        case kind::binary: return "binary";
+        case kind::convolution:
+            return fwd ? "convolution_forward"
+                       : bwd_w ? "convolution_backward_weights"
+                               : "convolution_backward_data";
+        case kind::inner_product:
+            return fwd ? "inner_product_forward"
+                       : bwd_w ? "inner_product_backward_weights"
+                               : "inner_product_backward_data";
+        case kind::eltwise:
+            return fwd ? "eltwise_forward" : "eltwise_backward";
+        case kind::pooling:
+        case kind::pooling_v2:
+            return fwd ? "pooling_forward" : "pooling_backward";
+        case kind::softmax:
+            return fwd ? "softmax_forward" : "softmax_backward";
+        default: return "primitive";
+    }
+}
+
+#define TRACE_CAT2(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT2(a, b)
+#ifdef TRACE
+#define TRACE_SCOPE(name, cat) \
+    TraceScope TRACE_CAT(trace_scope_, __LINE__)(name, cat)
+#define TRACE_SCOPE_INDEX(name, cat, index) \
+    TraceScope TRACE_CAT(trace_scope_, __LINE__)(name, cat, index)
+#else
+#define TRACE_SCOPE(name, cat)
+#define TRACE_SCOPE_INDEX(name, cat, index)
+#endif
+
+#endif
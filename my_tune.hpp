@@ -0,0 +1,207 @@
+#ifndef MY_TUNE
+#define MY_TUNE
+
+#include <sched.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "my_eval.hpp"
+#include "oneapi/dnnl/dnnl.hpp"
+
+// Throughput autotuning under a latency target. A configuration is a batch
+// size, threads per instance, instances (copies of the inference graph run
+// side by side on disjoint cores) and the activation layout. measure() runs
+// one for a while and reports images/s and the p50 / p99 batch latency;
+// the best one within the target is saved as a RuntimeConfig, which the
+// runtime reads at startup instead of constants baked into the binary.
+
+struct RuntimeConfig {
+    // training, never tuned, only read
+    dnnl::memory::dim train_batch = 16;
+    int train_threads = 0;  // 0 for the OpenMP default
+    // inference (evaluation), written by the autotuner; the instances it
+    // found best are a deployment setting (one graph per process), only
+    // reported in the file's comment
+    dnnl::memory::dim batch = 32;
+    int threads = 0;
+    std::string layout = "any";  // any, nchw or nhwc
+};
+
+// "key value" lines, '#' starts a comment; keys missing from the file keep
+// their value. false if the file cannot be read
+inline bool load_config(const std::string& path, RuntimeConfig& config) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string key;
+        if (!(fields >> key)) continue;
+        if (key == "train_batch") fields >> config.train_batch;
+        else if (key == "train_threads") fields >> config.train_threads;
+        else if (key == "batch") fields >> config.batch;
+        else if (key == "threads") fields >> config.threads;
+        else if (key == "instances") continue;  // files of older autotunes
+        else if (key == "layout") fields >> config.layout;
+        else throw std::runtime_error("unknown key " + key + " in " + path);
+        if (fields.fail())
+            throw std::runtime_error("bad value of " + key + " in " + path);
+    }
+    return true;
+}
+
+inline bool save_config(const std::string& path, const RuntimeConfig& config,
+                        const std::string& comment) {
+    std::ofstream out(path);
+    out << "# " << comment << "\n"
+        << "train_batch " << config.train_batch << "\n"
+        << "train_threads " << config.train_threads << "\n"
+        << "batch " << config.batch << "\n"
+        << "threads " << config.threads << "\n"
+        << "layout " << config.layout << "\n";
+    return (bool)out;
+}
+
+inline dnnl::memory::format_tag layout_tag(const std::string& layout) {
+    using tag = dnnl::memory::format_tag;
+    if (layout == "any") return tag::any;
+    if (layout == "nchw") return tag::nchw;
+    if (layout == "nhwc") return tag::nhwc;
+    throw std::runtime_error("unknown layout " + layout);
+}
+
+struct TuneCase {
+    dnnl::memory::dim batch;
+    int threads, instances;
+    std::string layout;
+};
+
+struct TuneResult {
+    TuneCase config;
+    double images_per_s, p50_ms, p99_ms;
+};
+
+// returns, on the calling instance thread, the function running one batch
+using TuneRunner = std::function<void()>;
+using TuneFactory = std::function<TuneRunner(const TuneCase&)>;
+
+// every (batch, threads, instances, layout) with threads a power of two or
+// all cores, instances 1 or as many as fit; configurations with more than
+// max_in_flight images at once are skipped (memory)
+inline std::vector<TuneCase> tune_grid(
+    int cores, const std::vector<dnnl::memory::dim>& batches,
+    const std::vector<std::string>& layouts, dnnl::memory::dim max_in_flight) {
+    std::vector<int> threads;
+    for (int t = 1; t < cores; t *= 2)
+        threads.push_back(t);
+    threads.push_back(cores);
+
+    std::vector<TuneCase> grid;
+    for (auto& layout : layouts)
+        for (auto batch : batches)
+            for (int t : threads) {
+                std::vector<int> counts = {1};
+                if (cores / t > 1) counts.push_back(cores / t);
+                for (int instances : counts)
+                    if (batch * instances <= max_in_flight)
+                        grid.push_back({batch, t, instances, layout});
+            }
+    return grid;
+}
+
+// instances of make(config), each pinned to its own `threads` cores and
+// built one at a time, then run together for `seconds`
+inline TuneResult measure(const TuneCase& config, const TuneFactory& make,
+                          double seconds) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    int ready = 0;
+    bool go = false;
+    std::chrono::steady_clock::time_point start;
+    std::vector<std::vector<double>> ms(config.instances);
+    std::vector<std::thread> instances;
+    for (int k = 0; k < config.instances; ++k)
+        instances.emplace_back([&, k]() {
+            cpu_set_t cores;
+            CPU_ZERO(&cores);
+            for (int i = k * config.threads;
+                 i < (k + 1) * config.threads && i < (int)cpus.size(); ++i)
+                CPU_SET(cpus[i], &cores);
+            pin_thread(cores);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            TuneRunner run = make(config);
+            lock.unlock();
+            run();  // warm-up: page faults, lazy kernels
+            run();
+            lock.lock();
+            ++ready;
+            cv.notify_all();
+            cv.wait(lock, [&] { return go; });
+            lock.unlock();
+
+            auto end = start + std::chrono::duration_cast<
+                                   std::chrono::steady_clock::duration>(
+                                   std::chrono::duration<double>(seconds));
+            while (std::chrono::steady_clock::now() < end) {
+                auto t0 = std::chrono::steady_clock::now();
+                run();
+                ms[k].push_back(std::chrono::duration<double, std::milli>(
+                                    std::chrono::steady_clock::now() - t0)
+                                    .count());
+            }
+        });
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return ready == config.instances; });
+        start = std::chrono::steady_clock::now();
+        go = true;
+        cv.notify_all();
+    }
+    for (auto& t : instances)
+        t.join();
+    double wall = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+
+    std::vector<double> all;
+    for (auto& m : ms)
+        all.insert(all.end(), m.begin(), m.end());
+    std::sort(all.begin(), all.end());
+    TuneResult result = {config, 0, 0, 0};
+    if (all.empty()) return result;
+    result.images_per_s = all.size() * config.batch / wall;
+    result.p50_ms = all[all.size() / 2];
+    result.p99_ms = all[std::min(all.size() - 1, all.size() * 99 / 100)];
+    return result;
+}
+
+// index of the highest throughput with p99 within slo_ms, -1 if none
+inline int pick_best(const std::vector<TuneResult>& results, double slo_ms) {
+    int best = -1;
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (results[i].p99_ms > slo_ms) continue;
+        if (best < 0 || results[i].images_per_s > results[best].images_per_s)
+            best = i;
+    }
+    return best;
+}
+
+#endif